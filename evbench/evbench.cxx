@@ -0,0 +1,491 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+////////////////////// Eventing benchmark
+//
+// Subscribes N simulated control points to the RenderingControl
+// service of a running upmpdcli, changes the volume through the MPD
+// server (normally fakempd), and measures the time until each
+// subscriber gets the NOTIFY. The GENA listeners are plain sockets
+// on the loopback interface, served by a single poll() loop.
+//
+// The delay includes the upmpdcli MPD polling period, so upmpdcli
+// should be run with a short eventintervalms for meaningful numbers.
+// The spread (time between the first and last delivery of an event)
+// does not depend on it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+static long long nowus()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int tcpConnect(const string& host, int port)
+{
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	char sport[20];
+	sprintf(sport, "%d", port);
+	if (getaddrinfo(host.c_str(), sport, &hints, &res) != 0)
+		return -1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+static bool sendAll(int fd, const string& data)
+{
+	const char *cp = data.data();
+	size_t remain = data.size();
+	while (remain > 0) {
+		ssize_t n = send(fd, cp, remain, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		cp += n;
+		remain -= n;
+	}
+	return true;
+}
+
+// Send an HTTP request and read the response until the connection
+// closes.
+static bool httpRequest(const string& host, int port, const string& request,
+						string& response)
+{
+	int fd = tcpConnect(host, port);
+	if (fd < 0)
+		return false;
+	bool ok = sendAll(fd, request);
+	response.clear();
+	char buf[4096];
+	ssize_t n;
+	while (ok && (n = recv(fd, buf, sizeof(buf), 0)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ok = false;
+			break;
+		}
+		response.append(buf, n);
+	}
+	close(fd);
+	return ok;
+}
+
+// Case-insensitive header lookup
+static string httpHeader(const string& response, const string& name)
+{
+	string::size_type hend = response.find("\r\n\r\n");
+	string lower(response, 0, hend);
+	transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	string key = "\r\n" + name + ":";
+	transform(key.begin(), key.end(), key.begin(), ::tolower);
+	string::size_type pos = lower.find(key);
+	if (pos == string::npos)
+		return string();
+	pos += key.size();
+	string::size_type eol = response.find("\r\n", pos);
+	string value(response, pos, eol - pos);
+	value.erase(0, value.find_first_not_of(" \t"));
+	return value;
+}
+
+static bool parseUrl(const string& url, string& host, int *port, string& path)
+{
+	if (url.compare(0, 7, "http://"))
+		return false;
+	string::size_type slash = url.find('/', 7);
+	string hostport(url, 7, slash == string::npos ? string::npos : slash - 7);
+	path = slash == string::npos ? "/" : url.substr(slash);
+	string::size_type colon = hostport.find(':');
+	host = hostport.substr(0, colon);
+	*port = colon == string::npos ? 80 : atoi(hostport.c_str() + colon + 1);
+	return !host.empty();
+}
+
+// Find the eventSubURL for a service in a device description
+static string eventUrl(const string& description, const string& service)
+{
+	string::size_type pos = description.find(service);
+	if (pos == string::npos)
+		return string();
+	pos = description.find("<eventSubURL>", pos);
+	if (pos == string::npos)
+		return string();
+	pos += strlen("<eventSubURL>");
+	string::size_type end = description.find("</eventSubURL>", pos);
+	return description.substr(pos, end - pos);
+}
+
+// A simulated control point
+struct Subscriber {
+	Subscriber() : lfd(-1), cfd(-1), port(0), lastvolume(-1), gotat(0) {}
+	int lfd;        // Listening socket
+	int cfd;        // Current NOTIFY connection
+	int port;
+	string sid;
+	string inbuf;
+	int lastvolume; // From the last NOTIFY
+	long long gotat;
+};
+
+static bool listenLocal(Subscriber& sub)
+{
+	sub.lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sub.lfd < 0)
+		return false;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	socklen_t len = sizeof(addr);
+	if (bind(sub.lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(sub.lfd, 5) < 0 ||
+		getsockname(sub.lfd, (struct sockaddr *)&addr, &len) < 0) {
+		return false;
+	}
+	sub.port = ntohs(addr.sin_port);
+	return true;
+}
+
+// The Volume value from a RenderingControl NOTIFY body, or -1
+static int volumeFromEvent(const string& body)
+{
+	string::size_type pos = body.find("Volume ");
+	if (pos == string::npos)
+		return -1;
+	pos = body.find("val=", pos);
+	if (pos == string::npos)
+		return -1;
+	pos = body.find_first_of("0123456789", pos);
+	if (pos == string::npos)
+		return -1;
+	return atoi(body.c_str() + pos);
+}
+
+// Process NOTIFY traffic for up to timeoutms. Returns when all the
+// subscribers have seen the target volume.
+static void serveEvents(vector<Subscriber>& subs, int target, int timeoutms)
+{
+	long long deadline = nowus() + timeoutms * 1000LL;
+	vector<struct pollfd> pfds;
+	for (;;) {
+		unsigned int done = 0;
+		pfds.clear();
+		for (unsigned int i = 0; i < subs.size(); i++) {
+			if (subs[i].lastvolume == target)
+				done++;
+			struct pollfd pfd;
+			pfd.fd = subs[i].cfd >= 0 ? subs[i].cfd : subs[i].lfd;
+			pfd.events = POLLIN;
+			pfds.push_back(pfd);
+		}
+		long long remain = (deadline - nowus()) / 1000;
+		if (done == subs.size() || remain <= 0)
+			return;
+		if (poll(&pfds[0], pfds.size(), int(remain)) <= 0)
+			continue;
+		for (unsigned int i = 0; i < subs.size(); i++) {
+			if (!(pfds[i].revents & (POLLIN|POLLHUP|POLLERR)))
+				continue;
+			Subscriber& sub = subs[i];
+			if (sub.cfd < 0) {
+				sub.cfd = accept(sub.lfd, 0, 0);
+				sub.inbuf.clear();
+				continue;
+			}
+			char buf[8192];
+			ssize_t n = recv(sub.cfd, buf, sizeof(buf), 0);
+			if (n > 0)
+				sub.inbuf.append(buf, n);
+			string::size_type hend = sub.inbuf.find("\r\n\r\n");
+			bool complete = false;
+			if (hend != string::npos) {
+				string clen = httpHeader(sub.inbuf, "Content-Length");
+				complete = !clen.empty() && 
+					sub.inbuf.size() >= hend + 4 + atoi(clen.c_str());
+			}
+			if (complete || n <= 0) {
+				long long now = nowus();
+				if (complete) {
+					sendAll(sub.cfd, "HTTP/1.1 200 OK\r\n"
+							"Content-Length: 0\r\n\r\n");
+					int volume = volumeFromEvent(sub.inbuf.substr(hend));
+					if (volume >= 0) {
+						sub.lastvolume = volume;
+						sub.gotat = now;
+					}
+				}
+				close(sub.cfd);
+				sub.cfd = -1;
+			}
+		}
+	}
+}
+
+// Ticks of CPU time used by a process, or -1
+static long long processTicks(int pid)
+{
+	char fn[50];
+	sprintf(fn, "/proc/%d/stat", pid);
+	FILE *fp = fopen(fn, "r");
+	if (fp == 0)
+		return -1;
+	char buf[1024];
+	size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+	fclose(fp);
+	buf[n] = 0;
+	// Fields 14 and 15 (utime, stime), counted after the command name
+	char *cp = strrchr(buf, ')');
+	if (cp == 0)
+		return -1;
+	unsigned long utime, stime;
+	if (sscanf(cp + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			   &utime, &stime) != 2)
+		return -1;
+	return utime + stime;
+}
+
+static double pcms(const vector<long long>& sorted, double pc)
+{
+	size_t idx = size_t(sorted.size() * pc / 100.0);
+	if (idx >= sorted.size())
+		idx = sorted.size() - 1;
+	return sorted[idx] / 1000.0;
+}
+
+static char *thisprog;
+static char usage [] =
+			" [-n subscribers] [-e events] [-m mpdhost:port] [-p pid]\n"
+			"  [-x maxp99ms] descriptionurl\n"
+			"   Measure the event delivery delay of a running upmpdcli\n"
+			"   (descriptionurl is like http://127.0.0.1:49152/description.xml)\n"
+			" -n subscribers : simulated control points (1-200, default 10)\n"
+			" -e events : count of volume changes (default 50)\n"
+			" -m host:port : MPD server (default localhost:6600)\n"
+			" -p pid : upmpdcli process id, for measuring the CPU time\n"
+			" -x ms : report a regression (and exit with status 2) if the\n"
+			"   delivery delay 99th percentile is above this\n"
+			"  \n\n"
+			;
+static void
+Usage(void)
+{
+	fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+	exit(1);
+}
+static int	   op_flags;
+#define OPT_MOINS 0x1
+#define OPT_n	  0x2
+#define OPT_e	  0x4
+#define OPT_m	  0x8
+#define OPT_p	  0x10
+#define OPT_x	  0x20
+
+int main(int argc, char *argv[])
+{
+	int nsubs = 10;
+	int nevents = 50;
+	string mpdhost("localhost");
+	int mpdport = 6600;
+	int pid = 0;
+	double maxp99 = 0;
+
+	thisprog = argv[0];
+	argc--; argv++;
+
+	while (argc > 0 && **argv == '-') {
+		(*argv)++;
+		if (!(**argv))
+			Usage();
+		while (**argv)
+			switch (*(*argv)++) {
+			case 'n':	op_flags |= OPT_n; if (argc < 2)  Usage();
+				nsubs = atoi(*(++argv)); argc--; goto b1;
+			case 'e':	op_flags |= OPT_e; if (argc < 2)  Usage();
+				nevents = atoi(*(++argv)); argc--; goto b1;
+			case 'm': {
+				op_flags |= OPT_m; if (argc < 2)  Usage();
+				string hp(*(++argv)); argc--;
+				string::size_type colon = hp.find(':');
+				mpdhost = hp.substr(0, colon);
+				if (colon != string::npos)
+					mpdport = atoi(hp.c_str() + colon + 1);
+				goto b1;
+			}
+			case 'p':	op_flags |= OPT_p; if (argc < 2)  Usage();
+				pid = atoi(*(++argv)); argc--; goto b1;
+			case 'x':	op_flags |= OPT_x; if (argc < 2)  Usage();
+				maxp99 = atof(*(++argv)); argc--; goto b1;
+			default: Usage();	break;
+			}
+	b1: argc--; argv++;
+	}
+	if (argc != 1 || nsubs < 1 || nsubs > 200 || nevents < 1)
+		Usage();
+
+	string host, path;
+	int port;
+	if (!parseUrl(argv[0], host, &port, path))
+		Usage();
+	string response;
+	if (!httpRequest(host, port, "GET " + path + " HTTP/1.0\r\nHOST: " + 
+					 host + "\r\n\r\n", response)) {
+		fprintf(stderr, "Can't fetch %s\n", argv[0]);
+		return 1;
+	}
+	string evturl = eventUrl(response, "service:RenderingControl");
+	if (evturl.empty()) {
+		fprintf(stderr, "No RenderingControl service in description\n");
+		return 1;
+	}
+
+	int mpdfd = tcpConnect(mpdhost, mpdport);
+	if (mpdfd < 0) {
+		fprintf(stderr, "Can't connect to MPD at %s:%d\n", mpdhost.c_str(), 
+				mpdport);
+		return 1;
+	}
+	FILE *mpdin = fdopen(dup(mpdfd), "r");
+	char line[1024];
+	if (fgets(line, sizeof(line), mpdin) == 0 || strncmp(line, "OK MPD", 6)) {
+		fprintf(stderr, "Bad MPD greeting\n");
+		return 1;
+	}
+
+	vector<Subscriber> subs(nsubs);
+	for (int i = 0; i < nsubs; i++) {
+		if (!listenLocal(subs[i])) {
+			fprintf(stderr, "Can't create listener\n");
+			return 1;
+		}
+		char req[1024];
+		sprintf(req, "SUBSCRIBE %s HTTP/1.1\r\nHOST: %s:%d\r\n"
+				"CALLBACK: <http://127.0.0.1:%d/>\r\nNT: upnp:event\r\n"
+				"TIMEOUT: Second-1800\r\nContent-Length: 0\r\n"
+				"Connection: close\r\n\r\n", 
+				evturl.c_str(), host.c_str(), port, subs[i].port);
+		if (!httpRequest(host, port, req, response) ||
+			(subs[i].sid = httpHeader(response, "SID")).empty()) {
+			fprintf(stderr, "Subscription %d failed\n", i);
+			return 1;
+		}
+	}
+	// Get the initial events out of the way
+	serveEvents(subs, -2, 2000);
+
+	vector<long long> delays, spreads;
+	int lost = 0;
+	long long ticks0 = pid ? processTicks(pid) : -1;
+	for (int ev = 0; ev < nevents; ev++) {
+		int volume = 10 + (ev % 2) * 50 + ev % 40;
+		sprintf(line, "setvol %d\n", volume);
+		sendAll(mpdfd, line);
+		if (fgets(line, sizeof(line), mpdin) == 0 || strncmp(line, "OK", 2)) {
+			fprintf(stderr, "MPD setvol failed\n");
+			return 1;
+		}
+		long long start = nowus();
+		serveEvents(subs, volume, 5000);
+		long long first = -1, last = -1;
+		for (int i = 0; i < nsubs; i++) {
+			if (subs[i].lastvolume != volume) {
+				lost++;
+				continue;
+			}
+			long long delay = subs[i].gotat - start;
+			delays.push_back(delay);
+			if (first < 0 || delay < first)
+				first = delay;
+			if (delay > last)
+				last = delay;
+		}
+		if (first >= 0)
+			spreads.push_back(last - first);
+	}
+	long long ticks1 = pid ? processTicks(pid) : -1;
+
+	for (int i = 0; i < nsubs; i++) {
+		char req[1024];
+		sprintf(req, "UNSUBSCRIBE %s HTTP/1.1\r\nHOST: %s:%d\r\nSID: %s\r\n"
+				"Content-Length: 0\r\nConnection: close\r\n\r\n", 
+				evturl.c_str(), host.c_str(), port, subs[i].sid.c_str());
+		httpRequest(host, port, req, response);
+		close(subs[i].lfd);
+	}
+	fclose(mpdin);
+	close(mpdfd);
+
+	if (delays.empty()) {
+		fprintf(stderr, "No events received\n");
+		return 1;
+	}
+	sort(delays.begin(), delays.end());
+	sort(spreads.begin(), spreads.end());
+	printf("%d subscribers, %d events, %d deliveries, %d lost\n", nsubs,
+		   nevents, int(delays.size()), lost);
+	printf("Delivery delay ms: p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+		   pcms(delays, 50), pcms(delays, 90), pcms(delays, 99),
+		   delays.back() / 1000.0);
+	printf("Spread ms (first to last subscriber): p50 %.2f p90 %.2f "
+		   "max %.2f\n", pcms(spreads, 50), pcms(spreads, 90), 
+		   spreads.back() / 1000.0);
+	if (ticks0 >= 0 && ticks1 >= 0) {
+		printf("upmpdcli CPU per event: %.3f ms\n", 
+			   (ticks1 - ticks0) * 1000.0 / sysconf(_SC_CLK_TCK) / nevents);
+	}
+	int ret = 0;
+	if (maxp99 > 0 && pcms(delays, 99) > maxp99) {
+		printf("REGRESSION: p99 delay %.2f ms above %.2f ms\n",
+			   pcms(delays, 99), maxp99);
+		ret = 2;
+	}
+	if (lost) {
+		printf("REGRESSION: %d events not delivered\n", lost);
+		ret = 2;
+	}
+	return ret;
+}
@@ -0,0 +1,214 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+////////////////////// Content Directory client benchmark
+//
+// Browses all the containers under the root of a media server
+// (normally fakecds) and runs a search, reporting the throughput and
+// the memory used per entry. The DIDL parsing cost is also measured
+// separately, on locally generated data of the same size.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <malloc.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#include "libupnpp/upnpplib.hxx"
+#include "libupnpp/discovery.hxx"
+#include "libupnpp/cdirectory.hxx"
+#include "libupnpp/cdircontent.hxx"
+#include "libupnpp/metrics.hxx"
+#include "fakedidl.hxx"
+
+// Bytes allocated from the heap
+static long long heapInUse()
+{
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks;
+#elif defined(__GLIBC__)
+	struct mallinfo mi = mallinfo();
+	return mi.uordblks;
+#else
+	return 0;
+#endif
+}
+
+static double median(vector<double>& values)
+{
+	sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+// Time the parsing of a locally generated document with nitems
+// entries. Returns microseconds per entry.
+static double parseCost(int nitems, unsigned int fields, int iterations)
+{
+	vector<int> sizes(1, nitems);
+	FakeContent content(sizes, "http://192.168.1.1:49152");
+	string didl;
+	int returned, total;
+	content.browse("c0", 0, 0, UPnPDirContent::filterFor(fields), didl,
+				   &returned, &total);
+	vector<double> times;
+	for (int i = 0; i < iterations; i++) {
+		UPnPDirContent dirbuf;
+		long long start = Metrics::now();
+		dirbuf.parse(didl, fields);
+		times.push_back((Metrics::now() - start) / 1000.0);
+	}
+	return median(times) / (nitems ? nitems : 1);
+}
+
+static char *thisprog;
+static char usage [] =
+			" [-f friendlyname] [-n iterations] [-F fields] [-s criteria]\n"
+			"   Measure readDir() and search() against a media server\n"
+			" -f friendlyname : server name (default FakeCDS)\n"
+			" -n iterations : runs for each measure (default 3)\n"
+			" -F fields : UPnPDirContent::PropFlags mask, in hex (default ffff)\n"
+			" -s criteria : search criteria (default 'dc:title contains \"7\"')\n"
+			"  \n\n"
+			;
+static void
+Usage(void)
+{
+	fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+	exit(1);
+}
+static int	   op_flags;
+#define OPT_MOINS 0x1
+#define OPT_f	  0x2
+#define OPT_n	  0x4
+#define OPT_F	  0x8
+#define OPT_s	  0x10
+
+int main(int argc, char *argv[])
+{
+	string friendlyname("FakeCDS");
+	int iterations = 3;
+	unsigned int fields = UPnPDirContent::PF_ALL;
+	string criteria("dc:title contains \"7\"");
+
+	thisprog = argv[0];
+	argc--; argv++;
+
+	while (argc > 0 && **argv == '-') {
+		(*argv)++;
+		if (!(**argv))
+			Usage();
+		while (**argv)
+			switch (*(*argv)++) {
+			case 'f':	op_flags |= OPT_f; if (argc < 2)  Usage();
+				friendlyname = *(++argv); argc--; goto b1;
+			case 'n':	op_flags |= OPT_n; if (argc < 2)  Usage();
+				iterations = atoi(*(++argv)); argc--; goto b1;
+			case 'F':	op_flags |= OPT_F; if (argc < 2)  Usage();
+				fields = strtoul(*(++argv), 0, 16); argc--; goto b1;
+			case 's':	op_flags |= OPT_s; if (argc < 2)  Usage();
+				criteria = *(++argv); argc--; goto b1;
+			default: Usage();	break;
+			}
+	b1: argc--; argv++;
+	}
+	if (argc != 0 || iterations < 1)
+		Usage();
+
+	LibUPnP *mylib = LibUPnP::getLibUPnP();
+	if (!mylib) {
+		fprintf(stderr, "Can't get LibUPnP\n");
+		return 1;
+	}
+	if (!mylib->ok()) {
+		fprintf(stderr, "Lib init failed: %s\n",
+				mylib->errAsString("main", mylib->getInitError()).c_str());
+		return 1;
+	}
+	UPnPDeviceDirectory *superdir = UPnPDeviceDirectory::getTheDir();
+	if (!superdir || !superdir->ok()) {
+		fprintf(stderr, "Discovery services startup failed\n");
+		return 1;
+	}
+	ContentDirectoryService server;
+	int tries = 10;
+	while (!superdir->getServer(friendlyname, server)) {
+		if (--tries == 0) {
+			fprintf(stderr, "Server %s not found\n", friendlyname.c_str());
+			return 1;
+		}
+		sleep(1);
+	}
+
+	UPnPDirContent root;
+	int code = server.readDir("0", root, fields);
+	if (code) {
+		fprintf(stderr, "%s\n", LibUPnP::errAsString("readDir", code).c_str());
+		return 1;
+	}
+
+	printf("%-10s %8s %10s %12s %10s %10s\n", "container", "items",
+		   "readDir ms", "items/s", "bytes/item", "parse us");
+	for (unsigned int ci = 0; ci < root.m_containers.size(); ci++) {
+		const string& id = root.m_containers[ci].m_id;
+		vector<double> times;
+		int nitems = 0;
+		long long bytes = 0;
+		for (int i = 0; i < iterations; i++) {
+			long long heap = heapInUse();
+			UPnPDirContent dirbuf;
+			long long start = Metrics::now();
+			code = server.readDir(id, dirbuf, fields);
+			times.push_back((Metrics::now() - start) / 1e6);
+			if (code) {
+				fprintf(stderr, "%s\n", 
+						LibUPnP::errAsString("readDir", code).c_str());
+				return 1;
+			}
+			nitems = dirbuf.m_items.size() + dirbuf.m_containers.size();
+			bytes = heapInUse() - heap;
+		}
+		double ms = median(times);
+		printf("%-10s %8d %10.2f %12.0f %10.0f %10.3f\n", id.c_str(), nitems,
+			   ms, ms > 0 ? nitems * 1000.0 / ms : 0.0, 
+			   nitems ? double(bytes) / nitems : 0.0,
+			   parseCost(nitems, fields, iterations));
+	}
+
+	vector<double> times;
+	int nfound = 0;
+	for (int i = 0; i < iterations; i++) {
+		UPnPDirContent dirbuf;
+		long long start = Metrics::now();
+		code = server.search("0", criteria, dirbuf, fields);
+		times.push_back((Metrics::now() - start) / 1e6);
+		if (code) {
+			fprintf(stderr, "%s\n", 
+					LibUPnP::errAsString("search", code).c_str());
+			return 1;
+		}
+		nfound = dirbuf.m_items.size();
+	}
+	double ms = median(times);
+	printf("Search [%s]: %d items, %.2f ms, %.0f items/s\n", criteria.c_str(),
+		   nfound, ms, ms > 0 ? nfound * 1000.0 / ms : 0.0);
+	return 0;
+}
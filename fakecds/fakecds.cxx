@@ -0,0 +1,412 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+////////////////////// Fake Content Directory server for load testing
+//
+// A MediaServer device serving a synthetic library (see fakedidl.hxx)
+// through libupnpp's UpnpDevice. Container sizes, the maximum count
+// of entries returned by a Browse or Search call, and an artificial
+// latency can be set, for benchmarking the control point side
+// (e.g. with cdsbench).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+using namespace std;
+using namespace std::placeholders;
+
+#include "libupnpp/upnpplib.hxx"
+#include "libupnpp/soaphelp.hxx"
+#include "libupnpp/device.hxx"
+#include "libupnpp/log.hxx"
+#include "fakedidl.hxx"
+
+static const char *description = 
+	"<?xml version=\"1.0\"?>\n"
+	"<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n"
+	"  <specVersion><major>1</major><minor>0</minor></specVersion>\n"
+	"  <device>\n"
+	"    <deviceType>urn:schemas-upnp-org:device:MediaServer:1"
+	"</deviceType>\n"
+	"    <friendlyName>@FRIENDLYNAME@</friendlyName>\n"
+	"    <manufacturer>JF Light Industries</manufacturer>\n"
+	"    <modelName>FakeCDS</modelName>\n"
+	"    <modelNumber>1.0</modelNumber>\n"
+	"    <UDN>uuid:@UUID@</UDN>\n"
+	"    <serviceList>\n"
+	"      <service>\n"
+	"        <serviceType>urn:schemas-upnp-org:service:ContentDirectory:1"
+	"</serviceType>\n"
+	"        <serviceId>urn:upnp-org:serviceId:ContentDirectory</serviceId>\n"
+	"        <SCPDURL>/ContentDirectory.xml</SCPDURL>\n"
+	"        <controlURL>/ctl/ContentDirectory</controlURL>\n"
+	"        <eventSubURL>/evt/ContentDirectory</eventSubURL>\n"
+	"      </service>\n"
+	"    </serviceList>\n"
+	"  </device>\n"
+	"</root>\n";
+
+#define SCPDARG(NAME, DIR, VAR)											\
+	"      <argument><name>" NAME "</name><direction>" DIR "</direction>" \
+	"<relatedStateVariable>" VAR "</relatedStateVariable></argument>\n"
+#define SCPDVAR(NAME, TYPE)												\
+	"    <stateVariable sendEvents=\"no\"><name>" NAME "</name>"		\
+	"<dataType>" TYPE "</dataType></stateVariable>\n"
+#define BROWSEARGS												\
+	SCPDARG("Filter", "in", "A_ARG_TYPE_Filter")				\
+	SCPDARG("StartingIndex", "in", "A_ARG_TYPE_Index")			\
+	SCPDARG("RequestedCount", "in", "A_ARG_TYPE_Count")			\
+	SCPDARG("SortCriteria", "in", "A_ARG_TYPE_SortCriteria")	\
+	SCPDARG("Result", "out", "A_ARG_TYPE_Result")				\
+	SCPDARG("NumberReturned", "out", "A_ARG_TYPE_Count")		\
+	SCPDARG("TotalMatches", "out", "A_ARG_TYPE_Count")			\
+	SCPDARG("UpdateID", "out", "A_ARG_TYPE_UpdateID")
+
+static const char *cdsscpd = 
+	"<?xml version=\"1.0\"?>\n"
+	"<scpd xmlns=\"urn:schemas-upnp-org:service-1-0\">\n"
+	"  <specVersion><major>1</major><minor>0</minor></specVersion>\n"
+	"  <actionList>\n"
+	"    <action><name>GetSearchCapabilities</name><argumentList>\n"
+	SCPDARG("SearchCaps", "out", "SearchCapabilities")
+	"    </argumentList></action>\n"
+	"    <action><name>GetSortCapabilities</name><argumentList>\n"
+	SCPDARG("SortCaps", "out", "SortCapabilities")
+	"    </argumentList></action>\n"
+	"    <action><name>GetSystemUpdateID</name><argumentList>\n"
+	SCPDARG("Id", "out", "SystemUpdateID")
+	"    </argumentList></action>\n"
+	"    <action><name>Browse</name><argumentList>\n"
+	SCPDARG("ObjectID", "in", "A_ARG_TYPE_ObjectID")
+	SCPDARG("BrowseFlag", "in", "A_ARG_TYPE_BrowseFlag")
+	BROWSEARGS
+	"    </argumentList></action>\n"
+	"    <action><name>Search</name><argumentList>\n"
+	SCPDARG("ContainerID", "in", "A_ARG_TYPE_ObjectID")
+	SCPDARG("SearchCriteria", "in", "A_ARG_TYPE_SearchCriteria")
+	BROWSEARGS
+	"    </argumentList></action>\n"
+	"  </actionList>\n"
+	"  <serviceStateTable>\n"
+	SCPDVAR("SearchCapabilities", "string")
+	SCPDVAR("SortCapabilities", "string")
+	"    <stateVariable sendEvents=\"yes\"><name>SystemUpdateID</name>"
+	"<dataType>ui4</dataType></stateVariable>\n"
+	SCPDVAR("A_ARG_TYPE_ObjectID", "string")
+	SCPDVAR("A_ARG_TYPE_Result", "string")
+	SCPDVAR("A_ARG_TYPE_SearchCriteria", "string")
+	"    <stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_BrowseFlag</name>"
+	"<dataType>string</dataType><allowedValueList>"
+	"<allowedValue>BrowseMetadata</allowedValue>"
+	"<allowedValue>BrowseDirectChildren</allowedValue>"
+	"</allowedValueList></stateVariable>\n"
+	SCPDVAR("A_ARG_TYPE_Filter", "string")
+	SCPDVAR("A_ARG_TYPE_SortCriteria", "string")
+	SCPDVAR("A_ARG_TYPE_Index", "ui4")
+	SCPDVAR("A_ARG_TYPE_Count", "ui4")
+	SCPDVAR("A_ARG_TYPE_UpdateID", "ui4")
+	"  </serviceStateTable>\n"
+	"</scpd>\n";
+
+static const string serviceIdCDS("urn:upnp-org:serviceId:ContentDirectory");
+
+class FakeCDS : public UpnpDevice {
+public:
+	FakeCDS(const string& deviceid, 
+			const unordered_map<string, string>& xmlfiles,
+			const FakeContent& content, int maxslice, int latencyms);
+
+	virtual bool getEventData(bool all, const string& serviceid, 
+							  vector<string>& names, 
+							  vector<string>& values);
+	int browse(const SoapArgs& sc, SoapData& data);
+	int search(const SoapArgs& sc, SoapData& data);
+	int getSearchCapabilities(const SoapArgs& sc, SoapData& data);
+	int getSortCapabilities(const SoapArgs& sc, SoapData& data);
+	int getSystemUpdateID(const SoapArgs& sc, SoapData& data);
+
+private:
+	void delay();
+	// Retrieve the StartingIndex and RequestedCount arguments,
+	// applying the slice size limit.
+	bool sliceArgs(const SoapArgs& sc, int *offset, int *count);
+	void addResult(SoapData& data, const string& didl, int returned,
+				   int total);
+
+	const FakeContent& m_content;
+	int m_maxslice;
+	int m_latencyms;
+};
+
+FakeCDS::FakeCDS(const string& deviceid, 
+				 const unordered_map<string, string>& xmlfiles,
+				 const FakeContent& content, int maxslice, int latencyms)
+	: UpnpDevice(deviceid, xmlfiles), m_content(content),
+	  m_maxslice(maxslice), m_latencyms(latencyms)
+{
+	addServiceType(serviceIdCDS,
+				   "urn:schemas-upnp-org:service:ContentDirectory:1");
+	{	auto bound = bind(&FakeCDS::browse, this, _1, _2);
+		addActionMapping("Browse", bound);
+	}
+	{	auto bound = bind(&FakeCDS::search, this, _1, _2);
+		addActionMapping("Search", bound);
+	}
+	{	auto bound = bind(&FakeCDS::getSearchCapabilities, this, _1, _2);
+		addActionMapping("GetSearchCapabilities", bound);
+	}
+	{	auto bound = bind(&FakeCDS::getSortCapabilities, this, _1, _2);
+		addActionMapping("GetSortCapabilities", bound);
+	}
+	{	auto bound = bind(&FakeCDS::getSystemUpdateID, this, _1, _2);
+		addActionMapping("GetSystemUpdateID", bound);
+	}
+}
+
+// The content never changes
+bool FakeCDS::getEventData(bool all, const string& serviceid, 
+						   vector<string>& names, vector<string>& values)
+{
+	if (!all)
+		return true;
+	names.push_back("SystemUpdateID");
+	values.push_back("1");
+	return true;
+}
+
+// Note that the device callbacks are serialized, so the latency
+// also delays any concurrent request.
+void FakeCDS::delay()
+{
+	if (m_latencyms > 0)
+		usleep(m_latencyms * 1000);
+}
+
+bool FakeCDS::sliceArgs(const SoapArgs& sc, int *offset, int *count)
+{
+	map<string, string>::const_iterator it;
+	it = sc.args.find("StartingIndex");
+	if (it == sc.args.end())
+		return false;
+	*offset = atoi(it->second.c_str());
+	it = sc.args.find("RequestedCount");
+	if (it == sc.args.end())
+		return false;
+	*count = atoi(it->second.c_str());
+	if (m_maxslice > 0 && (*count <= 0 || *count > m_maxslice))
+		*count = m_maxslice;
+	return true;
+}
+
+void FakeCDS::addResult(SoapData& data, const string& didl, int returned,
+						int total)
+{
+	char buf[30];
+	data.addarg("Result", didl);
+	sprintf(buf, "%d", returned);
+	data.addarg("NumberReturned", buf);
+	sprintf(buf, "%d", total);
+	data.addarg("TotalMatches", buf);
+	data.addarg("UpdateID", "1");
+}
+
+int FakeCDS::browse(const SoapArgs& sc, SoapData& data)
+{
+	delay();
+	map<string, string>::const_iterator objit = sc.args.find("ObjectID");
+	map<string, string>::const_iterator flagit = sc.args.find("BrowseFlag");
+	map<string, string>::const_iterator filtit = sc.args.find("Filter");
+	int offset, count;
+	if (objit == sc.args.end() || flagit == sc.args.end() ||
+		!sliceArgs(sc, &offset, &count)) {
+		return UPNP_E_INVALID_PARAM;
+	}
+	string filter = filtit == sc.args.end() ? "*" : filtit->second;
+
+	string didl;
+	int returned, total;
+	if (flagit->second == "BrowseMetadata") {
+		if (!m_content.metadata(objit->second, filter, didl))
+			return UPNP_E_INVALID_PARAM;
+		returned = total = 1;
+	} else if (flagit->second == "BrowseDirectChildren") {
+		if (!m_content.browse(objit->second, offset, count, filter, didl,
+							  &returned, &total))
+			return UPNP_E_INVALID_PARAM;
+	} else {
+		return UPNP_E_INVALID_PARAM;
+	}
+	addResult(data, didl, returned, total);
+	return UPNP_E_SUCCESS;
+}
+
+int FakeCDS::search(const SoapArgs& sc, SoapData& data)
+{
+	delay();
+	map<string, string>::const_iterator objit = sc.args.find("ContainerID");
+	map<string, string>::const_iterator critit = 
+		sc.args.find("SearchCriteria");
+	map<string, string>::const_iterator filtit = sc.args.find("Filter");
+	int offset, count;
+	if (objit == sc.args.end() || critit == sc.args.end() ||
+		!sliceArgs(sc, &offset, &count)) {
+		return UPNP_E_INVALID_PARAM;
+	}
+	string filter = filtit == sc.args.end() ? "*" : filtit->second;
+	string didl;
+	int returned, total;
+	if (!m_content.search(objit->second, critit->second, offset, count,
+						  filter, didl, &returned, &total))
+		return UPNP_E_INVALID_PARAM;
+	addResult(data, didl, returned, total);
+	return UPNP_E_SUCCESS;
+}
+
+int FakeCDS::getSearchCapabilities(const SoapArgs& sc, SoapData& data)
+{
+	data.addarg("SearchCaps", "dc:title");
+	return UPNP_E_SUCCESS;
+}
+
+int FakeCDS::getSortCapabilities(const SoapArgs& sc, SoapData& data)
+{
+	data.addarg("SortCaps", "");
+	return UPNP_E_SUCCESS;
+}
+
+int FakeCDS::getSystemUpdateID(const SoapArgs& sc, SoapData& data)
+{
+	data.addarg("Id", "1");
+	return UPNP_E_SUCCESS;
+}
+
+static string regsub1(const string& sexp, const string& input, 
+					  const string& repl)
+{
+	string out(input);
+	string::size_type pos = out.find(sexp);
+	if (pos != string::npos)
+		out.replace(pos, sexp.size(), repl);
+	return out;
+}
+
+static char *thisprog;
+static char usage [] =
+			" [-f friendlyname] [-s size,size...] [-m maxslice] [-l ms]\n"
+			"   Fake UPnP Media Server with a synthetic library\n"
+			" -f friendlyname : default FakeCDS\n"
+			" -s sizes : comma-separated item counts for the containers under\n"
+			"   the root (1 to 100000, default 1,100,1000,10000)\n"
+			" -m maxslice : maximum entries returned by one Browse/Search\n"
+			"   (default 0: no limit)\n"
+			" -l ms : latency added to each Browse/Search call\n"
+			"  \n\n"
+			;
+static void
+Usage(void)
+{
+	fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+	exit(1);
+}
+static int	   op_flags;
+#define OPT_MOINS 0x1
+#define OPT_f	  0x2
+#define OPT_s	  0x4
+#define OPT_m	  0x8
+#define OPT_l	  0x10
+
+int main(int argc, char *argv[])
+{
+	string friendlyname("FakeCDS");
+	string ssizes("1,100,1000,10000");
+	int maxslice = 0;
+	int latencyms = 0;
+
+	thisprog = argv[0];
+	argc--; argv++;
+
+	while (argc > 0 && **argv == '-') {
+		(*argv)++;
+		if (!(**argv))
+			Usage();
+		while (**argv)
+			switch (*(*argv)++) {
+			case 'f':	op_flags |= OPT_f; if (argc < 2)  Usage();
+				friendlyname = *(++argv); argc--; goto b1;
+			case 's':	op_flags |= OPT_s; if (argc < 2)  Usage();
+				ssizes = *(++argv); argc--; goto b1;
+			case 'm':	op_flags |= OPT_m; if (argc < 2)  Usage();
+				maxslice = atoi(*(++argv)); argc--; goto b1;
+			case 'l':	op_flags |= OPT_l; if (argc < 2)  Usage();
+				latencyms = atoi(*(++argv)); argc--; goto b1;
+			default: Usage();	break;
+			}
+	b1: argc--; argv++;
+	}
+	if (argc != 0)
+		Usage();
+
+	vector<int> sizes;
+	for (const char *cp = ssizes.c_str(); *cp; ) {
+		char *cp1;
+		long size = strtol(cp, &cp1, 10);
+		if (cp1 == cp || size < 1 || size > FakeContent::maxItems)
+			Usage();
+		sizes.push_back(int(size));
+		cp = *cp1 == ',' ? cp1 + 1 : cp1;
+		if (*cp1 != ',' && *cp1 != 0)
+			Usage();
+	}
+
+	LibUPnP *mylib = LibUPnP::getLibUPnP(true);
+	if (!mylib) {
+		fprintf(stderr, "Can't get LibUPnP\n");
+		return 1;
+	}
+	if (!mylib->ok()) {
+		fprintf(stderr, "Lib init failed: %s\n",
+				mylib->errAsString("main", mylib->getInitError()).c_str());
+		return 1;
+	}
+	char baseurl[200];
+	sprintf(baseurl, "http://%s:%d", mylib->host().c_str(), mylib->port());
+	FakeContent content(sizes, baseurl);
+
+	string UUID = LibUPnP::makeDevUUID(friendlyname);
+	string desc = regsub1("@UUID@", description, UUID);
+	desc = regsub1("@FRIENDLYNAME@", desc, friendlyname);
+	unordered_map<string, string> xmlfiles;
+	xmlfiles["description.xml"] = desc;
+	xmlfiles["ContentDirectory.xml"] = cdsscpd;
+	FakeCDS device(string("uuid:") + UUID, xmlfiles, content, maxslice,
+				   latencyms);
+	if (!device.ok()) {
+		fprintf(stderr, "Device initialization failed\n");
+		return 1;
+	}
+	fprintf(stderr, "%s: serving %d containers at %s\n", 
+			friendlyname.c_str(), content.containerCount(), baseurl);
+
+	UpnpDevice::eventloop();
+	return 0;
+}
@@ -0,0 +1,272 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "libupnpp/soaphelp.hxx"
+#include "fakedidl.hxx"
+
+static const char *didlhead = 
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+	"<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" "
+	"xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+	"xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
+	"xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\">\n";
+static const char *didltail = "</DIDL-Lite>\n";
+
+static const char *genres[] = {"Rock", "Jazz", "Classical", "Folk", 
+							   "Electronic", "Soundtrack"};
+static const int ngenres = sizeof(genres) / sizeof(genres[0]);
+
+// Tracks per album
+static const int albumtracks = 12;
+
+FakeContent::FakeContent(const vector<int>& sizes, const string& baseurl)
+	: m_baseurl(baseurl)
+{
+	for (unsigned int i = 0; i < sizes.size(); i++) {
+		int size = sizes[i];
+		if (size < 0)
+			size = 0;
+		if (size > maxItems)
+			size = maxItems;
+		m_sizes.push_back(size);
+	}
+}
+
+unsigned int FakeContent::filterProps(const string& filter)
+{
+	if (filter.empty() || filter.find('*') != string::npos)
+		return P_ALL;
+	unsigned int props = 0;
+	if (filter.find("upnp:artist") != string::npos)
+		props |= P_ARTIST;
+	if (filter.find("upnp:album") != string::npos)
+		props |= P_ALBUM;
+	if (filter.find("upnp:albumArtURI") != string::npos)
+		props |= P_ART;
+	if (filter.find("upnp:genre") != string::npos)
+		props |= P_GENRE;
+	if (filter.find("upnp:originalTrackNumber") != string::npos)
+		props |= P_TRACKNO;
+	if (filter.find("res") != string::npos)
+		props |= P_RES;
+	return props;
+}
+
+// Some titles and artists have characters which need escaping, as
+// real ones do.
+static string titleFor(int ii)
+{
+	char buf[100];
+	sprintf(buf, ii % 10 == 9 ? "Track %d (Live & <Unplugged>)" : "Track %d",
+			ii);
+	return buf;
+}
+
+static string artistFor(int ii)
+{
+	if (ii % 25 == 3)
+		return "Simon & Garfunkel";
+	char buf[100];
+	sprintf(buf, "Artist %d", ii / albumtracks % 50);
+	return buf;
+}
+
+int FakeContent::parseId(const string& objid, int *ii) const
+{
+	*ii = -1;
+	if (objid == "0")
+		return -1;
+	if (objid.size() < 2 || objid[0] != 'c')
+		return -2;
+	char *cp;
+	long ci = strtol(objid.c_str() + 1, &cp, 10);
+	if (cp == objid.c_str() + 1 || ci < 0 || ci >= long(m_sizes.size()))
+		return -2;
+	if (*cp == 0)
+		return int(ci);
+	if (*cp != '/')
+		return -2;
+	char *cp1;
+	long item = strtol(cp + 1, &cp1, 10);
+	if (cp1 == cp + 1 || *cp1 != 0 || item < 0 || item >= m_sizes[ci])
+		return -2;
+	*ii = int(item);
+	return int(ci);
+}
+
+void FakeContent::appendContainer(string& out, int ci) const
+{
+	char buf[200];
+	if (ci < 0) {
+		sprintf(buf, "<container id=\"0\" parentID=\"-1\" restricted=\"1\" "
+				"childCount=\"%d\">", int(m_sizes.size()));
+		out += buf;
+		out += "<dc:title>Root</dc:title>";
+	} else {
+		sprintf(buf, "<container id=\"c%d\" parentID=\"0\" restricted=\"1\" "
+				"childCount=\"%d\"><dc:title>%d items</dc:title>", ci,
+				m_sizes[ci], m_sizes[ci]);
+		out += buf;
+	}
+	out += "<upnp:class>object.container.storageFolder</upnp:class>"
+		"</container>\n";
+}
+
+void FakeContent::appendItem(string& out, int ci, int ii, 
+							 unsigned int props) const
+{
+	char buf[300];
+	sprintf(buf, "<item id=\"c%d/%d\" parentID=\"c%d\" restricted=\"1\">"
+			"<dc:title>", ci, ii, ci);
+	out += buf;
+	xmlquote_append(out, titleFor(ii));
+	out += "</dc:title>"
+		"<upnp:class>object.item.audioItem.musicTrack</upnp:class>";
+	if (props & P_ARTIST) {
+		out += "<upnp:artist>";
+		xmlquote_append(out, artistFor(ii));
+		out += "</upnp:artist><dc:creator>";
+		xmlquote_append(out, artistFor(ii));
+		out += "</dc:creator>";
+	}
+	int album = ii / albumtracks;
+	if (props & P_ALBUM) {
+		sprintf(buf, "<upnp:album>Album %d</upnp:album>", album);
+		out += buf;
+	}
+	if (props & P_GENRE) {
+		out += "<upnp:genre>";
+		out += genres[album % ngenres];
+		out += "</upnp:genre>";
+	}
+	if (props & P_TRACKNO) {
+		sprintf(buf, "<upnp:originalTrackNumber>%d"
+				"</upnp:originalTrackNumber>", ii % albumtracks + 1);
+		out += buf;
+	}
+	if (props & P_ART) {
+		out += "<upnp:albumArtURI>";
+		out += m_baseurl;
+		sprintf(buf, "/art/c%d/%d.jpg</upnp:albumArtURI>", ci, album);
+		out += buf;
+	}
+	if (props & P_RES) {
+		int secs = 120 + (ii * 37) % 300;
+		sprintf(buf, "<res protocolInfo=\"http-get:*:audio/flac:"
+				"DLNA.ORG_OP=01;DLNA.ORG_FLAGS=01700000000000000000000000000000"
+				"\" size=\"%d\" duration=\"%d:%02d:%02d.000\" "
+				"bitrate=\"176400\" sampleFrequency=\"44100\" "
+				"bitsPerSample=\"16\" nrAudioChannels=\"2\">",
+				secs * 88200, secs / 3600, secs / 60 % 60, secs % 60);
+		out += buf;
+		out += m_baseurl;
+		sprintf(buf, "/media/c%d/%d.flac</res>", ci, ii);
+		out += buf;
+	}
+	out += "</item>\n";
+}
+
+bool FakeContent::browse(const string& objid, int offset, int count,
+						 const string& filter, string& didl,
+						 int *returned, int *total) const
+{
+	int ii;
+	int ci = parseId(objid, &ii);
+	if (ci < -1 || ii >= 0)
+		return false;
+	*total = ci == -1 ? int(m_sizes.size()) : m_sizes[ci];
+	if (offset < 0)
+		offset = 0;
+	int end = count > 0 && offset + count < *total ? offset + count : *total;
+	*returned = end > offset ? end - offset : 0;
+	unsigned int props = filterProps(filter);
+
+	didl = didlhead;
+	// About the size of an item with all the properties
+	didl.reserve(didl.size() + *returned * 900);
+	for (int i = offset; i < end; i++) {
+		if (ci == -1)
+			appendContainer(didl, i);
+		else
+			appendItem(didl, ci, i, props);
+	}
+	didl += didltail;
+	return true;
+}
+
+bool FakeContent::metadata(const string& objid, const string& filter,
+						   string& didl) const
+{
+	int ii;
+	int ci = parseId(objid, &ii);
+	if (ci < -1)
+		return false;
+	didl = didlhead;
+	if (ii >= 0)
+		appendItem(didl, ci, ii, filterProps(filter));
+	else
+		appendContainer(didl, ci);
+	didl += didltail;
+	return true;
+}
+
+bool FakeContent::search(const string& objid, const string& criteria,
+						 int offset, int count, const string& filter,
+						 string& didl, int *returned, int *total) const
+{
+	int ii;
+	int ci = parseId(objid, &ii);
+	if (ci < -1 || ii >= 0)
+		return false;
+	string what;
+	string::size_type pos = criteria.find("contains");
+	if (criteria.find("dc:title") != string::npos && pos != string::npos) {
+		string::size_type q1 = criteria.find('"', pos);
+		string::size_type q2 = q1 == string::npos ? q1 : 
+			criteria.find('"', q1 + 1);
+		if (q2 != string::npos)
+			what = criteria.substr(q1 + 1, q2 - q1 - 1);
+	}
+	unsigned int props = filterProps(filter);
+	if (offset < 0)
+		offset = 0;
+
+	didl = didlhead;
+	*total = *returned = 0;
+	int cfirst = ci == -1 ? 0 : ci;
+	int clast = ci == -1 ? int(m_sizes.size()) - 1 : ci;
+	for (int c = cfirst; c <= clast; c++) {
+		for (int i = 0; i < m_sizes[c]; i++) {
+			if (!what.empty() && titleFor(i).find(what) == string::npos)
+				continue;
+			if (*total >= offset && (count <= 0 || *returned < count)) {
+				appendItem(didl, c, i, props);
+				(*returned)++;
+			}
+			(*total)++;
+		}
+	}
+	didl += didltail;
+	return true;
+}
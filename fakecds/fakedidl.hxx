@@ -0,0 +1,97 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _FAKEDIDL_H_X_INCLUDED_
+#define _FAKEDIDL_H_X_INCLUDED_
+
+#include <string>
+#include <vector>
+
+/**
+ * Synthetic media library for the fake Content Directory server and
+ * the benchmark, which uses it to measure the DIDL parsing cost
+ * without the network.
+ *
+ * The root container ("0") holds one container per configured size,
+ * with ids "c0", "c1"..., each holding the specified count of music
+ * tracks, with ids "c0/0", "c0/1"... The metadata is generated from
+ * the item numbers, so that nothing is stored.
+ */
+class FakeContent {
+public:
+	/** Maximum container size */
+	enum {maxItems = 100000};
+
+	/**
+	 * @param sizes item counts for the containers
+	 * @param baseurl prefix for the res and album art URLs
+	 *	   (e.g. http://192.168.1.2:49152)
+	 */
+	FakeContent(const std::vector<int>& sizes, const std::string& baseurl);
+
+	/**
+	 * Produce the DIDL-Lite document for a slice of a container's
+	 * children.
+	 *
+	 * @param objid the container id
+	 * @param offset the index of the first child
+	 * @param count the maximum count of children, 0 for all
+	 * @param filter the Browse Filter argument ("*" or a list of
+	 *	   properties). dc:title and upnp:class are always included.
+	 * @param[out] didl the document
+	 * @param[out] returned the count of children in the document
+	 * @param[out] total the count of children in the container
+	 * @return false if the container does not exist
+	 */
+	bool browse(const std::string& objid, int offset, int count,
+				const std::string& filter, std::string& didl,
+				int *returned, int *total) const;
+
+	/** Produce the DIDL-Lite document for a single object */
+	bool metadata(const std::string& objid, const std::string& filter,
+				  std::string& didl) const;
+
+	/**
+	 * Search the items in a container (or all, for "0"). Only
+	 * 'dc:title contains "xx"' criteria are actually looked at,
+	 * anything else matches all the items.
+	 * Parameters as for browse()
+	 */
+	bool search(const std::string& objid, const std::string& criteria,
+				int offset, int count, const std::string& filter,
+				std::string& didl, int *returned, int *total) const;
+
+	int containerCount() const {return int(m_sizes.size());}
+	int containerSize(int i) const {return m_sizes[i];}
+
+private:
+	// Property selection from the filter
+	enum {P_ARTIST = 0x1, P_ALBUM = 0x2, P_GENRE = 0x4, P_TRACKNO = 0x8,
+		  P_ART = 0x10, P_RES = 0x20, P_ALL = 0xff};
+	static unsigned int filterProps(const std::string& filter);
+	void appendContainer(std::string& out, int ci) const;
+	void appendItem(std::string& out, int ci, int ii,
+					unsigned int props) const;
+	static void appendTitle(std::string& out, int ii);
+	// Parse an object id. Returns -1 for the root, or the container
+	// index with ii set to -1 for a container or the item index.
+	int parseId(const std::string& objid, int *ii) const;
+
+	std::vector<int> m_sizes;
+	std::string m_baseurl;
+};
+
+#endif /* _FAKEDIDL_H_X_INCLUDED_ */
@@ -0,0 +1,521 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+////////////////////// Fake MPD server for testing and benchmarking
+//
+// Speaks the subset of the MPD protocol used by MPDCli, on a local TCP
+// port, with a synthetic queue. Command latencies, protocol errors and
+// connection drops can be injected, so that upmpdcli can be exercised
+// reproducibly without a real MPD or audio hardware.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+using namespace std;
+
+static const char *protoversion = "0.18.0";
+
+struct Song {
+	unsigned int id;
+	string uri;
+	string title;
+	string artist;
+	string album;
+	int track;
+	int seconds;
+};
+
+// Player state, shared by all the connections, under stlock
+static pthread_mutex_t stlock = PTHREAD_MUTEX_INITIALIZER;
+static vector<Song> queue;
+static unsigned int nextid = 1;
+static unsigned int qversion = 1;
+static int curpos = -1;
+enum PlayState {ST_STOP, ST_PLAY, ST_PAUSE};
+static PlayState pstate = ST_STOP;
+static int volume = 50;
+static bool repeat, randomflag, single, consume;
+// Elapsed play time for the current song: ms accumulated before the
+// last start, and the start time (ms)
+static long long elapsedbase;
+static long long playstart;
+
+// Fault injection and latency settings. Read-only after startup.
+static int dfltlatencyms;
+static map<string, int> cmdlatencyms;
+static unsigned int closeevery;
+static unsigned int errorevery;
+// Total command count, for the injection periods
+static unsigned int cmdcount;
+
+static long long nowms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void addSong(const string& uri)
+{
+	Song song;
+	song.id = nextid++;
+	song.uri = uri;
+	char buf[100];
+	sprintf(buf, "Title %u", song.id);
+	song.title = buf;
+	sprintf(buf, "Artist %u", song.id % 7);
+	song.artist = buf;
+	sprintf(buf, "Album %u", song.id % 13);
+	song.album = buf;
+	song.track = song.id % 20 + 1;
+	song.seconds = 120 + song.id % 240;
+	queue.push_back(song);
+}
+
+// Elapsed ms in the current song. Called with the lock held. Moves
+// to the next song when the current one is done.
+static long long elapsed()
+{
+	if (pstate != ST_PLAY || curpos < 0)
+		return elapsedbase;
+	long long el = elapsedbase + nowms() - playstart;
+	while (curpos >= 0 && el >= queue[curpos].seconds * 1000LL) {
+		el -= queue[curpos].seconds * 1000LL;
+		if (curpos + 1 < int(queue.size())) {
+			curpos++;
+		} else if (repeat) {
+			curpos = 0;
+		} else {
+			curpos = -1;
+			pstate = ST_STOP;
+			el = 0;
+		}
+		elapsedbase = el;
+		playstart = nowms();
+	}
+	return el;
+}
+
+static void startPlay(int pos)
+{
+	curpos = pos;
+	pstate = ST_PLAY;
+	elapsedbase = 0;
+	playstart = nowms();
+}
+
+static void songOut(ostringstream& out, const Song& song, int pos)
+{
+	out << "file: " << song.uri << "\n" <<
+		"Last-Modified: 2014-01-01T00:00:00Z\n" <<
+		"Time: " << song.seconds << "\n" <<
+		"Artist: " << song.artist << "\n" <<
+		"Album: " << song.album << "\n" <<
+		"Title: " << song.title << "\n" <<
+		"Track: " << song.track << "\n" <<
+		"Genre: Test\n" <<
+		"Pos: " << pos << "\n" <<
+		"Id: " << song.id << "\n";
+}
+
+static int findId(unsigned int id)
+{
+	for (unsigned int i = 0; i < queue.size(); i++)
+		if (queue[i].id == id)
+			return i;
+	return -1;
+}
+
+// Split a command line into words, handling the double quotes and
+// backslash escapes used by libmpdclient.
+static void splitCommand(const string& line, vector<string>& words)
+{
+	words.clear();
+	string::size_type i = 0;
+	while (i < line.size()) {
+		while (i < line.size() && (line[i] == ' ' || line[i] == '\t'))
+			i++;
+		if (i == line.size())
+			break;
+		string word;
+		if (line[i] == '"') {
+			for (i++; i < line.size() && line[i] != '"'; i++) {
+				if (line[i] == '\\' && i + 1 < line.size())
+					i++;
+				word += line[i];
+			}
+			i++;
+		} else {
+			while (i < line.size() && line[i] != ' ' && line[i] != '\t')
+				word += line[i++];
+		}
+		words.push_back(word);
+	}
+}
+
+// Execute one command, producing the response text without the
+// final OK. Returns false with an error message for an ACK.
+static bool execute(const vector<string>& words, ostringstream& out,
+					string& error)
+{
+	const string& cmd = words[0];
+	unsigned int nargs = words.size() - 1;
+	int arg1 = nargs > 0 ? atoi(words[1].c_str()) : -1;
+
+	pthread_mutex_lock(&stlock);
+	bool ok = true;
+	long long el = elapsed();
+	if (cmd == "status") {
+		out << "volume: " << volume << "\n" <<
+			"repeat: " << repeat << "\n" <<
+			"random: " << randomflag << "\n" <<
+			"single: " << single << "\n" <<
+			"consume: " << consume << "\n" <<
+			"playlist: " << qversion << "\n" <<
+			"playlistlength: " << queue.size() << "\n" <<
+			"mixrampdb: 0.000000\n" <<
+			"state: " << (pstate == ST_PLAY ? "play" : 
+						  pstate == ST_PAUSE ? "pause" : "stop") << "\n";
+		if (curpos >= 0) {
+			out << "song: " << curpos << "\n" <<
+				"songid: " << queue[curpos].id << "\n";
+			if (pstate != ST_STOP) {
+				char buf[50];
+				sprintf(buf, "%lld.%03lld", el / 1000, el % 1000);
+				out << "time: " << el / 1000 << ":" << 
+					queue[curpos].seconds << "\n" <<
+					"elapsed: " << buf << "\n" <<
+					"bitrate: 320\n" << "audio: 44100:16:2\n";
+			}
+			if (curpos + 1 < int(queue.size())) {
+				out << "nextsong: " << curpos + 1 << "\n" <<
+					"nextsongid: " << queue[curpos + 1].id << "\n";
+			}
+		}
+	} else if (cmd == "currentsong") {
+		if (curpos >= 0)
+			songOut(out, queue[curpos], curpos);
+	} else if (cmd == "playlistinfo" && nargs == 1) {
+		if (arg1 < 0 || arg1 >= int(queue.size())) {
+			ok = false;
+			error = "Bad song index";
+		} else {
+			songOut(out, queue[arg1], arg1);
+		}
+	} else if (cmd == "playlistid" && nargs == 1) {
+		int pos = findId(arg1);
+		if (pos < 0) {
+			ok = false;
+			error = "No such song";
+		} else {
+			songOut(out, queue[pos], pos);
+		}
+	} else if (cmd == "addid" && nargs >= 1) {
+		addSong(words[1]);
+		if (nargs == 2) {
+			int pos = atoi(words[2].c_str());
+			if (pos >= 0 && pos < int(queue.size()) - 1) {
+				Song song = queue.back();
+				queue.pop_back();
+				queue.insert(queue.begin() + pos, song);
+				if (curpos >= pos)
+					curpos++;
+			}
+		}
+		qversion++;
+		out << "Id: " << nextid - 1 << "\n";
+	} else if (cmd == "deleteid" && nargs == 1) {
+		int pos = findId(arg1);
+		if (pos < 0) {
+			ok = false;
+			error = "No such song";
+		} else {
+			queue.erase(queue.begin() + pos);
+			if (pos == curpos) {
+				pstate = ST_STOP;
+				curpos = pos < int(queue.size()) ? pos : -1;
+			} else if (pos < curpos) {
+				curpos--;
+			}
+			qversion++;
+		}
+	} else if (cmd == "play") {
+		int pos = nargs == 1 ? arg1 : (curpos >= 0 ? curpos : 0);
+		if (pos < 0 || pos >= int(queue.size())) {
+			ok = false;
+			error = "Bad song index";
+		} else if (nargs == 0 && pstate == ST_PAUSE) {
+			pstate = ST_PLAY;
+			playstart = nowms();
+		} else {
+			startPlay(pos);
+		}
+	} else if (cmd == "pause") {
+		if (pstate == ST_PLAY) {
+			elapsedbase = el;
+			pstate = ST_PAUSE;
+		} else if (pstate == ST_PAUSE) {
+			pstate = ST_PLAY;
+			playstart = nowms();
+		}
+	} else if (cmd == "stop") {
+		pstate = ST_STOP;
+		elapsedbase = 0;
+	} else if (cmd == "next" || cmd == "previous") {
+		int pos = curpos + (cmd == "next" ? 1 : -1);
+		if (curpos < 0 || pos < 0 || pos >= int(queue.size())) {
+			ok = false;
+			error = "Not playing";
+		} else {
+			startPlay(pos);
+		}
+	} else if (cmd == "seek" && nargs == 2) {
+		if (arg1 < 0 || arg1 >= int(queue.size())) {
+			ok = false;
+			error = "Bad song index";
+		} else {
+			startPlay(arg1);
+			elapsedbase = atoi(words[2].c_str()) * 1000LL;
+		}
+	} else if (cmd == "setvol" && nargs == 1) {
+		volume = arg1 < 0 ? 0 : arg1 > 100 ? 100 : arg1;
+	} else if (cmd == "repeat" && nargs == 1) {
+		repeat = arg1 != 0;
+	} else if (cmd == "random" && nargs == 1) {
+		randomflag = arg1 != 0;
+	} else if (cmd == "single" && nargs == 1) {
+		single = arg1 != 0;
+	} else if (cmd == "consume" && nargs == 1) {
+		consume = arg1 != 0;
+	} else if (cmd == "password" || cmd == "ping") {
+	} else {
+		ok = false;
+		error = "unknown command \"" + cmd + "\"";
+	}
+	pthread_mutex_unlock(&stlock);
+	return ok;
+}
+
+static bool sendAll(int fd, const string& data)
+{
+	const char *cp = data.data();
+	size_t remain = data.size();
+	while (remain > 0) {
+		ssize_t n = send(fd, cp, remain, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		cp += n;
+		remain -= n;
+	}
+	return true;
+}
+
+static void *connthread(void *arg)
+{
+	int fd = (int)(long)arg;
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (!sendAll(fd, string("OK MPD ") + protoversion + "\n")) {
+		close(fd);
+		return 0;
+	}
+
+	string inbuf;
+	vector<string> words;
+	char buf[4096];
+	for (;;) {
+		string::size_type nl = inbuf.find('\n');
+		if (nl == string::npos) {
+			ssize_t n = recv(fd, buf, sizeof(buf), 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			inbuf.append(buf, n);
+			continue;
+		}
+		string line = inbuf.substr(0, nl);
+		inbuf.erase(0, nl + 1);
+		splitCommand(line, words);
+		if (words.empty())
+			continue;
+		if (words[0] == "close")
+			break;
+
+		unsigned int count = __sync_add_and_fetch(&cmdcount, 1);
+		if (closeevery && count % closeevery == 0) {
+			fprintf(stderr, "fakempd: closing connection on %s\n", 
+					words[0].c_str());
+			break;
+		}
+		map<string, int>::const_iterator it = cmdlatencyms.find(words[0]);
+		int latency = it == cmdlatencyms.end() ? dfltlatencyms : it->second;
+		if (latency > 0)
+			usleep(latency * 1000);
+
+		ostringstream out;
+		string error;
+		bool ok;
+		if (errorevery && count % errorevery == 0) {
+			ok = false;
+			error = "injected failure";
+		} else {
+			ok = execute(words, out, error);
+		}
+		if (ok) {
+			out << "OK\n";
+		} else {
+			out.str("");
+			// 50: ACK_ERROR_NO_EXIST. The command index is always 0
+			// as we don't do command lists.
+			out << "ACK [50@0] {" << words[0] << "} " << error << "\n";
+		}
+		if (!sendAll(fd, out.str()))
+			break;
+	}
+	close(fd);
+	return 0;
+}
+
+static char *thisprog;
+static char usage [] =
+			" [-p port] [-q count] [-l ms] [-L cmd=ms] [-c n] [-e n]\n"
+			"   Fake MPD server, listening on localhost\n"
+			" -p port : listen port (default 6600)\n"
+			" -q count : initial queue size (default 10)\n"
+			" -l ms : latency for all commands\n"
+			" -L cmd=ms : latency for the specified command (repeatable)\n"
+			" -c n : close the connection on every nth command\n"
+			" -e n : return an error for every nth command\n"
+			"  \n\n"
+			;
+static void
+Usage(void)
+{
+	fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+	exit(1);
+}
+static int	   op_flags;
+#define OPT_MOINS 0x1
+#define OPT_p	  0x2
+#define OPT_q	  0x4
+#define OPT_l	  0x8
+#define OPT_L	  0x10
+#define OPT_c	  0x20
+#define OPT_e	  0x40
+
+int main(int argc, char *argv[])
+{
+	int port = 6600;
+	int qsize = 10;
+
+	thisprog = argv[0];
+	argc--; argv++;
+
+	while (argc > 0 && **argv == '-') {
+		(*argv)++;
+		if (!(**argv))
+			Usage();
+		while (**argv)
+			switch (*(*argv)++) {
+			case 'p':	op_flags |= OPT_p; if (argc < 2)  Usage();
+				port = atoi(*(++argv)); argc--; goto b1;
+			case 'q':	op_flags |= OPT_q; if (argc < 2)  Usage();
+				qsize = atoi(*(++argv)); argc--; goto b1;
+			case 'l':	op_flags |= OPT_l; if (argc < 2)  Usage();
+				dfltlatencyms = atoi(*(++argv)); argc--; goto b1;
+			case 'L': {
+				op_flags |= OPT_L; if (argc < 2)  Usage();
+				string spec(*(++argv)); argc--;
+				string::size_type eq = spec.find('=');
+				if (eq == string::npos)
+					Usage();
+				cmdlatencyms[spec.substr(0, eq)] = 
+					atoi(spec.substr(eq + 1).c_str());
+				goto b1;
+			}
+			case 'c':	op_flags |= OPT_c; if (argc < 2)  Usage();
+				closeevery = atoi(*(++argv)); argc--; goto b1;
+			case 'e':	op_flags |= OPT_e; if (argc < 2)  Usage();
+				errorevery = atoi(*(++argv)); argc--; goto b1;
+			default: Usage();	break;
+			}
+	b1: argc--; argv++;
+	}
+	if (argc != 0)
+		Usage();
+
+	for (int i = 0; i < qsize; i++) {
+		char uri[100];
+		sprintf(uri, "fake/Album %d/track%02d.flac", (i / 10) % 13, i % 10);
+		addSong(uri);
+	}
+
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		perror("socket");
+		return 1;
+	}
+	int one = 1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(lfd, 20) < 0) {
+		perror("bind/listen");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		int fd = accept(lfd, 0, 0);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			return 1;
+		}
+		pthread_t thr;
+		if (pthread_create(&thr, 0, connthread, (void *)(long)fd)) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thr);
+	}
+	return 0;
+}
@@ -42,20 +42,69 @@ static void listmap(const map<string,string>& mp)
 }
 #endif
 
-static const char* upnptags[] = {
-	"upnp:artist",
-	"upnp:album",
-	"upnp:genre",
-	"upnp:originalTrackNumber",
-	"upnp:class",
+// The upnp: tags we look at, and the field selection flag for each
+static const struct UpnpTag {
+	const char *name;
+	unsigned int flag;
+} upnptags[] = {
+	{"upnp:artist", UPnPDirContent::PF_ARTIST},
+	{"upnp:album", UPnPDirContent::PF_ALBUM},
+	{"upnp:genre", UPnPDirContent::PF_GENRE},
+	{"upnp:originalTrackNumber", UPnPDirContent::PF_TRACKNO},
+	// Always needed to check the item type
+	{"upnp:class", 0},
 };
-static const int nupnptags = sizeof(upnptags) / sizeof(char*);
+static const int nupnptags = sizeof(upnptags) / sizeof(UpnpTag);
+
+// The res attributes we store (<res protocolInfo="http-get:*:audio/mpeg:*"
+// size="5171496" bitrate="24576" duration="00:03:35"
+// sampleFrequency="44100" nrAudioChannels="2">)
+static const char *resattrs[] = {
+	"protocolInfo",
+	"size",
+	"bitrate",
+	"duration",
+	"sampleFrequency",
+	"nrAudioChannels",
+};
+static const int nresattrs = sizeof(resattrs) / sizeof(char *);
+
+string UPnPDirContent::filterFor(unsigned int fields)
+{
+	if ((fields & PF_ALL) == PF_ALL)
+		return "*";
+
+	// id, parentID, restricted, dc:title and upnp:class are required
+	// properties and will be returned anyway, but some servers are
+	// happier with something in there.
+	string filter("dc:title,upnp:class");
+	for (int i = 0; i < nupnptags; i++) {
+		if (upnptags[i].flag & fields) {
+			filter += ",";
+			filter += upnptags[i].name;
+		}
+	}
+	if (fields & PF_RES) {
+		filter += ",res";
+		for (int i = 0; i < nresattrs; i++) {
+			filter += ",res@";
+			filter += resattrs[i];
+		}
+	}
+	return filter;
+}
 
 // An XML parser which builds directory contents from DIDL lite input.
+//
+// Only the properties selected by the fields mask are converted and
+// stored. Attributes are only looked at for the elements which need
+// them, we don't keep a map of attributes for each element on the
+// stack.
 class UPnPDirParser : public expatmm::inputRefXMLParser {
 public:
-	UPnPDirParser(UPnPDirContent& dir, const string& input)
-		: inputRefXMLParser(input), m_dir(dir)
+	UPnPDirParser(UPnPDirContent& dir, const string& input,
+				  unsigned int fields)
+		: inputRefXMLParser(input), m_dir(dir), m_fields(fields)
 		{
 			m_okitems["object.item.audioItem.musicTrack"] =
 				UPnPDirObject::audioItem_musicTrack;
@@ -69,33 +118,57 @@ protected:
 	public:
 		StackEl(const string& nm) : name(nm) {}
 		string name;
-		map<string,string> attributes;
 	};
 
+	void startObject(UPnPDirObject::ObjType tp, const XML_Char **attrs)
+		{
+			m_tobj.clear();
+			m_tobj.m_type = tp;
+			for (int i = 0; attrs[i] != 0; i += 2) {
+				if (!strcmp(attrs[i], "id")) {
+					m_tobj.m_id = attrs[i+1];
+				} else if (!strcmp(attrs[i], "parentID")) {
+					m_tobj.m_pid = attrs[i+1];
+				}
+			}
+		}
+
+	void startRes(const XML_Char **attrs)
+		{
+			// Absent attributes are stored as empty values
+			for (int j = 0; j < nresattrs; j++) {
+				const char *value = "";
+				for (int i = 0; attrs[i] != 0; i += 2) {
+					if (!strcmp(attrs[i], resattrs[j])) {
+						value = attrs[i+1];
+						break;
+					}
+				}
+				m_tobj.m_props[resattrs[j]] = value;
+			}
+		}
+
 	virtual void StartElement(const XML_Char *name, const XML_Char **attrs)
 		{
 			//cerr << "startElement: name [" << name << "]" << endl;
 
 			m_path.push_back(StackEl(name));
-			for (int i = 0; attrs[i] != 0; i += 2) {
-				m_path.back().attributes[attrs[i]] = attrs[i+1];
-			}
 
 			switch (name[0]) {
 			case 'c':
 				if (!strcmp(name, "container")) {
-					m_tobj.clear();
-					m_tobj.m_type = UPnPDirObject::container;
-					m_tobj.m_id = m_path.back().attributes["id"];
-					m_tobj.m_pid = m_path.back().attributes["parentID"];
+					startObject(UPnPDirObject::container, attrs);
 				}
 				break;
 			case 'i':
 				if (!strcmp(name, "item")) {
-					m_tobj.clear();
-					m_tobj.m_type = UPnPDirObject::item;
-					m_tobj.m_id = m_path.back().attributes["id"];
-					m_tobj.m_pid = m_path.back().attributes["parentID"];
+					startObject(UPnPDirObject::item, attrs);
+				}
+				break;
+			case 'r':
+				if ((m_fields & UPnPDirContent::PF_RES) &&
+					!strcmp(name, "res")) {
+					startRes(attrs);
 				}
 				break;
 			default:
@@ -140,42 +213,45 @@ protected:
 					//cerr << "Pushing item: " << m_tobj.m_title << endl;
 					m_dir.m_items.push_back(m_tobj);
 				}
-			} else if (!strcmp(name, "res")) {
-				// <res protocolInfo="http-get:*:audio/mpeg:*" size="5171496"
-				// bitrate="24576" duration="00:03:35" sampleFrequency="44100"
-				// nrAudioChannels="2">
-				string s;
-				s="protocolInfo";m_tobj.m_props[s] = m_path.back().attributes[s];
-				s="size";m_tobj.m_props[s] = m_path.back().attributes[s];
-				s="bitrate";m_tobj.m_props[s] = m_path.back().attributes[s];
-				s="duration";m_tobj.m_props[s] = m_path.back().attributes[s];
-				s="sampleFrequency";m_tobj.m_props[s] = m_path.back().attributes[s];
-				s="nrAudioChannels";m_tobj.m_props[s] = m_path.back().attributes[s];
 			}
 
 			m_path.pop_back();
 		}
 
+	// Append trimmed character data to the value
+	void appendData(string& value, const XML_Char *s, int len)
+		{
+			string str(s, len);
+			trimstring(str);
+			value += str;
+		}
+
 	virtual void CharacterData(const XML_Char *s, int len)
 		{
 			if (s == 0 || *s == 0)
 				return;
-			string str(s, len);
-			trimstring(str);
-			switch (m_path.back().name[0]) {
+			// Decide if we want the data before doing anything with it.
+			const string& name = m_path.back().name;
+			switch (name[0]) {
 			case 'd':
-				if (!m_path.back().name.compare("dc:title"))
-					m_tobj.m_title += str;
+				if (!name.compare("dc:title"))
+					appendData(m_tobj.m_title, s, len);
 				break;
 			case 'r':
-				if (!m_path.back().name.compare("res")) {
-					m_tobj.m_props["url"] += str;
+				if ((m_fields & UPnPDirContent::PF_RES) &&
+					!name.compare("res")) {
+					appendData(m_tobj.m_props["url"], s, len);
 				}
 				break;
 			case 'u':
 				for (int i = 0; i < nupnptags; i++) {
-					if (!m_path.back().name.compare(upnptags[i])) {
-						m_tobj.m_props[upnptags[i]] += str;
+					if (!name.compare(upnptags[i].name)) {
+						if (upnptags[i].flag == 0 ||
+							(upnptags[i].flag & m_fields)) {
+							appendData(m_tobj.m_props[upnptags[i].name],
+									   s, len);
+						}
+						break;
 					}
 				}
 				break;
@@ -186,11 +262,12 @@ private:
 	vector<StackEl> m_path;
 	UPnPDirObject m_tobj;
 	map<string, UPnPDirObject::ItemClass> m_okitems;
+	unsigned int m_fields;
 };
 
-bool UPnPDirContent::parse(const std::string& input)
+bool UPnPDirContent::parse(const std::string& input, unsigned int fields)
 {
-	UPnPDirParser parser(*this, input);
+	UPnPDirParser parser(*this, input, fields);
 	return parser.Parse();
 }
 /* Local Variables: */
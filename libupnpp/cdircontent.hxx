@@ -100,6 +100,23 @@ public:
 	std::vector<UPnPDirObject> m_containers;
 	std::vector<UPnPDirObject> m_items;
 
+	/** Selection of the object properties to be requested and parsed.
+	 *
+	 * The object and parent ids, the title and the class are always
+	 * processed, they are needed to build a valid object. Using a
+	 * restricted set (e.g. 0 for just displaying names) reduces the
+	 * volume of data sent by the server and the parsing work.
+	 */
+	enum PropFlags {
+		PF_ARTIST = 0x1,
+		PF_ALBUM = 0x2,
+		PF_GENRE = 0x4,
+		PF_TRACKNO = 0x8,
+		// res element: url and attributes (protocolInfo, size, etc.)
+		PF_RES = 0x10,
+		PF_ALL = 0xffff
+	};
+
 	/**
 	 * Parse from DIDL-Lite XML data.
 	 *
@@ -112,8 +129,16 @@ public:
 	 * chunks are from the same container, but given that UPnP Ids are
 	 * actually global, nothing really bad will happen if you mix
 	 * up...
+	 *
+	 * @param didltext the DIDL-Lite XML document.
+	 * @param fields an OR of PropFlags values, selecting the properties
+	 *	   which will be stored in UPnPDirObject::m_props.
 	 */
-	bool parse(const std::string& didltext);
+	bool parse(const std::string& didltext, unsigned int fields = PF_ALL);
+
+	/** Compute the Browse/Search "Filter" argument matching a field
+	 * selection. This returns "*" for PF_ALL */
+	static std::string filterFor(unsigned int fields);
 };
 
 #endif /* _UPNPDIRCONTENT_H_X_INCLUDED_ */
@@ -23,6 +23,8 @@
 #include <iostream>
 #include <set>
 #include <vector>
+#include <algorithm>
+#include <future>
 using std::string;
 using std::cerr;
 using std::endl;
@@ -38,6 +40,7 @@ using std::set;
 #include "ixmlwrap.hxx"
 #include "cdirectory.hxx"
 #include "cdircontent.hxx"
+#include "stealqueue.hxx"
 
 class DirBResFree {
 public:
@@ -56,7 +59,8 @@ public:
 
 int ContentDirectoryService::readDirSlice(const string& objectId, int offset,
 										  int count, UPnPDirContent& dirbuf,
-										  int *didreadp, int *totalp)
+										  int *didreadp, int *totalp,
+										  unsigned int fields)
 {
 	PLOGDEB("CDService::readDirSlice: objId [%s] offset %d count %d\n",
 			objectId.c_str(), offset, count);
@@ -75,12 +79,13 @@ int ContentDirectoryService::readDirSlice(const string& objectId, int offset,
 	char ofbuf[100], cntbuf[100];
 	sprintf(ofbuf, "%d", offset);
 	sprintf(cntbuf, "%d", count);
+	string filter = UPnPDirContent::filterFor(fields);
 	int argcnt = 6;
 	// Some devices require an empty SortCriteria, else bad params
 	request = UpnpMakeAction("Browse", m_serviceType.c_str(), argcnt,
 							 "ObjectID", objectId.c_str(),
 							 "BrowseFlag", "BrowseDirectChildren",
-							 "Filter", "*",
+							 "Filter", filter.c_str(),
 							 "SortCriteria", "",
 							 "StartingIndex", ofbuf,
 							 "RequestedCount", cntbuf,
@@ -124,14 +129,40 @@ int ContentDirectoryService::readDirSlice(const string& objectId, int offset,
 	cerr << " result " << tbuf << endl;
 #endif
 
-	dirbuf.parse(tbuf);
+	dirbuf.parse(tbuf, fields);
 	*didreadp = didread;
 	return UPNP_E_SUCCESS;
 }
 
 
+// Read the entries in [offset, end) into dirbuf, with as many requests as
+// needed (the server may return less than we ask for).
+int ContentDirectoryService::readDirRange(const string& objectId, int offset,
+										  int end, UPnPDirContent& dirbuf,
+										  unsigned int fields)
+{
+	int total = end;
+	while (offset < end) {
+		int count = -1;
+		int error = readDirSlice(objectId, offset, 
+								 std::min(m_rdreqcnt, end - offset), dirbuf,
+								 &count, &total, fields);
+		if (error != UPNP_E_SUCCESS)
+			return error;
+		if (count <= 0) {
+			PLOGERR("CDService::readDirRange: objId [%s]: server returned "
+					"%d entries at offset %d, expected up to %d\n",
+					objectId.c_str(), count, offset, end);
+			break;
+		}
+		offset += count;
+	}
+	return UPNP_E_SUCCESS;
+}
+
 int ContentDirectoryService::readDir(const string& objectId,
-									 UPnPDirContent& dirbuf)
+									 UPnPDirContent& dirbuf,
+									 unsigned int fields)
 {
 	PLOGDEB("CDService::readDir: url [%s] type [%s] udn [%s] objId [%s]\n",
 			m_actionURL.c_str(), m_serviceType.c_str(), m_deviceId.c_str(),
@@ -140,10 +171,55 @@ int ContentDirectoryService::readDir(const string& objectId,
 	int offset = 0;
 	int total = 1000;// Updated on first read.
 
-	while (offset < total) {
-		int count;
-		int error = readDirSlice(objectId, offset, m_rdreqcnt, dirbuf,
-								 &count, &total);
+	// The first slice gives us the total count
+	int count;
+	int error = readDirSlice(objectId, offset, m_rdreqcnt, dirbuf,
+							 &count, &total, fields);
+	if (error != UPNP_E_SUCCESS)
+		return error;
+	offset += count;
+
+	// If the server honoured our slice size and there are more to
+	// read, fetch the remaining slices in parallel. Each task reads
+	// its range into its own buffer, and we merge in order. Don't do
+	// this if we're running in a pool thread ourselves.
+	TaskPool *pool = TaskPool::getShared();
+	if (count == m_rdreqcnt && offset < total && pool && !pool->inWorker()) {
+		vector<UPnPDirContent> slices((total - offset + m_rdreqcnt - 1) /
+									  m_rdreqcnt);
+		vector<std::future<int> > results;
+		for (unsigned int i = 0; i < slices.size(); i++) {
+			int start = offset + i * m_rdreqcnt;
+			int end = std::min(start + m_rdreqcnt, total);
+			UPnPDirContent *slice = &slices[i];
+			results.push_back(pool->submit([=]() {
+						return readDirRange(objectId, start, end,
+											*slice, fields);
+					}));
+		}
+		// Wait for all the tasks before returning, even in case of
+		// error: they use our data.
+		for (unsigned int i = 0; i < results.size(); i++) {
+			int ret = results[i].get();
+			if (ret != UPNP_E_SUCCESS && error == UPNP_E_SUCCESS)
+				error = ret;
+		}
+		if (error != UPNP_E_SUCCESS)
+			return error;
+		for (unsigned int i = 0; i < slices.size(); i++) {
+			dirbuf.m_containers.insert(dirbuf.m_containers.end(),
+									   slices[i].m_containers.begin(),
+									   slices[i].m_containers.end());
+			dirbuf.m_items.insert(dirbuf.m_items.end(),
+								  slices[i].m_items.begin(),
+								  slices[i].m_items.end());
+		}
+		return UPNP_E_SUCCESS;
+	}
+
+	while (count > 0 && offset < total) {
+		error = readDirSlice(objectId, offset, m_rdreqcnt, dirbuf,
+							 &count, &total, fields);
 		if (error != UPNP_E_SUCCESS)
 			return error;
 
@@ -155,7 +231,8 @@ int ContentDirectoryService::readDir(const string& objectId,
 
 int ContentDirectoryService::search(const string& objectId,
 									const string& ss,
-									UPnPDirContent& dirbuf)
+									UPnPDirContent& dirbuf,
+									unsigned int fields)
 {
 	PLOGDEB("CDService::search: url [%s] type [%s] udn [%s] objid [%s] "
 			"search [%s]\n",
@@ -175,6 +252,7 @@ int ContentDirectoryService::search(const string& objectId,
 
 	int offset = 0;
 	int total = 1000;// Updated on first read.
+	string filter = UPnPDirContent::filterFor(fields);
 
 	while (offset < total) {
 		DirBResFree cleaner(&request, &response);
@@ -186,7 +264,7 @@ int ContentDirectoryService::search(const string& objectId,
 			"Search", m_serviceType.c_str(), argcnt,
 			"ContainerID", objectId.c_str(),
 			"SearchCriteria", ss.c_str(),
-			"Filter", "*",
+			"Filter", filter.c_str(),
 			"SortCriteria", "",
 			"StartingIndex", ofbuf,
 			"RequestedCount", "0", // Setting a value here gets twonky into fits
@@ -232,7 +310,7 @@ int ContentDirectoryService::search(const string& objectId,
 		cerr << " result " << tbuf << endl;
 #endif
 
-		dirbuf.parse(tbuf);
+		dirbuf.parse(tbuf, fields);
 	}
 
 	return UPNP_E_SUCCESS;
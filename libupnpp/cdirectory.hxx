@@ -67,16 +67,25 @@ public:
 	ContentDirectoryService() {}
 
 	/** Read a container's children list into dirbuf.
+	 *
+	 * After the first slice, the remaining ones are requested in
+	 * parallel through the shared task pool, if the server respects
+	 * the requested slice size.
 	 *
 	 * @param objectId the UPnP object Id for the container. Root has Id "0"
 	 * @param[out] dirbuf stores the entries we read.
+	 * @param fields the object properties we need (an OR of
+	 *	 UPnPDirContent::PropFlags). This is used to build the
+	 *	 Browse "Filter" argument, and to restrict the parsing.
 	 * @return UPNP_E_SUCCESS for success, else libupnp error code.
 	 */
-	int readDir(const std::string& objectId, UPnPDirContent& dirbuf);
+	int readDir(const std::string& objectId, UPnPDirContent& dirbuf,
+				unsigned int fields = UPnPDirContent::PF_ALL);
 
 	int readDirSlice(const string& objectId, int offset,
 					 int count, UPnPDirContent& dirbuf,
-					 int *didread, int *total);
+					 int *didread, int *total,
+					 unsigned int fields = UPnPDirContent::PF_ALL);
 
 	/** Search the content directory service.
 	 *
@@ -87,10 +96,12 @@ public:
 	 * UPnP document: UPnP-av-ContentDirectory-v1-Service-20020625.pdf
 	 * section 2.5.5. Maybe we'll provide an easier way some day...
 	 * @param[out] dirbuf stores the entries we read.
+	 * @param fields the object properties we need. See readDir().
 	 * @return UPNP_E_SUCCESS for success, else libupnp error code.
 	 */
 	int search(const std::string& objectId, const std::string& searchstring,
-		   UPnPDirContent& dirbuf);
+		   UPnPDirContent& dirbuf,
+		   unsigned int fields = UPnPDirContent::PF_ALL);
 
 	/** Read metadata for a given node.
 	 *
@@ -113,6 +124,9 @@ public:
 	std::string getFriendlyName() const {return m_friendlyName;}
 
 private:
+	int readDirRange(const std::string& objectId, int offset, int end,
+					 UPnPDirContent& dirbuf, unsigned int fields);
+
 	std::string m_actionURL;
 	std::string m_serviceType;
 	std::string m_deviceId;
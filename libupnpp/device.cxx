@@ -16,53 +16,45 @@
  */
 #include "config.h"
 
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
 #include <iostream>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <functional>
 using namespace std;
 
 #include "upnpplib.hxx"
 #include "vdir.hxx"
 #include "device.hxx"
 #include "log.hxx"
+#include "trace.hxx"
+#include "metrics.hxx"
 
 unordered_map<std::string, UpnpDevice *> UpnpDevice::o_devices;
 
-static string xmlquote(const string& in)
-{
-    string out;
-    for (unsigned int i = 0; i < in.size(); i++) {
-        switch(in[i]) {
-        case '"': out += "&quot;";break;
-        case '&': out += "&amp;";break;
-        case '<': out += "&lt;";break;
-        case '>': out += "&gt;";break;
-        case '\'': out += "&apos;";break;
-        default: out += in[i];
-        }
-    }
-    return out;
-}
+// Protects the o_devices map. Each device has its own lock for
+// serializing its callbacks and event generation.
+static PTMutexInit cblock;
 
-static bool vectorstoargslists(const vector<string>& names, 
-                               const vector<string>& values,
-                               vector<string>& qvalues,
-                               vector<const char *>& cnames,
-                               vector<const char *>& cvalues)
+// Schedule the periodic polls for a new service (see eventloop())
+static void evaddservice(UpnpDevice *dev, const string *serviceid);
+
+// Copy name/value vectors into an event buffer, escaping the values
+static bool vectorstoeventbuf(const vector<string>& names, 
+                              const vector<string>& values,
+                              EventBuf& buf)
 {
     if (names.size() != values.size()) {
-        LOGERR("vectorstoargslists: bad sizes" << endl);
+        LOGERR("vectorstoeventbuf: bad sizes" << endl);
         return false;
     }
 
-    cnames.reserve(names.size());
     for (unsigned int i = 0; i < names.size(); i++) {
-        cnames.push_back(names[i].c_str());
-    }
-    qvalues.clear();
-    qvalues.reserve(values.size());
-    cvalues.reserve(values.size());
-    for (unsigned int i = 0; i < values.size(); i++) {
-        qvalues.push_back(xmlquote(values[i]));
-        cvalues.push_back(qvalues[i].c_str());
+        xmlquote_append(buf.add(names[i].c_str()), values[i]);
     }
     return true;
 }
@@ -85,11 +77,17 @@ UpnpDevice::UpnpDevice(const string& deviceId,
         return;
     }
 
-    if (o_devices.empty()) {
-        // First call: init callbacks
-        m_lib->registerHandler(UPNP_CONTROL_ACTION_REQUEST, sCallBack, this);
-	m_lib->registerHandler(UPNP_CONTROL_GET_VAR_REQUEST, sCallBack, this);
-	m_lib->registerHandler(UPNP_EVENT_SUBSCRIPTION_REQUEST, sCallBack,this);
+    {
+        PTMutexLocker lock(cblock);
+        if (o_devices.empty()) {
+            // First call: init callbacks
+            m_lib->registerHandler(UPNP_CONTROL_ACTION_REQUEST, sCallBack, 
+                                   this);
+            m_lib->registerHandler(UPNP_CONTROL_GET_VAR_REQUEST, sCallBack, 
+                                   this);
+            m_lib->registerHandler(UPNP_EVENT_SUBSCRIPTION_REQUEST, sCallBack,
+                                   this);
+        }
     }
 
     VirtualDir* theVD = VirtualDir::getVirtualDir();
@@ -98,33 +96,32 @@ UpnpDevice::UpnpDevice(const string& deviceId,
         return;
     }
 
-    unordered_map<string,string>::const_iterator it = 
-        xmlfiles.find("description.xml");
-    if (it == xmlfiles.end()) {
-        LOGFAT("UpnpDevice::UpnpDevice: no description.xml found in xmlfiles"
-               << endl);
-        return;
-    } 
-
-    const string& description = it->second;
-
-    for (it = xmlfiles.begin(); it != xmlfiles.end(); it++) {
+    for (unordered_map<string,string>::const_iterator it = xmlfiles.begin();
+         it != xmlfiles.end(); it++) {
         theVD->addFile("/", it->first, it->second, "application/xml");
     }
 
-    // Start up the web server for sending out description files
-    m_lib->setupWebServer(description);
+    unordered_map<string,string>::const_iterator it = 
+        xmlfiles.find("description.xml");
+    if (it != xmlfiles.end()) {
+        // Root device: start up the web server for sending out
+        // description files. This must be done after the embedded
+        // devices have been created, as the library may begin
+        // dispatching requests for them at once.
+        m_lib->setupWebServer(it->second);
+    } else {
+        LOGDEB("UpnpDevice::UpnpDevice: no description.xml: " << m_deviceId
+               << " is an embedded device" << endl);
+    }
 
+    PTMutexLocker lock(cblock);
     o_devices[m_deviceId] = this;
 }
 
-static PTMutexInit cblock;
-
 // Main libupnp callback: use the device id and call the right device
 int UpnpDevice::sCallBack(Upnp_EventType et, void* evp, void* tok)
 {
     //LOGDEB("UpnpDevice::sCallBack" << endl);
-    PTMutexLocker lock(cblock);
 
     string deviceid;
     switch (et) {
@@ -146,17 +143,25 @@ int UpnpDevice::sCallBack(Upnp_EventType et, void* evp, void* tok)
     }
     // LOGDEB("UpnpDevice::sCallBack: deviceid[" << deviceid << "]" << endl);
 
-    unordered_map<std::string, UpnpDevice *>::iterator it =
-        o_devices.find(deviceid);
+    UpnpDevice *dev;
+    {
+        PTMutexLocker lock(cblock);
+        unordered_map<std::string, UpnpDevice *>::iterator it =
+            o_devices.find(deviceid);
 
-    if (it == o_devices.end()) {
-        LOGERR("UpnpDevice::sCallBack: Device not found: [" << 
-               deviceid << "]" << endl);
-        return UPNP_E_INVALID_PARAM;
+        if (it == o_devices.end()) {
+            LOGERR("UpnpDevice::sCallBack: Device not found: [" << 
+                   deviceid << "]" << endl);
+            return UPNP_E_INVALID_PARAM;
+        }
+        dev = it->second;
     }
-    // LOGDEB("UpnpDevice::sCallBack: device found: [" << it->second 
+    // LOGDEB("UpnpDevice::sCallBack: device found: [" << dev 
     // << "]" << endl);
-    return (it->second)->callBack(et, evp);
+
+    // Callbacks for different devices can run in parallel.
+    PTMutexLocker lock(dev->m_lock);
+    return dev->callBack(et, evp);
 }
 
 int UpnpDevice::callBack(Upnp_EventType et, void* evp)
@@ -165,8 +170,14 @@ int UpnpDevice::callBack(Upnp_EventType et, void* evp)
     case UPNP_CONTROL_ACTION_REQUEST:
     {
         struct Upnp_Action_Request *act = (struct Upnp_Action_Request *)evp;
-        LOGDEB("UPNP_CONTROL_ACTION_REQUEST: " << act->ActionName <<
-               ". Params: " << ixmlPrintDocument(act->ActionRequest) << endl);
+        unsigned int trid = TRACE_NAMEID(act->ActionName);
+        TraceSpan actspan(Trace::ACTION, trid);
+        if (LOGGER_LEVEL_ENABLED(upnppdebug::Logger::LLDEB)) {
+            DOMString params = ixmlPrintDocument(act->ActionRequest);
+            LOGDEB("UPNP_CONTROL_ACTION_REQUEST: " << act->ActionName <<
+                   ". Params: " << params << endl);
+            ixmlFreeDOMString(params);
+        }
 
         unordered_map<string, string>::const_iterator servit = 
             m_serviceTypes.find(act->ServiceID);
@@ -176,31 +187,41 @@ int UpnpDevice::callBack(Upnp_EventType et, void* evp)
         }
         const string& servicetype = servit->second;
 
-        unordered_map<string, soapfun>::iterator callit = 
+        unordered_map<string, ActionEntry>::iterator callit = 
             m_calls.find(act->ActionName);
         if (callit == m_calls.end()) {
             LOGINF("No such action: " << act->ActionName << endl);
             return UPNP_E_INVALID_PARAM;
         }
+        const ActionEntry& entry = callit->second;
+        MetricTimer acttimer(entry.histo);
 
         SoapArgs sc;
+        TraceSpan decspan(Trace::DECODE, trid);
         if (!decodeSoapBody(act->ActionName, act->ActionRequest, &sc)) {
             LOGERR("Error decoding Action call arguments" << endl);
+            entry.errors->inc();
             return UPNP_E_INVALID_PARAM;
         }
+        decspan.end();
         SoapData dt;
         dt.name = act->ActionName;
         dt.serviceType = servicetype;
 
         // Call the action routine
-        int ret = callit->second(sc, dt);
+        TraceSpan hdlspan(Trace::HANDLER, trid);
+        int ret = entry.fun(sc, dt);
+        hdlspan.end();
         if (ret != UPNP_E_SUCCESS) {
             LOGERR("Action failed: " << sc.name << endl);
+            entry.errors->inc();
             return ret;
         }
 
         // Encode result data
+        TraceSpan encspan(Trace::ENCODE, trid);
         act->ActionResult = buildSoapBody(dt);
+        encspan.setValue(dt.data.size());
         //LOGDEB("Response data: " << 
         //   ixmlPrintDocument(act->ActionResult) << endl);
 
@@ -224,16 +245,15 @@ int UpnpDevice::callBack(Upnp_EventType et, void* evp)
             (struct  Upnp_Subscription_Request*)evp;
         LOGDEB("UPNP_EVENT_SUBSCRIPTION_REQUEST: " << act->ServiceId << endl);
 
-        vector<string> names, values, qvalues;
-        if (!getEventData(true, act->ServiceId, names, values)) {
+        // Subscriptions are rare, no need to reuse the loop buffer
+        EventBuf buf;
+        if (!getEventData(true, act->ServiceId, buf)) {
             break;
         }
-        vector<const char *> cnames, cvalues;
-        vectorstoargslists(names, values, qvalues, cnames, cvalues);
         int ret = 
             UpnpAcceptSubscription(m_lib->getdvh(), act->UDN, act->ServiceId,
-                                   &cnames[0], &cvalues[0],
-                                   int(cnames.size()), act->Sid);
+                                   buf.cnames(), buf.cvalues(),
+                                   int(buf.size()), act->Sid);
         if (ret != UPNP_E_SUCCESS) {
             LOGERR("UpnpDevice::callBack: UpnpAcceptSubscription failed: " 
                    << ret << endl);
@@ -257,119 +277,444 @@ void UpnpDevice::addServiceType(const std::string& serviceId,
     //LOGDEB("UpnpDevice::addServiceType: [" << 
     //    serviceId << "] -> [" << serviceType << endl);
     m_serviceTypes[serviceId] = serviceType;
+    pair<unordered_map<string, EvService>::iterator, bool> res = 
+        m_evservices.insert(pair<string, EvService>(serviceId, EvService()));
+    if (res.second) {
+        EvService& svc = res.first->second;
+        string label = Metrics::label("service", serviceId);
+        svc.notifies = Metrics::counter("upnp_event_notifies_total",
+                                        "Event notifies sent", label);
+        svc.coalesced = Metrics::counter(
+            "upnp_event_coalesced_total",
+            "Events merged into one still waiting to be sent", label);
+        evaddservice(this, &res.first->first);
+    }
 }
 
 void UpnpDevice::addActionMapping(const std::string& actName, soapfun fun)
 {
     // LOGDEB("UpnpDevice::addActionMapping:" << actName << endl);
-    m_calls[actName] = fun;
+    ActionEntry& entry = m_calls[actName];
+    entry.fun = fun;
+    // Only known action names get a metric, the label values must
+    // come from a bounded set. The lookups are done once here, the
+    // callback only updates the values.
+    string actlabel = Metrics::label("action", actName);
+    entry.histo = Metrics::histogram("upnp_action_duration_seconds",
+                                     "SOAP action processing time", actlabel);
+    entry.errors = Metrics::counter("upnp_action_errors_total",
+                                    "Failed SOAP actions", actlabel);
+}
+
+bool UpnpDevice::getEventData(bool all, const string& serviceid, 
+                              EventBuf& buf)
+{
+    vector<string> names, values;
+    if (!getEventData(all, serviceid, names, values))
+        return false;
+    return vectorstoeventbuf(names, values, buf);
 }
 
 void UpnpDevice::notifyEvent(const string& serviceId,
                              const vector<string>& names, 
                              const vector<string>& values)
+{
+    EventBuf buf;
+    if (!vectorstoeventbuf(names, values, buf))
+        return;
+    notifyEvent(serviceId, buf);
+}
+
+// Event notification threads. UpnpNotify() sends to all the
+// subscribers of a service in turn, so it can be slow if one of them
+// is, and it is never called from the event loop or under a device
+// lock. notifyEvent() merges the data into the service pending buffer
+// and queues the service if it is not already queued or being
+// sent. Only one thread at a time works on a given service, so that
+// the events stay in order. Lock order: device lock, notifylock.
+//
+// We can't interrupt or time out a send ourselves: libupnp's own HTTP
+// timeout is the only real bound on an UpnpNotify() call. What we do
+// is limit the damage. A send outstanding for more than notifyslow_ms
+// marks its service as lagging: the new events for the service are
+// only merged into the pending one (they are never queued twice), and
+// the lagging send does not count as a working thread. When all the
+// threads are busy and too many of them are lagging, a replacement
+// is started, up to nnotifymax threads, so that a few stuck services
+// can't block the events for all the others. The extra threads exit
+// when they find nothing to do.
+static const int nnotifythreads = 4;
+static const int nnotifymax = 16;
+static const int notifyslow_ms = 2000;
+
+struct NotifyTask {
+    NotifyTask(UpnpDevice *dv = 0, const string *sid = 0)
+        : dev(dv), serviceid(sid) {}
+    UpnpDevice *dev;
+    const string *serviceid; // Key in the device m_evservices
+};
+
+// State of a sender thread slot
+struct NotifyWorker {
+    NotifyWorker() : alive(false), start(0), serviceid(0), lagging(false) {}
+    bool alive;
+    long long start; // Current send start (Metrics::now()), or 0
+    const string *serviceid;
+    bool lagging;
+};
+
+static PTMutexInit notifylock;
+static pthread_cond_t notifycond = PTHREAD_COND_INITIALIZER;
+static deque<NotifyTask> notifyqueue;
+static NotifyWorker notifyworkers[nnotifymax];
+static int notifynthreads;
+static int notifyidle;
+static bool notifystarted;
+
+// Start a sender thread in a free slot. Under notifylock.
+static void notifyStartWorker(void *(*fn)(void *))
+{
+    for (int i = 0; i < nnotifymax; i++) {
+        if (notifyworkers[i].alive)
+            continue;
+        notifyworkers[i] = NotifyWorker();
+        pthread_t thr;
+        if (pthread_create(&thr, 0, fn, (void *)(long)i)) {
+            LOGERR("UpnpDevice: can't start notification thread" << endl);
+            return;
+        }
+        pthread_detach(thr);
+        notifyworkers[i].alive = true;
+        notifynthreads++;
+        return;
+    }
+}
+
+// Mark the sends outstanding for too long as lagging, and return the
+// count of threads which are not. Under notifylock.
+static int notifyCheckLagging()
+{
+    static MetricCounter *laggingcount = 
+        Metrics::counter("upnp_event_lagging_total",
+                         "Event sends outstanding for too long");
+    long long now = Metrics::now();
+    int working = 0;
+    for (int i = 0; i < nnotifymax; i++) {
+        NotifyWorker& w = notifyworkers[i];
+        if (!w.alive)
+            continue;
+        if (w.start == 0 || now - w.start < notifyslow_ms * 1000000LL) {
+            working++;
+        } else if (!w.lagging) {
+            w.lagging = true;
+            laggingcount->inc();
+            LOGINF("UpnpDevice: " << *w.serviceid << ": send outstanding for "
+                   << (now - w.start) / 1000000 << " mS, lagging" << endl);
+        }
+    }
+    return working;
+}
+
+void UpnpDevice::notifyEvent(const string& serviceId, EventBuf& buf)
 {
     LOGDEB("UpnpDevice::notifyEvent " << serviceId << " " <<
-           (names.empty()?"Empty names??":names[0]) << endl);
-    if (names.empty())
+           (buf.empty() ? "Empty names??" : buf.name(0)) << endl);
+    if (buf.empty())
+        return;
+
+    // The map is only modified during initialization
+    unordered_map<string, EvService>::iterator it = 
+        m_evservices.find(serviceId);
+    if (it == m_evservices.end()) {
+        LOGERR("UpnpDevice::notifyEvent: unknown service " << serviceId
+               << endl);
         return;
-    vector<const char *> cnames, cvalues;
-    vector<string> qvalues;
-    vectorstoargslists(names, values, qvalues, cnames, cvalues);
+    }
+    EvService& svc = it->second;
+
+    PTMutexLocker lock(notifylock);
+    if (!notifystarted) {
+        notifystarted = true;
+        for (int i = 0; i < nnotifythreads; i++)
+            notifyStartWorker(notifySender);
+    }
+    if (!svc.pending.empty()) {
+        svc.coalesced->inc();
+    }
+    for (unsigned int i = 0; i < buf.size(); i++) {
+        svc.pending.set(buf.name(i).c_str()).assign(buf.value(i));
+    }
+    if (!svc.queued) {
+        svc.queued = true;
+        notifyqueue.push_back(NotifyTask(this, &it->first));
+        pthread_cond_signal(&notifycond);
+        if (notifyidle == 0 && notifynthreads < nnotifymax &&
+            notifyCheckLagging() < nnotifythreads) {
+            notifyStartWorker(notifySender);
+        }
+    }
+}
 
+void *UpnpDevice::notifySender(void *arg)
+{
+    NotifyWorker& me = notifyworkers[(long)arg];
+    for (;;) {
+        NotifyTask task;
+        EvService *svc;
+        {
+            PTMutexLocker lock(notifylock);
+            notifyidle++;
+            while (notifyqueue.empty()) {
+                pthread_cond_wait(&notifycond, lock.getMutex());
+            }
+            notifyidle--;
+            task = notifyqueue.front();
+            notifyqueue.pop_front();
+            svc = &task.dev->m_evservices.find(*task.serviceid)->second;
+            svc->sending.swap(svc->pending);
+            svc->pending.clear();
+            me.start = Metrics::now();
+            me.serviceid = task.serviceid;
+            me.lagging = false;
+        }
+
+        svc->notifies->inc();
+        task.dev->sendNotify(*task.serviceid, svc->sending);
+
+        PTMutexLocker lock(notifylock);
+        if (me.lagging) {
+            LOGINF("UpnpDevice: " << *task.serviceid << ": lagging send "
+                   "done after " << (Metrics::now() - me.start) / 1000000 <<
+                   " mS" << endl);
+        }
+        me.start = 0;
+        if (svc->pending.empty()) {
+            svc->queued = false;
+        } else {
+            // More data came in while we were sending. Requeue
+            // instead of looping, so that a slow service does not
+            // hold the thread.
+            notifyqueue.push_back(task);
+            pthread_cond_signal(&notifycond);
+        }
+        // Extra thread, started to replace a lagging one?
+        if (notifynthreads > nnotifythreads && notifyqueue.empty() &&
+            notifyCheckLagging() > nnotifythreads) {
+            me.alive = false;
+            notifynthreads--;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Send an event. Called from the notification threads, without locks.
+void UpnpDevice::sendNotify(const string& serviceId, EventBuf& buf)
+{
+    static MetricHisto *notifyhisto = 
+        Metrics::histogram("upnp_event_notify_duration_seconds",
+                           "Time for sending an event to the subscribers");
+    TraceSpan span(Trace::NOTIFY, TRACE_NAMEID(serviceId));
+    if (Trace::enabled()) {
+        long long bytes = 0;
+        for (unsigned int i = 0; i < buf.size(); i++)
+            bytes += buf.name(i).size() + buf.value(i).size();
+        span.setValue(bytes);
+    }
+    long long start = Metrics::now();
     int ret = UpnpNotify(m_lib->getdvh(), m_deviceId.c_str(), 
-                         serviceId.c_str(), &cnames[0], &cvalues[0],
-                         int(cnames.size()));
+                         serviceId.c_str(), buf.cnames(), buf.cvalues(),
+                         int(buf.size()));
+    long long dur = Metrics::now() - start;
+    notifyhisto->observe(dur);
     if (ret != UPNP_E_SUCCESS) {
-        LOGERR("UpnpDevice::notifyEvent: UpnpNotify failed: " << ret << endl);
+        LOGERR("UpnpDevice::sendNotify: UpnpNotify failed: " << ret << endl);
     }
 }
 
+// Event scheduler. A min-heap holds the next poll time for each
+// service of each device, and a queue holds the devices which asked
+// for an early poll (loopWakeup()). Any number of threads can run
+// eventloop(). The scheduler lock (evlock) is never held while
+// calling into a device. Lock order when several are needed: device
+// lock, evlock, cblock.
+static int loopwait_ms = 1000; // Polling mpd every 1 S. Under evlock.
+static const int nloopstofull = 10;  // Full state every 10 polls
+
+struct EvTimer {
+    EvTimer(long long dl, UpnpDevice *dv, const string *sid)
+        : deadline(dl), dev(dv), serviceid(sid) {}
+    long long deadline; // Absolute CLOCK_REALTIME milliseconds
+    UpnpDevice *dev;
+    const string *serviceid; // Null for an early device wakeup
+    bool operator>(const EvTimer& o) const {
+        return deadline > o.deadline;
+    }
+};
+
+// Early wakeup state for one device
+struct EvDevState {
+    EvDevState() : queued(false), lastearly(0) {}
+    bool queued;
+    long long lastearly;
+};
+
+static PTMutexInit evlock;
 static pthread_cond_t evloopcond = PTHREAD_COND_INITIALIZER;
+static priority_queue<EvTimer, vector<EvTimer>, greater<EvTimer> > evtimers;
+static deque<UpnpDevice *> evwakeups;
+static unordered_map<UpnpDevice *, EvDevState> evdevstates;
+// Count of services registered, for spreading the first polls
+static int evnservices;
 
-static void timespec_addnanos(struct timespec *ts, int nanos)
+static long long evnowms()
 {
-    ts->tv_nsec += nanos;
-    if (ts->tv_nsec > 1000 * 1000 * 1000) {
-        int secs = ts->tv_nsec / (1000 * 1000 * 1000);
-        ts->tv_sec += secs;
-        ts->tv_nsec -= secs * (1000 * 1000 * 1000);
-    } 
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / (1000 * 1000);
 }
-int timespec_diffms(const struct timespec& old, const struct timespec& recent)
+
+// Called when a device registers a service, whether the loop is
+// running or not. The first poll happens at least one period later,
+// which leaves time for the derived device constructor to complete,
+// and the polls are spread over the period so that the services
+// don't all poll at the same time.
+static void evaddservice(UpnpDevice *dev, const string *serviceid)
 {
-    return (recent.tv_sec - old.tv_sec) * 1000 + 
-        (recent.tv_nsec - old.tv_nsec) / (1000 * 1000);
+    PTMutexLocker lock(evlock);
+    long long first = evnowms() + loopwait_ms + 
+        (loopwait_ms * (evnservices++ % 8)) / 8;
+    evtimers.push(EvTimer(first, dev, serviceid));
+    pthread_cond_signal(&evloopcond);
 }
 
-// Loop on services, and poll each for changed data. Generate event
-// only if changed data exists. Every 3 S we generate an artificial
-// event with all the current state.
-void UpnpDevice::eventloop()
+// Wait for the next thing to do: an early wakeup request or an
+// expired timer. This is removed from the queue or heap and returned.
+static bool evwait(EvTimer& todo)
 {
-    int count = 0;
-    const int loopwait_ms = 1000; // Polling mpd every 1 S
-    const int nloopstofull = 10;  // Full state every 10 S
-    struct timespec wkuptime, earlytime;
-    bool didearly = false;
-
+    PTMutexLocker lock(evlock);
     for (;;) {
-        clock_gettime(CLOCK_REALTIME, &wkuptime);
-        timespec_addnanos(&wkuptime, loopwait_ms * 1000 * 1000);
-
-        //LOGDEB("eventloop: now " << time(0) << " wkup at "<< 
-        //    wkuptime.tv_sec << " S " << wkuptime.tv_nsec << " ns" << endl);
+        if (!evwakeups.empty()) {
+            todo = EvTimer(0, evwakeups.front(), 0);
+            evwakeups.pop_front();
+            evdevstates[todo.dev].queued = false;
+            return true;
+        }
 
-        PTMutexLocker lock(cblock);
-        int err = pthread_cond_timedwait(&evloopcond, lock.getMutex(), 
+        int err;
+        if (evtimers.empty()) {
+            err = pthread_cond_wait(&evloopcond, lock.getMutex());
+        } else {
+            long long deadline = evtimers.top().deadline;
+            if (deadline <= evnowms()) {
+                todo = evtimers.top();
+                evtimers.pop();
+                return true;
+            }
+            struct timespec wkuptime;
+            wkuptime.tv_sec = deadline / 1000;
+            wkuptime.tv_nsec = (deadline % 1000) * 1000 * 1000;
+            err = pthread_cond_timedwait(&evloopcond, lock.getMutex(), 
                                          &wkuptime);
+        }
         if (err && err != ETIMEDOUT) {
-            LOGINF("UpnpDevice:eventloop: wait errno " << errno << endl);
-            break;
-        } else if (err == 0) {
-            // Early wakeup. Only does something if it did not already
-            // happen recently
-            if (didearly) {
-                int millis = timespec_diffms(earlytime, wkuptime);
-                if (millis < loopwait_ms) {
-                    // Do nothing. didearly stays true
-                    // LOGDEB("eventloop: early, previous too close "<<endl);
-                    continue;
-                } else {
-                    // had an early wakeup previously, but it was a
-                    // long time ago. Update state and wakeup
-                    // LOGDEB("eventloop: early, previous is old "<<endl);
-                    earlytime = wkuptime;
-                }
-            } else {
-                // Early wakeup, previous one was normal. Remember.
-                // LOGDEB("eventloop: early, no previous" << endl);
-                didearly = true;
-                earlytime = wkuptime;
-            }
-        } else {
-            // Normal wakeup
-            // LOGDEB("eventloop: normal wakeup" << endl);
-            didearly = false;
+            LOGINF("UpnpDevice:eventloop: wait error " << err << endl);
+            return false;
         }
+    }
+}
 
-        count++;
-        bool all = count && ((count % nloopstofull) == 0);
-        //LOGDEB("UpnpDevice::eventloop count "<<count<<" all "<<all<<endl);
+void UpnpDevice::setEventInterval(int ms)
+{
+    if (ms <= 0)
+        return;
+    PTMutexLocker lock(evlock);
+    // The timers already scheduled keep their deadlines, the new
+    // interval is used when they are rescheduled.
+    loopwait_ms = ms;
+}
 
-        for (unordered_map<string, string>::const_iterator it = 
-                 m_serviceTypes.begin(); it != m_serviceTypes.end(); it++) {
-            vector<string> names, values;
-            if (!getEventData(all, it->first, names, values) || names.empty()) {
-                continue;
-            }
-            notifyEvent(it->first, names, values);
+// Loop on devices and services, and poll each for changed data. Generate
+// event only if changed data exists. Every 10 polls we generate an artificial
+// event with all the current state.
+void UpnpDevice::eventloop()
+{
+    static MetricHisto *earlyhisto = 
+        Metrics::histogram("upnp_event_poll_duration_seconds",
+                           "Event loop state poll time", 
+                           Metrics::label("poll", "early"));
+    static MetricHisto *periodichisto = 
+        Metrics::histogram("upnp_event_poll_duration_seconds",
+                           "Event loop state poll time", 
+                           Metrics::label("poll", "periodic"));
+    EvTimer todo(0, 0, 0);
+    while (evwait(todo)) {
+        if (todo.serviceid == 0) {
+            // Early wakeup: look for changes in all the device services
+            TRACE_SPAN(earlyspan, Trace::EVTICK, "early");
+            MetricTimer timer(earlyhisto);
+            todo.dev->sendEvents(0);
+            continue;
+        }
+
+        {
+            TRACE_SPAN(tickspan, Trace::EVTICK, "periodic");
+            MetricTimer timer(periodichisto);
+            todo.dev->sendEvents(todo.serviceid);
         }
+
+        // Reschedule. If we fell behind, don't try to catch up.
+        PTMutexLocker lock(evlock);
+        long long now = evnowms();
+        todo.deadline += loopwait_ms;
+        if (todo.deadline <= now)
+            todo.deadline = now + loopwait_ms;
+        evtimers.push(todo);
     }
 }
 
-void UpnpDevice::loopWakeup()
+// Poll one service of this device (or all for a null serviceid) and
+// send events for changed data. Periodic polls of a service send the
+// full state every nloopstofull times.
+void UpnpDevice::sendEvents(const string *serviceid)
 {
-    pthread_cond_broadcast(&evloopcond);
+    PTMutexLocker lock(m_lock);
+    for (unordered_map<string, EvService>::iterator it = 
+             m_evservices.begin(); it != m_evservices.end(); it++) {
+        if (serviceid && serviceid != &it->first)
+            continue;
+        EvService& svc = it->second;
+        bool all = serviceid && (++svc.count % nloopstofull) == 0;
+        if (!all) {
+            // If the previous event is still waiting for a sender
+            // thread, this one will be merged into it. Merging
+            // deltas does not work for LastChange-style variables,
+            // so send the full state instead.
+            PTMutexLocker nlock(notifylock);
+            all = !svc.pending.empty();
+        }
+        svc.buf.clear();
+        if (!getEventData(all, it->first, svc.buf) || svc.buf.empty()) {
+            continue;
+        }
+        notifyEvent(it->first, svc.buf);
+    }
 }
 
+// Queue an early poll for this device. Only does something if the
+// previous one is not too recent: the data will be sent by the next
+// periodic poll anyway.
+void UpnpDevice::loopWakeup()
+{
+    PTMutexLocker lock(evlock);
+    EvDevState& state = evdevstates[this];
+    if (state.queued)
+        return;
+    long long now = evnowms();
+    if (now - state.lastearly < loopwait_ms)
+        return;
+    state.lastearly = now;
+    state.queued = true;
+    evwakeups.push_back(this);
+    pthread_cond_signal(&evloopcond);
+}
@@ -19,20 +19,112 @@
 
 #include <unordered_map>
 #include <functional>
+#include <utility>
 
 #include "soaphelp.hxx"
+#include "ptmutex.hxx"
 
 class UpnpDevice;
+class MetricHisto;
+class MetricCounter;
 
 //typedef int (*soapfun)(const SoapArgs&, void *, SoapData&) ;
 
 typedef function<int (const SoapArgs&, SoapData&)> soapfun;
 
+/** Reusable storage for the evented variables of one service.
+ *
+ * Values are stored in their final, XML-escaped, form, as they will
+ * appear in the NOTIFY message. The strings and the pointer arrays
+ * handed to libupnp are kept from one event to the next, so that
+ * after a few cycles, generating an event does not allocate memory.
+ */
+class EventBuf {
+public:
+    EventBuf() : m_count(0) {}
+
+    /** Forget the current contents (keeping the storage) */
+    void clear() {m_count = 0;}
+
+    /** Add a variable. Returns a reference to the (empty) value
+     * string, to be filled up by the caller with escaped data */
+    std::string& add(const char *name) {
+        if (m_count == m_names.size()) {
+            m_names.push_back(std::string());
+            m_values.push_back(std::string());
+        }
+        m_names[m_count].assign(name);
+        m_values[m_count].clear();
+        return m_values[m_count++];
+    }
+
+    /** Same as add(), but reuse the entry if the variable is already
+     * present, so that the latest value wins */
+    std::string& set(const char *name) {
+        for (size_t i = 0; i < m_count; i++) {
+            if (m_names[i] == name) {
+                m_values[i].clear();
+                return m_values[i];
+            }
+        }
+        return add(name);
+    }
+
+    /** Exchange contents and storage with another buffer */
+    void swap(EventBuf& other) {
+        m_names.swap(other.m_names);
+        m_values.swap(other.m_values);
+        m_cnames.swap(other.m_cnames);
+        m_cvalues.swap(other.m_cvalues);
+        std::swap(m_count, other.m_count);
+    }
+
+    size_t size() const {return m_count;}
+    bool empty() const {return m_count == 0;}
+    const std::string& name(size_t i) const {return m_names[i];}
+    const std::string& value(size_t i) const {return m_values[i];}
+
+    /** Set up and return the char* arrays for the libupnp calls. Only
+     * valid until the next call to add() */
+    const char **cnames() {
+        setpointers();
+        return &m_cnames[0];
+    }
+    const char **cvalues() {
+        setpointers();
+        return &m_cvalues[0];
+    }
+
+private:
+    void setpointers() {
+        m_cnames.resize(m_count + 1);
+        m_cvalues.resize(m_count + 1);
+        for (size_t i = 0; i < m_count; i++) {
+            m_cnames[i] = m_names[i].c_str();
+            m_cvalues[i] = m_values[i].c_str();
+        }
+    }
+    std::vector<std::string> m_names;
+    std::vector<std::string> m_values;
+    std::vector<const char *> m_cnames;
+    std::vector<const char *> m_cvalues;
+    size_t m_count;
+};
+
 /** Define a virtual interface to link libupnp operations to a device 
  * implementation 
  */
 class UpnpDevice {
 public:
+    /** Create a device. 
+     *
+     * @param deviceId the device UDN
+     * @param xmlfiles the files to be served in the root web
+     *    directory. Only the root device xmlfiles contain a description.xml.
+     *    A device created without one is assumed to be embedded inside
+     *    the root description, and it should be created before the root
+     *    device, as libupnp only supports a single root device per process.
+     */
     UpnpDevice(const std::string& deviceId, 
                const std::unordered_map<std::string, std::string>& xmlfiles);
     void addServiceType(const std::string& serviceId, 
@@ -47,35 +139,86 @@ public:
                               std::vector<std::string>& names, 
                               std::vector<std::string>& values) = 0;
 
+    /** Retrieve eventable data into a reusable buffer, with values
+     * already escaped. This is what the library actually calls. The
+     * default implementation calls the vector version above and
+     * quotes the values. A derived class can implement this too, to
+     * avoid the copies. The buffer is empty on entry.
+     */
+    virtual bool getEventData(bool all, const std::string& serviceid,
+                              EventBuf& buf);
+
     /** To be called by the device layer when data changes and an
-     * event should happen. */
+     * event should happen. This does not wait for the network: the
+     * data is handed to the notification threads. If the previous
+     * event for the service is still waiting to be sent (slow
+     * subscribers), the new values are merged into it. */
     void notifyEvent(const std::string& serviceId,
                      const std::vector<std::string>& names, 
                      const std::vector<std::string>& values);
+    /** Same with already escaped values */
+    void notifyEvent(const std::string& serviceId, EventBuf& buf);
 
     /** This loop polls getEventData and generates an UPnP event if
      * there is anything to broadcast. To be called by main() when
-     * done with initialization. */
-    void eventloop();
+     * done with initialization. The loop serves all the devices in
+     * the process, including those created after it started, and may
+     * be run by several threads for more parallelism. Does not return.
+     */
+    static void eventloop();
+
+    /** Set the state polling period for all the devices (default
+     * 1000 mS). Can be called at any time. */
+    static void setEventInterval(int ms);
 
     /** Called from a callback to Wakeup the event loop early if we
      * need to broadcast something quickly. Will only do something if
-     * the previous event is not too recent.
+     * the previous early wakeup for this device is not too recent.
      */
     void loopWakeup(); // To trigger an early event
 
     bool ok() {return m_lib != 0;}
 
+    /** The libupnp callback. This finds the device from the request
+     * UDN, and dispatches to the action routines. It may also be
+     * called directly to run requests without the network
+     * (e.g. from a benchmark) */
+    static int sCallBack(Upnp_EventType et, void* evp, void*);
+
 private:
     const std::string& serviceType(const std::string& serviceId);
+    void sendEvents(const std::string *serviceid);
+    void sendNotify(const std::string& serviceId, EventBuf& buf);
+    static void *notifySender(void *);
             
     LibUPnP *m_lib;
     std::string m_deviceId;
     std::unordered_map<std::string, std::string> m_serviceTypes;
-    std::unordered_map<std::string, soapfun> m_calls;
+    // Per-service eventing state. The buffers are reused by the event loop
+    struct EvService {
+        EvService() : count(0), queued(false), notifies(0), coalesced(0) {}
+        EventBuf buf;
+        int count; // Periodic polls, for sending the full state
+        // Asynchronous sending, under the notification lock
+        EventBuf pending; // Waiting for a sender thread
+        EventBuf sending; // Being sent by the sender thread
+        bool queued; // On the notification queue or being sent
+        MetricCounter *notifies;
+        MetricCounter *coalesced;
+    };
+    std::unordered_map<std::string, EvService> m_evservices;
+    // Serializes the callbacks and event generation for this device
+    PTMutexInit m_lock;
+    // Action routines, with their metrics looked up once
+    struct ActionEntry {
+        ActionEntry() : histo(0), errors(0) {}
+        soapfun fun;
+        MetricHisto *histo;
+        MetricCounter *errors;
+    };
+    std::unordered_map<std::string, ActionEntry> m_calls;
 
     static unordered_map<std::string, UpnpDevice *> o_devices;
-    static int sCallBack(Upnp_EventType et, void* evp, void*);
     int callBack(Upnp_EventType et, void* evp);
 };
 
@@ -21,6 +21,9 @@
 
 #include <iostream>
 #include <map>
+#include <vector>
+#include <future>
+#include <atomic>
 using namespace std;
 
 #include "upnpp_p.hxx"
@@ -28,7 +31,9 @@ using namespace std;
 #include <upnp/upnp.h>
 #include <upnp/upnptools.h>
 
-#include "workqueue.hxx"
+#include "lfworkqueue.hxx"
+#include "stealqueue.hxx"
+#include "trace.hxx"
 #include "expatmm.hxx"
 #include "upnpplib.hxx"
 #include "description.hxx"
@@ -78,20 +83,29 @@ static string cluDiscoveryToStr(const struct Upnp_Discovery *disco)
 
 // Each appropriate discovery event (executing in a libupnp thread
 // context) queues the following task object for processing by the
-// discovery thread.
+// discovery thread. The sequence number gives the arrival order,
+// which the queue does not preserve across priority lanes.
+static std::atomic<unsigned long> discoSeq(0);
 class DiscoveredTask {
 public:
 	DiscoveredTask(bool _alive, const struct Upnp_Discovery *disco)
 		: alive(_alive), url(disco->Location), deviceId(disco->DeviceId),
-		  expires(disco->Expires)
+		  expires(disco->Expires), seq(++discoSeq)
 		{}
 
 	bool alive;
 	string url;
 	string deviceId;
 	int expires; // Seconds valid
+	unsigned long seq;
 };
-static WorkQueue<DiscoveredTask*> discoveredQueue("DiscoveredQueue");
+// Many libupnp threads may be queueing at the same time: use the
+// lock-free queue. Departures and answers to our own searches (which
+// somebody is probably waiting for) go to the urgent lane, the
+// periodic ALIVE refreshes to the routine one.
+enum DiscoLane {discoLaneUrgent = 0, discoLaneRoutine = 1};
+static LFWorkQueue<DiscoveredTask*> discoveredQueue("DiscoveredQueue", 0, 1,
+													2);
 
 // Descriptor for one device having a Content Directory service found
 // on the network.
@@ -120,55 +134,137 @@ public:
 static ContentDirectoryPool contentDirectories;
 typedef map<string, ContentDirectoryDescriptor>::iterator DirPoolIt;
 
+// Process a discovery message: update the directory pool, after
+// fetching the description document for an ALIVE.
+static void processDiscovered(const DiscoveredTask *tsk)
+{
+	PLOGDEB("discoExplorer: alive %d deviceId [%s] URL [%s]\n",
+			tsk->alive, tsk->deviceId.c_str(), tsk->url.c_str());
+	if (!tsk->alive) {
+		// Device signals it is going off.
+		PTMutexLocker lock(contentDirectories.m_mutex);
+		DirPoolIt it = contentDirectories.m_directories.find(tsk->deviceId);
+		if (it != contentDirectories.m_directories.end()) {
+			contentDirectories.m_directories.erase(it);
+			PLOGDEB("discoExplorer: delete [%s]\n", tsk->deviceId.c_str());
+		}
+		return;
+	}
+
+	// Device signals its existence and well-being. Perform the
+	// UPnP "description" phase by downloading and decoding the
+	// description document. This is done without holding the pool lock.
+	char *buf;
+	// LINE_SIZE is defined by libupnp's upnp.h...
+	char contentType[LINE_SIZE];
+	TRACE_SPAN(fetchspan, Trace::DISCOFETCH, "description");
+	int code = UpnpDownloadUrlItem(tsk->url.c_str(), &buf, contentType);
+	if (code != UPNP_E_SUCCESS) {
+		cerr << LibUPnP::errAsString("discoExplorer", code) << endl;
+		return;
+	}
+	string sdesc(buf);
+	free(buf);
+	fetchspan.setValue(sdesc.size());
+	fetchspan.end();
+	PLOGDEB("discoExplorer: downloaded description document of "
+			"%d bytes\n", int(sdesc.size()));
+
+	// Update or insert the device
+	ContentDirectoryDescriptor d(tsk->url, sdesc, time(0), tsk->expires);
+	if (!d.device.ok) {
+		PLOGDEB("discoExplorer: description parse failed\n");
+		return;
+	}
+	PLOGDEB("discoExplorer: inserting id [%s]\n", tsk->deviceId.c_str());
+	PTMutexLocker lock(contentDirectories.m_mutex);
+	contentDirectories.m_directories[tsk->deviceId] = d;
+}
+
+// Max count of messages we process in one batch.
+static const size_t discoBatchSize = 64;
+
 // Worker routine for the discovery queue. Get messages about devices
 // appearing and disappearing, and update the directory pool
-// accordingly.
+// accordingly. 
+//
+// Devices typically send bursts of messages (one per embedded
+// device and service, repeated). We take the messages in batches and
+// only process the last one for each device: a later ALIVE supersedes
+// an earlier one, and the last message of an ALIVE/BYEBYE sequence
+// gives the final state.
+//
+// Because of the priority lanes, a BYEBYE may be processed before an
+// older ALIVE still sitting in the routine lane. We remember the
+// sequence number of the last BYEBYE for each device, and drop the
+// ALIVEs which predate it. The entries are only needed while older
+// messages may still be queued, so the table is reset whenever the
+// queue is found empty after a batch: devices which leave for good
+// are not remembered forever.
 static void *discoExplorer(void *)
 {
+	vector<DiscoveredTask*> tasks;
+	map<string, const DiscoveredTask*> lastfordev;
+	map<string, unsigned long> byebyeseq;
 	for (;;) {
-		DiscoveredTask *tsk = 0;
-		size_t qsz;
-		if (!discoveredQueue.take(&tsk, &qsz)) {
+		if (!discoveredQueue.takeUpTo(discoBatchSize, tasks)) {
 			discoveredQueue.workerExit();
 			return (void*)1;
 		}
-		PLOGDEB("discoExplorer: alive %d deviceId [%s] URL [%s]\n",
-				tsk->alive, tsk->deviceId.c_str(), tsk->url.c_str());
-		PTMutexLocker lock(contentDirectories.m_mutex);
-		if (!tsk->alive) {
-			// Device signals it is going off.
-			DirPoolIt it = contentDirectories.m_directories.find(tsk->deviceId);
-			if (it != contentDirectories.m_directories.end()) {
-				contentDirectories.m_directories.erase(it);
-				PLOGDEB("discoExplorer: delete [%s]\n", tsk->deviceId.c_str());
-			}
-		} else {
-			// Device signals its existence and well-being. Perform the
-			// UPnP "description" phase by downloading and decoding the
-			// description document.
-			char *buf;
-			// LINE_SIZE is defined by libupnp's upnp.h...
-			char contentType[LINE_SIZE];
-			int code = UpnpDownloadUrlItem(tsk->url.c_str(), &buf, contentType);
-			if (code != UPNP_E_SUCCESS) {
-				cerr << LibUPnP::errAsString("discoExplorer", code) << endl;
-				continue;
+
+		lastfordev.clear();
+		for (vector<DiscoveredTask*>::const_iterator it = tasks.begin();
+			 it != tasks.end(); it++) {
+			const DiscoveredTask*& last = lastfordev[(*it)->deviceId];
+			if (last == 0 || last->seq < (*it)->seq)
+				last = *it;
+		}
+		for (map<string, const DiscoveredTask*>::iterator it = 
+				 lastfordev.begin(); it != lastfordev.end(); it++) {
+			const DiscoveredTask *tsk = it->second;
+			map<string, unsigned long>::iterator bit = 
+				byebyeseq.find(tsk->deviceId);
+			if (!tsk->alive) {
+				byebyeseq[tsk->deviceId] = tsk->seq;
+			} else if (bit != byebyeseq.end()) {
+				if (bit->second > tsk->seq) {
+					PLOGDEB("discoExplorer: skipping ALIVE older than "
+							"BYEBYE for [%s]\n", tsk->deviceId.c_str());
+					it->second = 0;
+				} else {
+					byebyeseq.erase(bit);
+				}
 			}
-			string sdesc(buf);
-			PLOGDEB("discoExplorer: downloaded description document of "
-					"%d bytes\n", int(sdesc.size()));
-
-			// Update or insert the device
-			ContentDirectoryDescriptor d(tsk->url, sdesc,
-										 time(0), tsk->expires);
-			if (!d.device.ok) {
-				PLOGDEB("discoExplorer: description parse failed\n");
-				continue;
+		}
+		// Messages queued from now on are newer than any BYEBYE seen
+		if (!byebyeseq.empty() && discoveredQueue.qsize() == 0)
+			byebyeseq.clear();
+
+		// The remaining messages concern different devices, and the
+		// description fetches can be performed in parallel.
+		TaskPool *pool = TaskPool::getShared();
+		vector<std::future<void> > results;
+		for (vector<DiscoveredTask*>::iterator it = tasks.begin();
+			 it != tasks.end(); it++) {
+			const DiscoveredTask *tsk = *it;
+			if (lastfordev[tsk->deviceId] != tsk) {
+				PLOGDEB("discoExplorer: skipping superseded message "
+						"for [%s]\n", tsk->deviceId.c_str());
+			} else if (pool) {
+				results.push_back(pool->submit([tsk]() {
+							processDiscovered(tsk);
+						}));
+			} else {
+				processDiscovered(tsk);
 			}
-			PLOGDEB("discoExplorer: inserting id [%s]\n", tsk->deviceId.c_str());
-			contentDirectories.m_directories[tsk->deviceId] = d;
 		}
-		delete tsk;
+		for (unsigned int i = 0; i < results.size(); i++)
+			results[i].wait();
+
+		for (vector<DiscoveredTask*>::iterator it = tasks.begin();
+			 it != tasks.end(); it++) {
+			delete *it;
+		}
 	}
 }
 
@@ -176,13 +272,11 @@ static void *discoExplorer(void *)
 // events which we asked for.
 // Example: ContentDirectories appearing and disappearing from the network
 // We queue a task for our worker thread(s)
-// It seems that this can get called by several threads. We have a
-// mutex just for clarifying the message printing, the workqueue is
-// mt-safe of course.
-static PTMutexInit cblock;
+// This gets called by several threads concurrently. We used to have a
+// mutex here, but it only served to clarify the message printing and
+// made the callback threads convoy on the queue insertion.
 static int cluCallBack(Upnp_EventType et, void* evp, void*)
 {
-	PTMutexLocker lock(cblock);
 	PLOGDEB("cluCallBack: evt type: [%s]\n",
 			LibUPnP::evTypeAsString(et).c_str());
 
@@ -194,7 +288,9 @@ static int cluCallBack(Upnp_EventType et, void* evp, void*)
 		if (isMSDevice(disco->DeviceType) || isCDService(disco->ServiceType)) {
 			PLOGDEB("ALIVE : %s\n", cluDiscoveryToStr(disco).c_str());
 			DiscoveredTask *tp = new DiscoveredTask(1, disco);
-			if (discoveredQueue.put(tp)) {
+			int lane = et == UPNP_DISCOVERY_SEARCH_RESULT ? 
+				discoLaneUrgent : discoLaneRoutine;
+			if (discoveredQueue.put(tp, lane)) {
 				return UPNP_E_FINISH;
 			}
 		}
@@ -206,7 +302,7 @@ static int cluCallBack(Upnp_EventType et, void* evp, void*)
 
 		PLOGDEB("BYEBYE: %s\n", cluDiscoveryToStr(disco).c_str());
 		DiscoveredTask *tp = new DiscoveredTask(0, disco);
-		if (discoveredQueue.put(tp)) {
+		if (discoveredQueue.put(tp, discoLaneUrgent)) {
 			return UPNP_E_FINISH;
 		}
 		break;
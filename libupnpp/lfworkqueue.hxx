@@ -0,0 +1,640 @@
+/*	 Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _LFWORKQUEUE_H_INCLUDED_
+#define _LFWORKQUEUE_H_INCLUDED_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "ptmutex.hxx"
+#include "wqstats.hxx"
+
+/**
+ * Bounded lock-free multi-producer/multi-consumer ring (D. Vyukov's
+ * algorithm). Each cell carries a sequence number telling if it is
+ * ready for a producer or a consumer, so that producers and consumers
+ * only contend on their own position counter. The capacity is
+ * rounded up to a power of 2.
+ */
+template <class T> class MPMCRing {
+public:
+	MPMCRing(size_t capacity)
+	{
+		size_t cap = 2;
+		while (cap < capacity)
+			cap <<= 1;
+		m_mask = cap - 1;
+		m_cells = new Cell[cap];
+		for (size_t i = 0; i < cap; i++)
+			m_cells[i].seq.store(i, std::memory_order_relaxed);
+		m_enqpos.store(0, std::memory_order_relaxed);
+		m_deqpos.store(0, std::memory_order_relaxed);
+	}
+	~MPMCRing()
+	{
+		delete [] m_cells;
+	}
+
+	/** Add an element. Returns false if the ring is full */
+	bool tryPush(const T& t)
+	{
+		Cell *cell;
+		size_t pos = m_enqpos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &m_cells[pos & m_mask];
+			size_t seq = cell->seq.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if (dif == 0) {
+				if (m_enqpos.compare_exchange_weak(
+						pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = m_enqpos.load(std::memory_order_relaxed);
+			}
+		}
+		cell->data = t;
+		cell->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/** Extract an element. Returns false if the ring is empty */
+	bool tryPop(T& t)
+	{
+		Cell *cell;
+		size_t pos = m_deqpos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &m_cells[pos & m_mask];
+			size_t seq = cell->seq.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (dif == 0) {
+				if (m_deqpos.compare_exchange_weak(
+						pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = m_deqpos.load(std::memory_order_relaxed);
+			}
+		}
+		t = cell->data;
+		cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	/** Approximate count of elements (exact if no concurrent access) */
+	size_t size() const
+	{
+		size_t deq = m_deqpos.load(std::memory_order_acquire);
+		size_t enq = m_enqpos.load(std::memory_order_acquire);
+		return enq > deq ? enq - deq : 0;
+	}
+
+	size_t capacity() const {return m_mask + 1;}
+
+	/** Total count of elements extracted since creation */
+	size_t popped() const {return m_deqpos.load(std::memory_order_relaxed);}
+
+private:
+	struct Cell {
+		std::atomic<size_t> seq;
+		T data;
+	};
+	// Keep the position counters on separate cache lines
+	char m_pad0[64];
+	Cell *m_cells;
+	size_t m_mask;
+	char m_pad1[64];
+	std::atomic<size_t> m_enqpos;
+	char m_pad2[64];
+	std::atomic<size_t> m_deqpos;
+	char m_pad3[64];
+
+	MPMCRing(const MPMCRing&);
+	MPMCRing& operator=(const MPMCRing&);
+};
+
+/**
+ * Same interface and semantics as WorkQueue, but with the tasks
+ * stored in a lock-free ring instead of a mutex-protected queue.
+ *
+ * In the common case (ring neither empty nor full), put() and take()
+ * do not take any lock. Threads only sleep when they can't make
+ * progress, using an eventcount scheme: a waiter registers itself
+ * under the mutex, then checks the condition again before sleeping,
+ * while the other side only takes the mutex to signal if it sees a
+ * registered waiter.
+ *
+ * The ring is bounded: with hi == 0, the capacity is set to a default
+ * value and clients block when it is full.
+ *
+ * Priority lanes work as for WorkQueue, with one ring per lane. The
+ * aging counters are updated without synchronization, so the
+ * anti-starvation limit is approximate when several workers are
+ * taking concurrently.
+ *
+ * Like WorkQueue, the queue registers with the WQRegistry.
+ */
+template <class T> class LFWorkQueue : public WQStatsSource {
+public:
+
+	/** Create a LFWorkQueue
+	 * @param name for message printing
+	 * @param hi number of tasks on queue before clients blocks. Default 0
+	 *	  meaning the default ring capacity.
+	 * @param lo minimum count of tasks before worker starts. Default 1.
+	 * @param nlanes number of priority lanes. Default 1 (plain FIFO).
+	 */
+	LFWorkQueue(const std::string& name, size_t hi = 0, size_t lo = 1,
+				int nlanes = 1)
+		: m_name(name), m_high(hi), m_low(lo), m_agelimit(defaultAgeLimit),
+		  m_nthreads(0), m_workers_exited(0),
+		  m_workersleeps(0), m_clientsleeps(0)
+	{
+		for (int i = 0; i < (nlanes > 0 ? nlanes : 1); i++)
+			m_lanes.push_back(new Lane(hi ? hi : defaultCapacity));
+		m_ok = false;
+		m_clients_waiting = 0;
+		m_workers_waiting = 0;
+		m_tottasks = 0;
+		m_highwater = 0;
+		m_init = (pthread_cond_init(&m_ccond, 0) == 0) &&
+			(pthread_cond_init(&m_wcond, 0) == 0);
+		WQRegistry::add(this);
+	}
+
+	~LFWorkQueue()
+	{
+		WQRegistry::remove(this);
+		if (!m_worker_threads.empty())
+			setTerminateAndWait();
+		for (unsigned int i = 0; i < m_lanes.size(); i++)
+			delete m_lanes[i];
+	}
+
+	/** Start the worker threads.
+	 *
+	 * @param nworkers number of threads copies to start.
+	 * @param start_routine thread function. It should loop
+	 *		taking (QueueWorker::take()) and executing tasks.
+	 * @param arg initial parameter to thread function.
+	 * @return true if ok.
+	 */
+	bool start(int nworkers, void *(*workproc)(void *), void *arg)
+	{
+		PTMutexLocker lock(m_mutex);
+		if (!m_init || nworkers <= 0)
+			return false;
+		// Must be set before the workers begin calling take()
+		m_ok = true;
+		for	 (int i = 0; i < nworkers; i++) {
+			pthread_t thr;
+			if (pthread_create(&thr, 0, workproc, arg)) {
+				if (m_worker_threads.empty())
+					m_ok = false;
+				return false;
+			}
+			m_worker_threads.push_back(thr);
+			m_nthreads++;
+		}
+		return true;
+	}
+
+	/** Set the anti-starvation limit: the number of successive takes
+	 * which may pass over a non-empty lower priority lane. */
+	void setAgeLimit(unsigned int takes)
+	{
+		m_agelimit = takes;
+	}
+
+	/** Add item to work queue, called from client.
+	 *
+	 * Sleeps if there are already too many.
+	 * @param lane priority lane, 0 is the most urgent. The default (-1)
+	 *	 or any out of range value means the lowest priority lane.
+	 */
+	bool put(T t, int lane = -1)
+	{
+		lane = lanefix(lane);
+		for (;;) {
+			if (!ok())
+				return false;
+			if (tryPush(t, lane))
+				break;
+
+			// Full. Register as waiter, then check again before sleeping.
+			PTMutexLocker lock(m_mutex);
+			m_clients_waiting++;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (ok() && !hasRoom(lane)) {
+				m_clientsleeps++;
+				if (pthread_cond_wait(&m_ccond, lock.getMutex())) {
+					m_clients_waiting--;
+					return false;
+				}
+			}
+			m_clients_waiting--;
+		}
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_workers_waiting.load(std::memory_order_relaxed) > 0) {
+			// Just wake one worker, there is only one new task.
+			PTMutexLocker lock(m_mutex);
+			pthread_cond_signal(&m_wcond);
+		}
+		return true;
+	}
+
+	/** Add a batch of items to the work queue, called from client.
+	 *
+	 * There is a single worker wakeup for the batch. Sleeps if the
+	 * queue is full. All items go to the same lane.
+	 */
+	bool putMany(const std::vector<T>& tv, int lane = -1)
+	{
+		lane = lanefix(lane);
+		for (typename std::vector<T>::const_iterator it = tv.begin();
+			 it != tv.end(); it++) {
+			for (;;) {
+				if (!ok())
+					return false;
+				if (tryPush(*it, lane))
+					break;
+
+				PTMutexLocker lock(m_mutex);
+				// Let the workers process what we queued so far
+				if (m_workers_waiting.load() > 0)
+					pthread_cond_broadcast(&m_wcond);
+				m_clients_waiting++;
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (ok() && !hasRoom(lane)) {
+					m_clientsleeps++;
+					if (pthread_cond_wait(&m_ccond, lock.getMutex())) {
+						m_clients_waiting--;
+						return false;
+					}
+				}
+				m_clients_waiting--;
+			}
+		}
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_workers_waiting.load(std::memory_order_relaxed) > 0) {
+			PTMutexLocker lock(m_mutex);
+			if (tv.size() > 1)
+				pthread_cond_broadcast(&m_wcond);
+			else
+				pthread_cond_signal(&m_wcond);
+		}
+		return true;
+	}
+
+	/** Wait until the queue is inactive. Called from client.
+	 *
+	 * Waits until the task queue is empty and the workers are all
+	 * back sleeping. Same restrictions as WorkQueue::waitIdle().
+	 */
+	bool waitIdle()
+	{
+		PTMutexLocker lock(m_mutex);
+		if (!lock.ok() || !ok()) {
+			return false;
+		}
+
+		// We're done when the queue is empty AND all workers are back
+		// waiting for a task.
+		while (ok() && (ringsSize() > 0 ||
+						m_workers_waiting.load() != m_nthreads)) {
+			m_clients_waiting++;
+			if (pthread_cond_wait(&m_ccond, lock.getMutex())) {
+				m_clients_waiting--;
+				m_ok = false;
+				return false;
+			}
+			m_clients_waiting--;
+		}
+
+		return ok();
+	}
+
+	/** Tell the workers to exit, and wait for them.
+	 *
+	 * Does not bother about tasks possibly remaining on the queue, so
+	 * should be called after waitIdle() for an orderly shutdown.
+	 */
+	void* setTerminateAndWait()
+	{
+		PTMutexLocker lock(m_mutex);
+
+		if (m_worker_threads.empty()) {
+			// Already called ?
+			return (void*)0;
+		}
+
+		// Wait for all worker threads to have called workerExit()
+		m_ok = false;
+		pthread_cond_broadcast(&m_ccond);
+		while (m_workers_exited < m_worker_threads.size()) {
+			pthread_cond_broadcast(&m_wcond);
+			m_clients_waiting++;
+			if (pthread_cond_wait(&m_ccond, lock.getMutex())) {
+				m_clients_waiting--;
+				return (void*)0;
+			}
+			m_clients_waiting--;
+		}
+
+		// Perform the thread joins and compute overall status
+		// Workers return (void*)1 if ok
+		void *statusall = (void*)1;
+		for (unsigned int i = 0; i < m_worker_threads.size(); i++) {
+			void *status;
+			pthread_join(m_worker_threads[i], &status);
+			if (status == (void *)0)
+				statusall = status;
+		}
+		m_worker_threads.clear();
+
+		// Reset to start state. m_ok stays false until start()
+		m_nthreads = m_workers_exited = m_workersleeps = m_clientsleeps = 0;
+		return statusall;
+	}
+
+	/** Take task from queue. Called from worker.
+	 *
+	 * Sleeps if there are not enough. Signal if we go to sleep on empty
+	 * queue: client may be waiting for our going idle.
+	 */
+	bool take(T* tp, size_t *szp = 0)
+	{
+		wqServiceEnd(this, m_servicehist);
+		if (!waitTake(*tp))
+			return false;
+		m_tottasks.fetch_add(1, std::memory_order_relaxed);
+
+		if (szp)
+			*szp = ringsSize() + 1;
+
+		wakeClients();
+		return true;
+	}
+
+	/** Take up to n tasks from queue. Called from worker.
+	 *
+	 * Sleeps like take() if there are not enough, then moves all
+	 * available tasks, up to n, to the output vector (which is
+	 * cleared first). There is a single client wakeup for the batch.
+	 */
+	bool takeUpTo(size_t n, std::vector<T>& tv)
+	{
+		tv.clear();
+		if (n == 0)
+			return ok();
+		wqServiceEnd(this, m_servicehist);
+		T t;
+		if (!waitTake(t))
+			return false;
+		tv.push_back(t);
+		while (tv.size() < n && tryPop(t))
+			tv.push_back(t);
+		m_tottasks.fetch_add(tv.size(), std::memory_order_relaxed);
+
+		wakeClients();
+		return true;
+	}
+
+	/** Advertise exit and abort queue. Called from worker
+	 *
+	 * This would happen after an unrecoverable error, or when
+	 * the queue is terminated by the client. Workers never exit normally,
+	 * except when the queue is shut down (at which point m_ok is set to
+	 * false by the shutdown code anyway). The thread must return/exit
+	 * immediately after calling this.
+	 */
+	void workerExit()
+	{
+		PTMutexLocker lock(m_mutex);
+		m_workers_exited++;
+		m_ok = false;
+		pthread_cond_broadcast(&m_ccond);
+	}
+
+	size_t qsize()
+	{
+		return ringsSize();
+	}
+
+	virtual void getStats(WQStats& stats)
+	{
+		stats.name = m_name;
+		stats.depth = ringsSize();
+		stats.highwater = m_highwater.load();
+		stats.tasks = m_tottasks.load();
+		m_waithist.snapshot(stats.wait);
+		m_servicehist.snapshot(stats.service);
+		PTMutexLocker lock(m_mutex);
+		stats.workers = m_nthreads;
+		stats.workersleeps = m_workersleeps;
+		stats.clientsleeps = m_clientsleeps;
+	}
+
+private:
+	enum {defaultCapacity = 1024, defaultAgeLimit = 8};
+
+	// Task with its queueing time
+	struct Item {
+		T t;
+		long long enq;
+	};
+
+	struct Lane {
+		Lane(size_t capacity) : ring(capacity), skips(0) {}
+		MPMCRing<Item> ring;
+		std::atomic<unsigned int> skips;
+	};
+
+	int lanefix(int lane)
+	{
+		if (lane < 0 || lane >= int(m_lanes.size()))
+			lane = m_lanes.size() - 1;
+		return lane;
+	}
+
+	size_t ringsSize()
+	{
+		size_t sz = 0;
+		for (unsigned int i = 0; i < m_lanes.size(); i++)
+			sz += m_lanes[i]->ring.size();
+		return sz;
+	}
+
+	bool tryPush(const T& t, int lane)
+	{
+		size_t sz = ringsSize();
+		if (m_high != 0 && sz >= m_high)
+			return false;
+		Item item;
+		item.t = t;
+		item.enq = wqnow();
+		if (!m_lanes[lane]->ring.tryPush(item))
+			return false;
+		// Approximate, good enough for statistics
+		sz++;
+		size_t hw = m_highwater.load(std::memory_order_relaxed);
+		while (sz > hw && !m_highwater.compare_exchange_weak(hw, sz))
+			;
+		return true;
+	}
+
+	// Pop from the first non-empty lane, or from a lower priority lane
+	// which has been passed over too many times.
+	bool tryPop(T& t)
+	{
+		Item item;
+		unsigned int nlanes = m_lanes.size();
+		unsigned int top = 0;
+		while (top < nlanes && m_lanes[top]->ring.size() == 0)
+			top++;
+		if (top == nlanes)
+			return false;
+		unsigned int sel = top;
+		for (unsigned int i = top + 1; i < nlanes; i++) {
+			if (m_lanes[i]->ring.size() != 0 &&
+				m_lanes[i]->skips.load(std::memory_order_relaxed) >=
+				m_agelimit) {
+				sel = i;
+				break;
+			}
+		}
+		if (!m_lanes[sel]->ring.tryPop(item)) {
+			// Lost a race with another worker: take whatever is there
+			for (sel = 0; sel < nlanes; sel++)
+				if (m_lanes[sel]->ring.tryPop(item))
+					break;
+			if (sel == nlanes)
+				return false;
+		}
+		for (unsigned int i = 0; i < nlanes; i++) {
+			if (i != sel && m_lanes[i]->ring.size() != 0)
+				m_lanes[i]->skips.fetch_add(1, std::memory_order_relaxed);
+		}
+		m_lanes[sel]->skips.store(0, std::memory_order_relaxed);
+		t = item.t;
+		long long now = wqnow();
+		m_waithist.add(now - item.enq);
+		wqServiceStart(this, now);
+		return true;
+	}
+
+	bool ok()
+	{
+		return m_ok.load(std::memory_order_acquire);
+	}
+
+	// Get one task, sleeping if there are not enough
+	bool waitTake(T& t)
+	{
+		for (;;) {
+			if (!ok())
+				return false;
+			if ((m_low <= 1 || ringsSize() >= m_low) && tryPop(t))
+				return true;
+
+			// Not enough tasks. Register as waiter, then check again
+			// before sleeping.
+			PTMutexLocker lock(m_mutex);
+			m_workers_waiting++;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (ok() && ringsSize() < m_low) {
+				m_workersleeps++;
+				if (ringsSize() == 0 && m_clients_waiting.load() > 0)
+					pthread_cond_broadcast(&m_ccond);
+				if (pthread_cond_wait(&m_wcond, lock.getMutex())) {
+					m_workers_waiting--;
+					return false;
+				}
+			}
+			m_workers_waiting--;
+		}
+	}
+
+	// Called by a worker after taking tasks
+	void wakeClients()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_clients_waiting.load(std::memory_order_relaxed) > 0) {
+			// The clients may be waiting for room in the queue, or
+			// for idleness, so wake them all.
+			PTMutexLocker lock(m_mutex);
+			pthread_cond_broadcast(&m_ccond);
+		}
+	}
+
+	bool hasRoom(int lane)
+	{
+		const MPMCRing<Item>& ring = m_lanes[lane]->ring;
+		return ring.size() < ring.capacity() &&
+			(m_high == 0 || ringsSize() < m_high);
+	}
+
+	// Configuration
+	std::string m_name;
+	size_t m_high;
+	size_t m_low;
+
+	std::atomic<unsigned int> m_agelimit;
+
+	// One ring per priority lane. Lanes are not copyable (atomics)
+	std::vector<Lane*> m_lanes;
+
+	// Status. m_ok is true between start() and the first workerExit()
+	// or setTerminateAndWait()
+	std::atomic<bool> m_ok;
+	bool m_init;
+	unsigned int m_nthreads;
+	unsigned int m_workers_exited;
+	std::vector<pthread_t> m_worker_threads;
+
+	// Slow path synchronization
+	pthread_cond_t m_ccond;
+	pthread_cond_t m_wcond;
+	PTMutexInit m_mutex;
+	// Client/Worker threads currently registered as waiters
+	std::atomic<unsigned int> m_clients_waiting;
+	std::atomic<unsigned int> m_workers_waiting;
+
+	// Statistics (sleep counts updated under the mutex)
+	unsigned int m_workersleeps;
+	unsigned int m_clientsleeps;
+	std::atomic<unsigned long long> m_tottasks;
+	std::atomic<size_t> m_highwater;
+	WQHisto m_waithist;
+	WQHisto m_servicehist;
+};
+
+#endif /* _LFWORKQUEUE_H_INCLUDED_ */
+/* Local Variables: */
+/* mode: c++ */
+/* c-basic-offset: 4 */
+/* tab-width: 4 */
+/* indent-tabs-mode: t */
+/* End: */
@@ -17,36 +17,299 @@
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
 
 using namespace std;
 
 #include "log.hxx"
+#include "lfworkqueue.hxx"
 
 namespace upnppdebug {
 
+// Max count of messages waiting for the writer thread
+static const size_t logQueueSize = 8192;
+// Max count of messages written by one writev()
+static const int logBatchSize = 64;
+
+static Logger *theLog;
+
+class Logger::Internal {
+public:
+    Internal(int _fd)
+        : fd(_fd), ring(logQueueSize), reported(0) {
+        writersleeping = false;
+        running = false;
+        dropped = 0;
+        pthread_cond_init(&cond, 0);
+    }
+    // Write out the queued messages. Returns true if there were any
+    bool drain();
+    // Start the writer thread if it's not running
+    void start();
+    static void *writer(void *);
+    static void atforkPrepare();
+    static void atforkParent();
+    static void atforkChild();
+
+    int fd;
+    MPMCRing<string*> ring;
+    // Serializes the writes between the writer thread and flush()
+    PTMutexInit wmutex;
+    // Writer thread sleep/wakeup
+    PTMutexInit mutex;
+    pthread_cond_t cond;
+    std::atomic<bool> writersleeping;
+    std::atomic<bool> running;
+    std::atomic<unsigned long> dropped;
+    // Dropped count at the time of the last report (under wmutex)
+    unsigned long reported;
+};
+
+static void writeAll(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        // Skip what was written, possibly a partial vector
+        while (cnt > 0 && size_t(n) >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+bool Logger::Internal::drain()
+{
+    PTMutexLocker lock(wmutex);
+    bool didsomething = false;
+    string *msgs[logBatchSize];
+    struct iovec iov[logBatchSize + 1];
+    for (;;) {
+        int n = 0;
+        while (n < logBatchSize && ring.tryPop(msgs[n]))
+            n++;
+        string dropmsg;
+        unsigned long drops = dropped.load();
+        if (drops != reported) {
+            ostringstream str;
+            str << "Logger: " << drops - reported << 
+                " messages dropped" << endl;
+            dropmsg = str.str();
+            reported = drops;
+        }
+        if (n == 0 && dropmsg.empty())
+            return didsomething;
+
+        int cnt = 0;
+        for (int i = 0; i < n; i++) {
+            iov[cnt].iov_base = (void *)msgs[i]->data();
+            iov[cnt].iov_len = msgs[i]->size();
+            cnt++;
+        }
+        if (!dropmsg.empty()) {
+            iov[cnt].iov_base = (void *)dropmsg.data();
+            iov[cnt].iov_len = dropmsg.size();
+            cnt++;
+        }
+        writeAll(fd, iov, cnt);
+        for (int i = 0; i < n; i++)
+            delete msgs[i];
+        didsomething = true;
+    }
+}
+
+void *Logger::Internal::writer(void *arg)
+{
+    Internal *m = (Internal *)arg;
+    for (;;) {
+        if (m->drain())
+            continue;
+        // Nothing to do. Register as sleeper, then check again
+        // before sleeping (see LFWorkQueue).
+        PTMutexLocker lock(m->mutex);
+        m->writersleeping = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m->ring.size() == 0)
+            pthread_cond_wait(&m->cond, lock.getMutex());
+        m->writersleeping = false;
+    }
+    return 0;
+}
+
+void Logger::Internal::start()
+{
+    if (running.load(std::memory_order_acquire))
+        return;
+    PTMutexLocker lock(mutex);
+    if (running.load())
+        return;
+    pthread_t thr;
+    if (pthread_create(&thr, 0, writer, this) == 0) {
+        pthread_detach(thr);
+        running = true;
+    }
+}
+
+// The writer thread does not survive a fork (daemon()). Write the
+// queued messages and make sure that no lock is held by the writer
+// while forking. A new writer is started in the child when needed.
+void Logger::Internal::atforkPrepare()
+{
+    if (theLog == 0)
+        return;
+    theLog->flush();
+    pthread_mutex_lock(&theLog->m->wmutex.m_mutex);
+    pthread_mutex_lock(&theLog->m->mutex.m_mutex);
+}
+void Logger::Internal::atforkParent()
+{
+    if (theLog == 0)
+        return;
+    pthread_mutex_unlock(&theLog->m->mutex.m_mutex);
+    pthread_mutex_unlock(&theLog->m->wmutex.m_mutex);
+}
+void Logger::Internal::atforkChild()
+{
+    if (theLog == 0)
+        return;
+    Logger::Internal *m = theLog->m;
+    pthread_mutex_unlock(&m->mutex.m_mutex);
+    pthread_mutex_unlock(&m->wmutex.m_mutex);
+    pthread_cond_init(&m->cond, 0);
+    m->writersleeping = false;
+    m->running = false;
+}
+
+std::atomic<int> Logger::s_loglevel(LLDEB);
+
 Logger::Logger(const std::string& fn) 
-    : m_tocerr(false), m_loglevel(LLDEB)
 {
+    int fd = 2;
     if (!fn.empty() && fn.compare("stderr")) {
-        m_stream.open(fn, std::fstream::out | std::ofstream::trunc);
-        if (!m_stream.is_open()) {
+        fd = open(fn.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+        if (fd < 0) {
             cerr << "Logger::Logger: log open failed: for [" <<
                 fn << "] errno " << errno << endl;
-            m_tocerr = true;
+            fd = 2;
         }
-    } else {
-        m_tocerr = true;
     }
+    m = new Internal(fd);
 }
 
-static Logger *theLog;
+void Logger::submit(string *msg)
+{
+    m->start();
+    if (!m->running.load(std::memory_order_relaxed)) {
+        // No writer thread. Write it ourselves
+        struct iovec iov;
+        iov.iov_base = (void *)msg->data();
+        iov.iov_len = msg->size();
+        PTMutexLocker lock(m->wmutex);
+        writeAll(m->fd, &iov, 1);
+        delete msg;
+        return;
+    }
+    if (!m->ring.tryPush(msg)) {
+        m->dropped++;
+        delete msg;
+        return;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m->writersleeping.load(std::memory_order_relaxed)) {
+        PTMutexLocker lock(m->mutex);
+        pthread_cond_signal(&m->cond);
+    }
+}
+
+void Logger::flush()
+{
+    m->drain();
+}
+
+unsigned long Logger::dropped()
+{
+    return m->dropped.load();
+}
+
+static void flushAtExit()
+{
+    if (theLog)
+        theLog->flush();
+}
 
 Logger *Logger::getTheLog(const string& fn)
 {
-    if (theLog == 0)
+    if (theLog == 0) {
         theLog = new Logger(fn);
+        atexit(flushAtExit);
+        pthread_atfork(Internal::atforkPrepare, Internal::atforkParent,
+                       Internal::atforkChild);
+    }
     return theLog;
 }
 
+struct LogRecord::ThreadBuf {
+    ThreadBuf() : busy(false) {}
+    ostringstream stream;
+    bool busy;
+};
+
+static pthread_key_t bufkey;
+static pthread_once_t bufkeyonce = PTHREAD_ONCE_INIT;
+static void deleteThreadBuf(void *buf)
+{
+    delete (LogRecord::ThreadBuf *)buf;
+}
+static void initBufKey()
+{
+    pthread_key_create(&bufkey, deleteThreadBuf);
+}
+
+LogRecord::LogRecord()
+{
+    pthread_once(&bufkeyonce, initBufKey);
+    m_buf = (ThreadBuf *)pthread_getspecific(bufkey);
+    if (m_buf == 0) {
+        m_buf = new ThreadBuf;
+        pthread_setspecific(bufkey, m_buf);
+    }
+    if (m_buf->busy) {
+        // A log argument is logging something itself
+        m_buf = 0;
+        m_stream = new ostringstream;
+    } else {
+        m_buf->busy = true;
+        m_stream = &m_buf->stream;
+    }
+}
+
+LogRecord::~LogRecord()
+{
+    Logger::getTheLog("")->submit(new string(m_stream->str()));
+    if (m_buf) {
+        m_buf->stream.str(string());
+        m_buf->stream.clear();
+        m_buf->busy = false;
+    } else {
+        delete m_stream;
+    }
 }
 
+}
@@ -17,66 +17,110 @@
 #ifndef _LOG_H_X_INCLUDED_
 #define _LOG_H_X_INCLUDED_
 
-#include <iostream>
-#include <fstream>
+#include <atomic>
+#include <sstream>
 #include <string>
 
 namespace upnppdebug {
 
+    /** 
+     * The log messages are formatted by the calling thread into a
+     * per-thread buffer, then handed off through a lock-free ring to
+     * a background thread which performs the actual writes, in
+     * batches. The ring is bounded: if the writer can't keep up,
+     * messages are dropped and counted, the calling thread never
+     * waits. 
+     */
     class Logger {
     public:
         static Logger *getTheLog(const std::string& fn);
-        std::ostream& getstream() {
-            return m_tocerr ? std::cerr : m_stream;
-        }
         enum LogLevel {LLNON, LLFAT, LLERR, LLINF, LLDEB};
         void setLogLevel(LogLevel level) {
-            m_loglevel = level;
+            s_loglevel.store(level, std::memory_order_relaxed);
         }
         int getloglevel() {
-            return m_loglevel;
+            return s_loglevel.load(std::memory_order_relaxed);
         }
-        
+        /** The current level, for the log macros: a single atomic
+            load, the logger needs not exist yet. */
+        static std::atomic<int> s_loglevel;
+        /** Queue a formatted message for writing. Takes ownership */
+        void submit(std::string *msg);
+        /** Write out all the queued messages before returning */
+        void flush();
+        /** Count of messages dropped because the queue was full */
+        unsigned long dropped();
+
+        class Internal;
     private:
-        bool m_tocerr;
-        int m_loglevel;
-        std::ofstream m_stream;
-        
+        Internal *m;
+
         Logger(const std::string& fn);
 	Logger(const Logger &);
 	Logger& operator=(const Logger &);
     };
-        
+
+    /** 
+     * Temporary object used by the log macros: stream() returns the
+     * calling thread's formatting buffer, and the message is
+     * submitted by the destructor, at the end of the statement.
+     */
+    class LogRecord {
+    public:
+        LogRecord();
+        ~LogRecord();
+        std::ostream& stream() {
+            return *m_stream;
+        }
+        struct ThreadBuf;
+    private:
+        std::ostringstream *m_stream;
+        // The thread buffer, or null if it was busy (recursive
+        // logging), in which case m_stream is a local one.
+        ThreadBuf *m_buf;
+    };
 }
 
-#define DEBOUT (upnppdebug::Logger::getTheLog("")->getstream())
-#define LOGLEVEL (upnppdebug::Logger::getTheLog("")->getloglevel())
+// Messages above this level are not compiled at all (set by configure)
+#ifndef LOGGER_STATICVERBOSITY
+#define LOGGER_STATICVERBOSITY 4
+#endif
+
+#define DEBOUT (upnppdebug::LogRecord().stream())
+#define LOGLEVEL (upnppdebug::Logger::s_loglevel.load(std::memory_order_relaxed))
+
+// Test if a level is enabled. Use it to guard the computation of
+// expensive log arguments which need cleaning up afterwards.
+#define LOGGER_LEVEL_ENABLED(L) \
+    (LOGGER_STATICVERBOSITY >= (L) && LOGLEVEL >= (L))
 
 #define LOGDEB(X) {                                                     \
-        if (LOGLEVEL >= upnppdebug::Logger::LLDEB) \
+        if (LOGGER_LEVEL_ENABLED(upnppdebug::Logger::LLDEB))            \
         {                                                               \
-            DEBOUT << __FILE__ << ":" << __LINE__<< "::"; DEBOUT << X;  \
+            DEBOUT << __FILE__ << ":" << __LINE__<< "::" << X;          \
         }                                                               \
     }
 
 #define LOGINF(X) {                                                     \
-        if (LOGLEVEL >= upnppdebug::Logger::LLINF)                  \
+        if (LOGGER_LEVEL_ENABLED(upnppdebug::Logger::LLINF))            \
         {                                                               \
-            DEBOUT << __FILE__ << ":" << __LINE__<< "::"; DEBOUT << X;  \
+            DEBOUT << __FILE__ << ":" << __LINE__<< "::" << X;          \
         }                                                               \
     }                                                                   
 
 #define LOGERR(X) {                                                     \
-        if (LOGLEVEL >= upnppdebug::Logger::LLERR)                  \
+        if (LOGGER_LEVEL_ENABLED(upnppdebug::Logger::LLERR))            \
         {                                                               \
-            DEBOUT << __FILE__ << ":" << __LINE__<< "::"; DEBOUT << X;  \
+            DEBOUT << __FILE__ << ":" << __LINE__<< "::" << X;          \
         }                                                               \
     }
 
+// Fatal messages are usually followed by an exit: write them now.
 #define LOGFAT(X) {                                                     \
-        if (LOGLEVEL >= upnppdebug::Logger::LLFAT)                  \
+        if (LOGGER_LEVEL_ENABLED(upnppdebug::Logger::LLFAT))            \
         {                                                               \
-            DEBOUT << __FILE__ << ":" << __LINE__<< "::"; DEBOUT << X;  \
+            DEBOUT << __FILE__ << ":" << __LINE__<< "::" << X;          \
+            upnppdebug::Logger::getTheLog("")->flush();                 \
         }                                                               \
     }
 
@@ -0,0 +1,194 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <map>
+#include <sstream>
+#include <vector>
+using namespace std;
+
+#include "ptmutex.hxx"
+#include "wqstats.hxx"
+#include "metrics.hxx"
+
+const double MetricHisto::bounds[nbuckets] = {
+	0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+	1, 2.5, 5, 10
+};
+
+MetricHisto::MetricHisto()
+	: m_count(0), m_sumns(0)
+{
+	for (int i = 0; i <= nbuckets; i++)
+		m_buckets[i] = 0;
+}
+
+void MetricHisto::observe(long long ns)
+{
+	double secs = ns / 1e9;
+	int i = 0;
+	while (i < nbuckets && secs > bounds[i])
+		i++;
+	m_buckets[i].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_sumns.fetch_add(ns > 0 ? ns : 0, std::memory_order_relaxed);
+}
+
+// All the metrics with the same name. Only one of the maps is used,
+// depending on the type.
+struct MetricFamily {
+	string help;
+	map<string, MetricCounter*> counters;
+	map<string, MetricHisto*> histos;
+};
+
+// The metrics may be used from static objects' constructors.
+static PTMutexInit& metricsMutex()
+{
+	static PTMutexInit mutex;
+	return mutex;
+}
+static map<string, MetricFamily>& metricFamilies()
+{
+	static map<string, MetricFamily> families;
+	return families;
+}
+
+MetricCounter *Metrics::counter(const string& name, const string& help,
+								const string& labels)
+{
+	PTMutexLocker lock(metricsMutex());
+	MetricFamily& family = metricFamilies()[name];
+	family.help = help;
+	MetricCounter*& counter = family.counters[labels];
+	if (counter == 0)
+		counter = new MetricCounter;
+	return counter;
+}
+
+MetricHisto *Metrics::histogram(const string& name, const string& help,
+								const string& labels)
+{
+	PTMutexLocker lock(metricsMutex());
+	MetricFamily& family = metricFamilies()[name];
+	family.help = help;
+	MetricHisto*& histo = family.histos[labels];
+	if (histo == 0)
+		histo = new MetricHisto;
+	return histo;
+}
+
+string Metrics::label(const string& name, const string& value)
+{
+	string out(name);
+	out += "=\"";
+	for (unsigned int i = 0; i < value.size(); i++) {
+		switch (value[i]) {
+		case '\\': out += "\\\\"; break;
+		case '"': out += "\\\""; break;
+		case '\n': out += "\\n"; break;
+		default: out += value[i];
+		}
+	}
+	out += '"';
+	return out;
+}
+
+// Add a label to a possibly empty label list, and enclose in braces
+static string withLabel(const string& labels, const string& more)
+{
+	if (labels.empty())
+		return more.empty() ? string() : "{" + more + "}";
+	return "{" + labels + (more.empty() ? "" : ",") + more + "}";
+}
+
+static void renderQueues(ostringstream& out)
+{
+	vector<WQStats> stats;
+	WQRegistry::getAll(stats);
+	if (stats.empty())
+		return;
+	out << "# HELP workqueue_depth Current count of tasks on queue\n"
+		"# TYPE workqueue_depth gauge\n";
+	for (unsigned int i = 0; i < stats.size(); i++)
+		out << "workqueue_depth{" << Metrics::label("queue", stats[i].name) <<
+			"} " << stats[i].depth << "\n";
+	out << "# HELP workqueue_highwater Maximum count of tasks on queue\n"
+		"# TYPE workqueue_highwater gauge\n";
+	for (unsigned int i = 0; i < stats.size(); i++)
+		out << "workqueue_highwater{" <<
+			Metrics::label("queue", stats[i].name) << "} " <<
+			stats[i].highwater << "\n";
+	out << "# HELP workqueue_tasks_total Tasks taken by the workers\n"
+		"# TYPE workqueue_tasks_total counter\n";
+	for (unsigned int i = 0; i < stats.size(); i++)
+		out << "workqueue_tasks_total{" <<
+			Metrics::label("queue", stats[i].name) << "} " <<
+			stats[i].tasks << "\n";
+}
+
+string Metrics::render()
+{
+	ostringstream out;
+	// The default precision is not enough for the sums
+	out.precision(12);
+	{
+		PTMutexLocker lock(metricsMutex());
+		map<string, MetricFamily>& families = metricFamilies();
+		for (map<string, MetricFamily>::const_iterator fit =
+				 families.begin(); fit != families.end(); fit++) {
+			const string& name = fit->first;
+			const MetricFamily& family = fit->second;
+			out << "# HELP " << name << " " << family.help << "\n";
+			if (!family.counters.empty()) {
+				out << "# TYPE " << name << " counter\n";
+				for (map<string, MetricCounter*>::const_iterator it =
+						 family.counters.begin();
+					 it != family.counters.end(); it++) {
+					out << name << withLabel(it->first, "") << " " <<
+						it->second->value() << "\n";
+				}
+			} else {
+				out << "# TYPE " << name << " histogram\n";
+				for (map<string, MetricHisto*>::const_iterator it =
+						 family.histos.begin();
+					 it != family.histos.end(); it++) {
+					const MetricHisto *histo = it->second;
+					unsigned long long cumul = 0;
+					for (int i = 0; i < MetricHisto::nbuckets; i++) {
+						cumul += histo->bucket(i);
+						ostringstream le;
+						le << "le=\"" << MetricHisto::bounds[i] << "\"";
+						out << name << "_bucket" <<
+							withLabel(it->first, le.str()) << " " <<
+							cumul << "\n";
+					}
+					cumul += histo->bucket(MetricHisto::nbuckets);
+					out << name << "_bucket" <<
+						withLabel(it->first, "le=\"+Inf\"") << " " <<
+						cumul << "\n";
+					out << name << "_sum" << withLabel(it->first, "") <<
+						" " << histo->sumSeconds() << "\n";
+					out << name << "_count" << withLabel(it->first, "") <<
+						" " << cumul << "\n";
+				}
+			}
+		}
+	}
+	renderQueues(out);
+	return out.str();
+}
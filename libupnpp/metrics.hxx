@@ -0,0 +1,120 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _METRICS_H_X_INCLUDED_
+#define _METRICS_H_X_INCLUDED_
+
+#include <time.h>
+
+#include <atomic>
+#include <string>
+
+/**
+ * Process-wide counters and latency histograms, which can be rendered
+ * in the Prometheus text exposition format.
+ *
+ * A metric is identified by its name and label set (in Prometheus
+ * syntax, e.g.: action="Play"). The lookup functions create the
+ * metric if needed and return a pointer which stays valid for the
+ * life of the process, so that call sites with constant labels can
+ * look it up once. Updates are lock-free.
+ */
+class MetricCounter {
+public:
+	MetricCounter() : m_value(0) {}
+	void inc(unsigned long long n = 1)
+	{
+		m_value.fetch_add(n, std::memory_order_relaxed);
+	}
+	unsigned long long value() const
+	{
+		return m_value.load(std::memory_order_relaxed);
+	}
+private:
+	std::atomic<unsigned long long> m_value;
+};
+
+/** Duration histogram with fixed buckets, from 500 uS to 10 S */
+class MetricHisto {
+public:
+	enum {nbuckets = 14};
+	static const double bounds[nbuckets]; // Seconds
+	MetricHisto();
+	void observe(long long ns);
+	unsigned long long bucket(int i) const
+	{
+		return m_buckets[i].load(std::memory_order_relaxed);
+	}
+	unsigned long long count() const
+	{
+		return m_count.load(std::memory_order_relaxed);
+	}
+	double sumSeconds() const
+	{
+		return m_sumns.load(std::memory_order_relaxed) / 1e9;
+	}
+private:
+	// Non-cumulative counts, the last one is for +Inf
+	std::atomic<unsigned long long> m_buckets[nbuckets + 1];
+	std::atomic<unsigned long long> m_count;
+	std::atomic<unsigned long long> m_sumns;
+};
+
+class Metrics {
+public:
+	static MetricCounter *counter(const std::string& name,
+								  const std::string& help,
+								  const std::string& labels = std::string());
+	static MetricHisto *histogram(const std::string& name,
+								  const std::string& help,
+								  const std::string& labels = std::string());
+	/** Build a label string, quoting the value as needed */
+	static std::string label(const std::string& name,
+							 const std::string& value);
+	/** Produce the text document for all the metrics. This includes
+	 * the work queue statistics from the WQRegistry. */
+	static std::string render();
+
+	static long long now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	}
+};
+
+/** Record the duration of a scope into a histogram */
+class MetricTimer {
+public:
+	MetricTimer(MetricHisto *histo)
+		: m_histo(histo), m_start(Metrics::now())
+	{}
+	~MetricTimer()
+	{
+		m_histo->observe(Metrics::now() - m_start);
+	}
+private:
+	MetricHisto *m_histo;
+	long long m_start;
+};
+
+#endif /* _METRICS_H_X_INCLUDED_ */
+/* Local Variables: */
+/* mode: c++ */
+/* c-basic-offset: 4 */
+/* tab-width: 4 */
+/* indent-tabs-mode: t */
+/* End: */
@@ -16,6 +16,13 @@
  */
 #include "config.h"
 
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <iostream>
 using namespace std;
 
@@ -109,3 +116,103 @@ IXML_Document *buildSoapBody(SoapData& data)
     
     return doc;
 }
+
+// Replacement string for a character which needs escaping, null for the
+// others.
+static inline const char *xmlentity(char c)
+{
+    switch (c) {
+    case '"': return "&quot;";
+    case '&': return "&amp;";
+    case '<': return "&lt;";
+    case '>': return "&gt;";
+    case '\'': return "&apos;";
+    default: return 0;
+    }
+}
+
+// Return the length of the initial segment of the input which needs
+// no escaping.
+static size_t xmlcleanspan(const char *in, size_t len)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i q = _mm256_set1_epi8('"');
+    const __m256i a = _mm256_set1_epi8('&');
+    const __m256i l = _mm256_set1_epi8('<');
+    const __m256i g = _mm256_set1_epi8('>');
+    const __m256i p = _mm256_set1_epi8('\'');
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, q), _mm256_cmpeq_epi8(v, a)),
+            _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, l),
+                                _mm256_cmpeq_epi8(v, g)),
+                _mm256_cmpeq_epi8(v, p)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128i q = _mm_set1_epi8('"');
+    const __m128i a = _mm_set1_epi8('&');
+    const __m128i l = _mm_set1_epi8('<');
+    const __m128i g = _mm_set1_epi8('>');
+    const __m128i p = _mm_set1_epi8('\'');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, a)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, l),
+                                      _mm_cmpeq_epi8(v, g)),
+                         _mm_cmpeq_epi8(v, p)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < len; i++) {
+        if (xmlentity(in[i]))
+            return i;
+    }
+    return len;
+}
+
+void xmlquote_append(string& out, const char *in, size_t len, bool twice)
+{
+    size_t clean = xmlcleanspan(in, len);
+    if (clean == len) {
+        // Most common case: nothing to escape
+        out.append(in, len);
+        return;
+    }
+
+    // Estimate: a few entities for the rest of the data. The string
+    // will grow normally if this is too small.
+    out.reserve(out.size() + len + (twice ? 10 : 6) * 4);
+    for (;;) {
+        out.append(in, clean);
+        in += clean;
+        len -= clean;
+        if (len == 0)
+            break;
+        if (twice) {
+            // "&lt;" -> "&amp;lt;"
+            out.append("&amp;");
+            out.append(xmlentity(*in) + 1);
+        } else {
+            out.append(xmlentity(*in));
+        }
+        in++;
+        len--;
+        clean = xmlcleanspan(in, len);
+    }
+}
+
+string xmlquote(const string& in)
+{
+    string out;
+    xmlquote_append(out, in);
+    return out;
+}
@@ -62,4 +62,24 @@ public:
 /** Build a SOAP response data XML document from a list of values */
 extern IXML_Document *buildSoapBody(SoapData& data);
 
+/** Escape XML special characters (<>&"'), appending the result to out.
+ *
+ * Clean runs of input are found several bytes at a time (using SSE2/AVX2
+ * if available) and copied in bulk.
+ *
+ * If twice is set, the output is escaped for two levels of XML
+ * nesting (as if xmlquote() had been applied twice), which is what
+ * is needed for the values inside an event LastChange document.
+ */
+extern void xmlquote_append(std::string& out, const char *in, size_t len,
+                            bool twice = false);
+inline void xmlquote_append(std::string& out, const std::string& in,
+                            bool twice = false)
+{
+    xmlquote_append(out, in.c_str(), in.size(), twice);
+}
+
+/** Escape XML special characters, returning a new string */
+extern std::string xmlquote(const std::string& in);
+
 #endif /* _SOAPHELP_H_X_INCLUDED_ */
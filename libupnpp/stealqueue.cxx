@@ -0,0 +1,44 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <unistd.h>
+
+#include "upnpp_p.hxx"
+#include "stealqueue.hxx"
+
+static TaskPool *theSharedPool;
+static pthread_once_t sharedPoolOnce = PTHREAD_ONCE_INIT;
+
+static void initSharedPool()
+{
+	long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nprocs < 2)
+		nprocs = 2;
+	else if (nprocs > 8)
+		nprocs = 8;
+	theSharedPool = new TaskPool("SharedTaskPool");
+	if (!theSharedPool->start(int(nprocs))) {
+		PLOGINF("TaskPool: could not start the shared pool threads\n");
+	}
+}
+
+TaskPool *TaskPool::getShared()
+{
+	pthread_once(&sharedPoolOnce, initSharedPool);
+	return theSharedPool;
+}
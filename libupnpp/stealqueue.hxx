@@ -0,0 +1,499 @@
+/*	 Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _STEALQUEUE_H_INCLUDED_
+#define _STEALQUEUE_H_INCLUDED_
+
+#include <pthread.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ptmutex.hxx"
+#include "wqstats.hxx"
+
+/**
+ * A work queue with one task deque per worker thread, and work
+ * stealing between workers.
+ *
+ * The interface is the same as WorkQueue's (start(), put(), take(),
+ * waitIdle(), setTerminateAndWait(), workerExit()), so existing users
+ * can switch by changing the type. There is no global lock on the
+ * task path:
+ *  - A task put by a worker thread goes to its own deque, others are
+ *    spread over the deques in turn.
+ *  - A worker takes from the front of its own deque (so that a single
+ *    worker sees the tasks in order), else it steals from the back of
+ *    another worker's deque.
+ *  - Each deque has its own mutex, only contended by thieves.
+ * The pool mutex is only used for sleeping when there is nothing to
+ * do, and for waking sleepers up.
+ *
+ * Like WorkQueue, the queue registers with the WQRegistry.
+ */
+template <class T> class StealQueue : public WQStatsSource {
+public:
+
+	/** Create a StealQueue
+	 * @param name for message printing
+	 * @param hi number of tasks on queue before clients blocks. Default 0
+	 *	  meaning no limit. Worker threads never block in put().
+	 * @param lo minimum count of tasks before worker starts. Default 1.
+	 */
+	StealQueue(const std::string& name, size_t hi = 0, size_t lo = 1)
+		: m_name(name), m_high(hi), m_low(lo), m_ndeques(0),
+		  m_nthreads(0), m_workers_exited(0), m_workersleeps(0),
+		  m_clientsleeps(0)
+	{
+		m_ok = false;
+		m_pending = 0;
+		m_rr = 0;
+		m_nextidx = 0;
+		m_clients_waiting = 0;
+		m_workers_waiting = 0;
+		m_tottasks = 0;
+		m_highwater = 0;
+		m_haskey = pthread_key_create(&m_key, 0) == 0;
+		m_init = m_haskey && (pthread_cond_init(&m_ccond, 0) == 0) &&
+			(pthread_cond_init(&m_wcond, 0) == 0);
+		WQRegistry::add(this);
+	}
+
+	~StealQueue()
+	{
+		WQRegistry::remove(this);
+		if (!m_worker_threads.empty())
+			setTerminateAndWait();
+		for (unsigned int i = 0; i < m_deques.size(); i++)
+			delete m_deques[i];
+		if (m_haskey)
+			pthread_key_delete(m_key);
+	}
+
+	/** Start the worker threads.
+	 *
+	 * @param nworkers number of threads copies to start.
+	 * @param start_routine thread function. It should loop
+	 *		taking (QueueWorker::take()) and executing tasks.
+	 * @param arg initial parameter to thread function.
+	 * @return true if ok.
+	 */
+	bool start(int nworkers, void *(*workproc)(void *), void *arg)
+	{
+		PTMutexLocker lock(m_mutex);
+		if (!m_init || nworkers <= 0 || !m_worker_threads.empty())
+			return false;
+		// The deques are created once and never deleted while the
+		// queue exists, a put() may be running concurrently.
+		while (m_deques.size() < (unsigned int)nworkers)
+			m_deques.push_back(new WDeque);
+		m_ndeques = nworkers;
+		m_nextidx = 0;
+		m_ok = true;
+		for	 (int i = 0; i < nworkers; i++) {
+			pthread_t thr;
+			if (pthread_create(&thr, 0, workproc, arg)) {
+				if (m_worker_threads.empty())
+					m_ok = false;
+				return false;
+			}
+			m_worker_threads.push_back(thr);
+			m_nthreads++;
+		}
+		return true;
+	}
+
+	/** Add item to work queue, called from client or worker.
+	 *
+	 * A client sleeps if there are already too many.
+	 */
+	bool put(T t)
+	{
+		int myidx = workerIndex();
+		if (myidx < 0 && m_high > 0) {
+			while (ok() && m_pending.load() >= (long)m_high) {
+				PTMutexLocker lock(m_mutex);
+				m_clients_waiting++;
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (ok() && m_pending.load() >= (long)m_high) {
+					m_clientsleeps++;
+					if (pthread_cond_wait(&m_ccond, lock.getMutex())) {
+						m_clients_waiting--;
+						return false;
+					}
+				}
+				m_clients_waiting--;
+			}
+		}
+		if (!ok())
+			return false;
+
+		unsigned int idx = myidx >= 0 ? myidx : m_rr++ % m_ndeques;
+		WDeque *dq = m_deques[idx];
+		Item item;
+		item.t = t;
+		item.enq = wqnow();
+		long pending;
+		{
+			// The count changes with the deque, under its lock: a
+			// counted task is always visible in some deque.
+			PTMutexLocker lock(dq->mutex);
+			dq->tasks.push_back(item);
+			pending = ++m_pending;
+		}
+		long hw = m_highwater.load(std::memory_order_relaxed);
+		while (pending > hw && !m_highwater.compare_exchange_weak(hw, pending))
+			;
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_workers_waiting.load(std::memory_order_relaxed) > 0) {
+			PTMutexLocker lock(m_mutex);
+			pthread_cond_signal(&m_wcond);
+		}
+		return true;
+	}
+
+	/** Wait until the queue is inactive. Called from client.
+	 *
+	 * Waits until the task queue is empty and the workers are all
+	 * back sleeping. Same restrictions as WorkQueue::waitIdle().
+	 */
+	bool waitIdle()
+	{
+		PTMutexLocker lock(m_mutex);
+		if (!lock.ok() || !ok()) {
+			return false;
+		}
+
+		while (ok() && (m_pending.load() > 0 ||
+						m_workers_waiting.load() != m_nthreads)) {
+			m_clients_waiting++;
+			if (pthread_cond_wait(&m_ccond, lock.getMutex())) {
+				m_clients_waiting--;
+				m_ok = false;
+				return false;
+			}
+			m_clients_waiting--;
+		}
+
+		return ok();
+	}
+
+	/** Tell the workers to exit, and wait for them.
+	 *
+	 * Does not bother about tasks possibly remaining on the queue, so
+	 * should be called after waitIdle() for an orderly shutdown.
+	 */
+	void* setTerminateAndWait()
+	{
+		PTMutexLocker lock(m_mutex);
+
+		if (m_worker_threads.empty()) {
+			// Already called ?
+			return (void*)0;
+		}
+
+		// Wait for all worker threads to have called workerExit()
+		m_ok = false;
+		pthread_cond_broadcast(&m_ccond);
+		while (m_workers_exited < m_worker_threads.size()) {
+			pthread_cond_broadcast(&m_wcond);
+			m_clients_waiting++;
+			if (pthread_cond_wait(&m_ccond, lock.getMutex())) {
+				m_clients_waiting--;
+				return (void*)0;
+			}
+			m_clients_waiting--;
+		}
+
+		// Perform the thread joins and compute overall status
+		// Workers return (void*)1 if ok
+		void *statusall = (void*)1;
+		for (unsigned int i = 0; i < m_worker_threads.size(); i++) {
+			void *status;
+			pthread_join(m_worker_threads[i], &status);
+			if (status == (void *)0)
+				statusall = status;
+		}
+		m_worker_threads.clear();
+
+		// Reset to start state. m_ok stays false until start()
+		m_nthreads = m_workers_exited = m_workersleeps = m_clientsleeps = 0;
+		return statusall;
+	}
+
+	/** Take task from queue. Called from worker.
+	 *
+	 * Takes from the worker's own deque if possible, else steals
+	 * from another. Sleeps if there are not enough tasks.
+	 */
+	bool take(T* tp, size_t *szp = 0)
+	{
+		int myidx = workerIndex();
+		if (myidx < 0) {
+			// First call from this worker: assign it a deque
+			PTMutexLocker lock(m_mutex);
+			myidx = m_nextidx++ % m_ndeques;
+			pthread_setspecific(m_key, (void *)(long)(myidx + 1));
+		}
+		wqServiceEnd(this, m_servicehist);
+
+		long remaining;
+		for (;;) {
+			if (!ok())
+				return false;
+			if ((long)m_pending.load() >= (long)m_low &&
+				tryTake(myidx, tp, &remaining))
+				break;
+
+			// Not enough tasks, or they were put behind our scan or
+			// taken by others. Register as waiter, then check again
+			// before sleeping.
+			PTMutexLocker lock(m_mutex);
+			m_workers_waiting++;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (ok() && m_pending.load() < (long)m_low) {
+				m_workersleeps++;
+				if (m_pending.load() == 0 && m_clients_waiting.load() > 0)
+					pthread_cond_broadcast(&m_ccond);
+				if (pthread_cond_wait(&m_wcond, lock.getMutex())) {
+					m_workers_waiting--;
+					return false;
+				}
+			}
+			m_workers_waiting--;
+		}
+
+		if (szp)
+			*szp = remaining + 1;
+		m_tottasks.fetch_add(1, std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_clients_waiting.load(std::memory_order_relaxed) > 0) {
+			// The clients may be waiting for room in the queue, or
+			// for idleness, so wake them all.
+			PTMutexLocker lock(m_mutex);
+			pthread_cond_broadcast(&m_ccond);
+		}
+		return true;
+	}
+
+	/** Advertise exit and abort queue. Called from worker
+	 *
+	 * This would happen after an unrecoverable error, or when
+	 * the queue is terminated by the client. The thread must
+	 * return/exit immediately after calling this.
+	 */
+	void workerExit()
+	{
+		PTMutexLocker lock(m_mutex);
+		m_workers_exited++;
+		m_ok = false;
+		pthread_cond_broadcast(&m_ccond);
+	}
+
+	size_t qsize()
+	{
+		long sz = m_pending.load();
+		return sz > 0 ? sz : 0;
+	}
+
+	virtual void getStats(WQStats& stats)
+	{
+		stats.name = m_name;
+		stats.depth = qsize();
+		stats.highwater = m_highwater.load();
+		stats.tasks = m_tottasks.load();
+		m_waithist.snapshot(stats.wait);
+		m_servicehist.snapshot(stats.service);
+		PTMutexLocker lock(m_mutex);
+		stats.workers = m_nthreads;
+		stats.workersleeps = m_workersleeps;
+		stats.clientsleeps = m_clientsleeps;
+	}
+
+	/** Check if the calling thread is one of our workers */
+	bool inWorker()
+	{
+		return workerIndex() >= 0;
+	}
+
+private:
+	// Task with its queueing time
+	struct Item {
+		T t;
+		long long enq;
+	};
+
+	struct WDeque {
+		PTMutexInit mutex;
+		std::deque<Item> tasks;
+		// Avoid false sharing between the deques
+		char pad[64];
+	};
+
+	bool ok()
+	{
+		return m_ok.load(std::memory_order_acquire);
+	}
+
+	// Deque index for the calling thread, or -1 if not a worker
+	int workerIndex()
+	{
+		long v = (long)pthread_getspecific(m_key);
+		return int(v) - 1;
+	}
+
+	// Take from our deque front, else steal from the back of
+	// another. Returns the count of tasks left.
+	bool tryTake(int myidx, T* tp, long *remaining)
+	{
+		for (unsigned int i = 0; i < m_ndeques; i++) {
+			WDeque *dq = m_deques[(myidx + i) % m_ndeques];
+			long long enq;
+			{
+				PTMutexLocker lock(dq->mutex);
+				if (dq->tasks.empty())
+					continue;
+				if (i == 0) {
+					*tp = dq->tasks.front().t;
+					enq = dq->tasks.front().enq;
+					dq->tasks.pop_front();
+				} else {
+					*tp = dq->tasks.back().t;
+					enq = dq->tasks.back().enq;
+					dq->tasks.pop_back();
+				}
+				*remaining = --m_pending;
+			}
+			long long now = wqnow();
+			m_waithist.add(now - enq);
+			wqServiceStart(this, now);
+			return true;
+		}
+		return false;
+	}
+
+	// Configuration
+	std::string m_name;
+	size_t m_high;
+	size_t m_low;
+
+	// Per-worker task deques
+	std::vector<WDeque*> m_deques;
+	unsigned int m_ndeques;
+	pthread_key_t m_key;
+	bool m_haskey;
+	// Queued tasks count, changed under the deque lock
+	std::atomic<long> m_pending;
+	// Round-robin deque choice for external clients
+	std::atomic<unsigned int> m_rr;
+
+	// Status. m_ok is true between start() and the first workerExit()
+	// or setTerminateAndWait()
+	std::atomic<bool> m_ok;
+	bool m_init;
+	unsigned int m_nthreads;
+	unsigned int m_nextidx;
+	unsigned int m_workers_exited;
+	std::vector<pthread_t> m_worker_threads;
+
+	// Sleep/wakeup synchronization
+	pthread_cond_t m_ccond;
+	pthread_cond_t m_wcond;
+	PTMutexInit m_mutex;
+	std::atomic<unsigned int> m_clients_waiting;
+	std::atomic<unsigned int> m_workers_waiting;
+
+	// Statistics (sleep counts updated under the mutex)
+	unsigned int m_workersleeps;
+	unsigned int m_clientsleeps;
+	std::atomic<unsigned long long> m_tottasks;
+	std::atomic<long> m_highwater;
+	WQHisto m_waithist;
+	WQHisto m_servicehist;
+};
+
+/**
+ * A pool of threads executing arbitrary tasks, on top of a StealQueue.
+ *
+ * submit() returns a std::future for the task result. If the pool is
+ * not running, the task is executed synchronously by submit(), so the
+ * future is always satisfied. A task which waits for the results of
+ * other tasks in the same pool should check inWorker() and do the
+ * work itself instead, else the pool could deadlock.
+ */
+class TaskPool : public StealQueue<std::function<void()> > {
+public:
+	TaskPool(const std::string& name)
+		: StealQueue<std::function<void()> >(name)
+	{}
+
+	/** Start the worker threads */
+	bool start(int nworkers)
+	{
+		return StealQueue<std::function<void()> >::start(nworkers,
+														  worker, this);
+	}
+
+	/** Queue a task, returning a future for its result */
+	template <class F> std::future<typename std::result_of<F()>::type>
+	submit(F f)
+	{
+		typedef typename std::result_of<F()>::type R;
+		std::shared_ptr<std::packaged_task<R()> >
+			task(new std::packaged_task<R()>(f));
+		std::future<R> fut = task->get_future();
+		if (!put([task]() {(*task)();})) {
+			(*task)();
+		}
+		return fut;
+	}
+
+	/** Return a process-wide pool shared by the library modules. This
+	 * is started on first call, with one thread per processor (at
+	 * least 2, at most 8) */
+	static TaskPool *getShared();
+
+private:
+	static void *worker(void *arg)
+	{
+		TaskPool *pool = (TaskPool *)arg;
+		std::function<void()> task;
+		for (;;) {
+			if (!pool->take(&task)) {
+				pool->workerExit();
+				return (void*)1;
+			}
+			task();
+			// Release the task resources now
+			task = std::function<void()>();
+		}
+	}
+};
+
+#endif /* _STEALQUEUE_H_INCLUDED_ */
+/* Local Variables: */
+/* mode: c++ */
+/* c-basic-offset: 4 */
+/* tab-width: 4 */
+/* indent-tabs-mode: t */
+/* End: */
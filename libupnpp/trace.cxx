@@ -0,0 +1,176 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+using namespace std;
+
+#include "ptmutex.hxx"
+#include "log.hxx"
+#include "trace.hxx"
+
+std::atomic<bool> Trace::s_enabled(false);
+
+// Write out the buffer when it gets bigger than this, without waiting
+// for the flusher thread.
+static const size_t traceBufMax = 256 * 1024;
+
+// The record buffer and the names. Lock order: tracewlock, tracelock
+static PTMutexInit tracelock;
+static string tracebuf;
+static unordered_map<string, unsigned int> tracenames;
+static vector<string> tracenamelist;
+// File writes
+static PTMutexInit tracewlock;
+static int tracefd = -1;
+
+static const char *catnames[] = {"name", "action", "decode", "handler",
+								 "encode", "mpd", "evtick", "notify",
+								 "discofetch"};
+
+const char *Trace::catName(int cat)
+{
+	if (cat < 0 || cat >= NCATEGORIES)
+		return "unknown";
+	return catnames[cat];
+}
+
+static void appendName(string& buf, unsigned int id, const string& name)
+{
+	TraceRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.cat = Trace::NAME;
+	rec.nameid = id;
+	rec.namelen = name.size() > 0xffff ? 0xffff : name.size();
+	buf.append((const char *)&rec, sizeof(rec));
+	buf.append(name.data(), rec.namelen);
+	buf.append((8 - rec.namelen % 8) % 8, '\0');
+}
+
+static void writeAll(int fd, const string& data)
+{
+	const char *cp = data.data();
+	size_t remain = data.size();
+	while (remain > 0) {
+		ssize_t n = write(fd, cp, remain);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGERR("Trace: write failed, errno " << errno << endl);
+			return;
+		}
+		cp += n;
+		remain -= n;
+	}
+}
+
+static void *traceFlusher(void *)
+{
+	for (;;) {
+		sleep(1);
+		Trace::flush();
+	}
+	return 0;
+}
+
+bool Trace::open(const string& filename)
+{
+	PTMutexLocker wlock(tracewlock);
+	if (tracefd >= 0)
+		return false;
+	int fd = ::open(filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		LOGERR("Trace::open: can't open " << filename << " errno " <<
+			   errno << endl);
+		return false;
+	}
+	TraceFileHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "UPNPTRC1", 8);
+	hdr.byteorder = 0x01020304;
+	hdr.recsize = sizeof(TraceRecord);
+	writeAll(fd, string((const char *)&hdr, sizeof(hdr)));
+	tracefd = fd;
+
+	pthread_t thr;
+	if (pthread_create(&thr, 0, traceFlusher, 0) == 0) {
+		pthread_detach(thr);
+	}
+
+	// Define the names created before we were opened
+	PTMutexLocker lock(tracelock);
+	for (unsigned int i = 0; i < tracenamelist.size(); i++)
+		appendName(tracebuf, i + 1, tracenamelist[i]);
+	s_enabled = true;
+	return true;
+}
+
+unsigned int Trace::nameId(const string& name)
+{
+	PTMutexLocker lock(tracelock);
+	unordered_map<string, unsigned int>::const_iterator it =
+		tracenames.find(name);
+	if (it != tracenames.end())
+		return it->second;
+	tracenamelist.push_back(name);
+	unsigned int id = tracenamelist.size();
+	tracenames[name] = id;
+	if (s_enabled.load())
+		appendName(tracebuf, id, name);
+	return id;
+}
+
+void Trace::record(int cat, unsigned int nameid, long long start,
+				   long long dur, long long value)
+{
+	TraceRecord rec;
+	rec.start = start;
+	rec.dur = dur;
+	rec.value = value;
+	rec.nameid = nameid;
+	rec.cat = cat;
+	rec.namelen = 0;
+	bool full;
+	{
+		PTMutexLocker lock(tracelock);
+		tracebuf.append((const char *)&rec, sizeof(rec));
+		full = tracebuf.size() >= traceBufMax;
+	}
+	if (full)
+		flush();
+}
+
+void Trace::flush()
+{
+	PTMutexLocker wlock(tracewlock);
+	if (tracefd < 0)
+		return;
+	string data;
+	{
+		PTMutexLocker lock(tracelock);
+		data.swap(tracebuf);
+	}
+	writeAll(tracefd, data);
+}
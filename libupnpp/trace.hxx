@@ -0,0 +1,137 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _TRACE_H_X_INCLUDED_
+#define _TRACE_H_X_INCLUDED_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+
+/**
+ * Binary trace of timed spans (SOAP actions, MPD commands, event
+ * loop ticks...), for profiling without text logging. Tracing is off
+ * until Trace::open() is called, and a disabled span costs one atomic
+ * load.
+ *
+ * File format (native byte order, see tracedump for a decoder):
+ *  - A TraceFileHeader.
+ *  - A sequence of TraceRecords. A record with cat == Trace::NAME
+ *    defines the name for nameid, and is followed by the name bytes,
+ *    padded to a multiple of 8. Names are always defined before use.
+ */
+struct TraceFileHeader {
+	char magic[8];       // "UPNPTRC1"
+	uint32_t byteorder;  // 0x01020304 as written by the tracing host
+	uint32_t recsize;    // sizeof(TraceRecord)
+};
+
+struct TraceRecord {
+	uint64_t start;      // CLOCK_MONOTONIC nanoseconds
+	uint64_t dur;        // nanoseconds
+	int64_t value;       // Category-dependant: byte count, etc.
+	uint32_t nameid;
+	uint16_t cat;
+	uint16_t namelen;    // Name records only
+};
+
+class Trace {
+public:
+	// Span categories. The record value is the count of output
+	// arguments for ENCODE, the byte count of the names and values for
+	// NOTIFY, the description size for DISCOFETCH, else 0.
+	enum Category {NAME = 0, ACTION, DECODE, HANDLER, ENCODE, MPD, EVTICK,
+				   NOTIFY, DISCOFETCH, NCATEGORIES};
+	static const char *catName(int cat);
+
+	/** Start tracing to the specified file (truncated). The data is
+	 * written out by a background thread every second. */
+	static bool open(const std::string& filename);
+
+	static bool enabled()
+	{
+		return s_enabled.load(std::memory_order_relaxed);
+	}
+
+	/** Get the numeric id for a name, defining it if needed */
+	static unsigned int nameId(const std::string& name);
+
+	static long long now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	}
+
+	static void record(int cat, unsigned int nameid, long long start,
+					   long long dur, long long value);
+
+	/** Write out the buffered records */
+	static void flush();
+
+private:
+	static std::atomic<bool> s_enabled;
+};
+
+/** A span lasting from construction to end() or destruction. Nothing
+ * is done if tracing is off at construction time */
+class TraceSpan {
+public:
+	TraceSpan(int cat, unsigned int nameid)
+		: m_cat(cat), m_nameid(nameid), m_value(0),
+		  m_start(Trace::enabled() ? Trace::now() : 0)
+	{}
+	~TraceSpan()
+	{
+		end();
+	}
+	void setValue(long long value)
+	{
+		m_value = value;
+	}
+	void end()
+	{
+		if (m_start) {
+			Trace::record(m_cat, m_nameid, m_start, Trace::now() - m_start,
+						  m_value);
+			m_start = 0;
+		}
+	}
+private:
+	int m_cat;
+	unsigned int m_nameid;
+	long long m_value;
+	long long m_start;
+};
+
+/** Declare a span with a constant name. The name id is computed once
+ * per call site. */
+#define TRACE_SPAN(VAR, CAT, NAME)									\
+	static unsigned int VAR##_nameid = Trace::nameId(NAME);			\
+	TraceSpan VAR(CAT, VAR##_nameid)
+
+/** Get a name id for a variable name, only if tracing is on */
+#define TRACE_NAMEID(NAME) (Trace::enabled() ? Trace::nameId(NAME) : 0)
+
+#endif /* _TRACE_H_X_INCLUDED_ */
+/* Local Variables: */
+/* mode: c++ */
+/* c-basic-offset: 4 */
+/* tab-width: 4 */
+/* indent-tabs-mode: t */
+/* End: */
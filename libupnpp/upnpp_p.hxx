@@ -32,9 +32,11 @@ template <class T> bool csvToStrings(const std::string& s, T &tokens);
 
 #if defined(HAVE_UPNPSETLOGLEVEL)
 #include <upnp/upnpdebug.h>
+#define PLOGERR(...) UpnpPrintf(UPNP_CRITICAL, API, __FILE__, __LINE__, __VA_ARGS__)
 #define PLOGINF(...) UpnpPrintf(UPNP_INFO, API, __FILE__, __LINE__, __VA_ARGS__)
 #define PLOGDEB(...) UpnpPrintf(UPNP_INFO,API, __FILE__, __LINE__, __VA_ARGS__)
 #else
+#define PLOGERR(...)
 #define PLOGINF(...)
 #define PLOGDEB(...)
 #endif
@@ -54,7 +54,7 @@ LibUPnP *LibUPnP::getLibUPnP(bool server)
 
 
 LibUPnP::LibUPnP(bool server)
-	: m_ok(false)
+	: m_ok(false), m_port(0)
 {
 	m_init_error = UpnpInit(0, 0);
 	if (m_init_error != UPNP_E_SUCCESS) {
@@ -66,6 +66,9 @@ LibUPnP::LibUPnP(bool server)
 	const char *ip_address = UpnpGetServerIpAddress();
 	int port = UpnpGetServerPort();
 	LOGDEB("Using IP " << ip_address << " port " << port << endl);
+	if (ip_address)
+		m_host = ip_address;
+	m_port = port;
 
 #if defined(HAVE_UPNPSETLOGLEVEL)
 	UpnpCloseLog();
@@ -65,6 +65,17 @@ public:
 		return m_init_error;
 	}
 
+	/** IP address and port of our HTTP server, for building URLs
+	 * to the files in the VirtualDir */
+	const std::string& host() const
+	{
+		return m_host;
+	}
+	int port() const
+	{
+		return m_port;
+	}
+
 	/** Build a unique persistent UUID for a root device. This uses a hash
 		of the input name (e.g.: friendlyName), and the host Ethernet address */
 	static std::string makeDevUUID(const std::string& name);
@@ -118,6 +129,8 @@ private:
 
 	bool m_ok;
 	int	 m_init_error;
+	std::string m_host;
+	int m_port;
 	UpnpClient_Handle m_clh;
 	UpnpDevice_Handle m_dvh;
 	PTMutexInit m_mutex;
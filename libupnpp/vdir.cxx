@@ -17,8 +17,16 @@
 #include "config.h"
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <memory.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 #include <upnp/upnp.h>
 
@@ -30,49 +38,151 @@ using namespace std;
 
 static VirtualDir *theDir;
 
+// Open file state. The contents are either shared with the directory
+// entry, or read from a local file.
 struct Handle {
-	Handle(VirtualDir::FileEnt *e)
-		: entry(e), offset(0)
+	Handle()
+		: offset(0), fd(-1), size(0)
 		{}
-	VirtualDir::FileEnt *entry;	
+	shared_ptr<const string> content;
 	size_t offset;
+	int fd;
+	off_t size;
 };
 
-static int vdclose(UpnpWebFileHandle fileHnd)
+// Recycle the handles instead of allocating one per request.
+static PTMutexInit handlesLock;
+static vector<Handle*> freeHandles;
+static const size_t maxFreeHandles = 32;
+
+static Handle *getHandle()
 {
-	Handle *h = (Handle*)fileHnd;
-	delete h;
-	return 0;
+	{
+		PTMutexLocker lock(handlesLock);
+		if (!freeHandles.empty()) {
+			Handle *h = freeHandles.back();
+			freeHandles.pop_back();
+			return h;
+		}
+	}
+	return new Handle;
 }
 
-static VirtualDir::FileEnt *vdgetentry(const char *pathname)
+static void releaseHandle(Handle *h)
 {
-	//LOGDEB("vdgetentry: [" << pathname << "]" << endl);
-	VirtualDir *thedir = VirtualDir::getVirtualDir();
-	if (thedir == 0)
-		return 0;
+	h->content.reset();
+	h->offset = 0;
+	if (h->fd >= 0)
+		close(h->fd);
+	h->fd = -1;
+	h->size = 0;
+	PTMutexLocker lock(handlesLock);
+	if (freeHandles.size() < maxFreeHandles) {
+		freeHandles.push_back(h);
+	} else {
+		delete h;
+	}
+}
 
-	string dir = path_getfather(pathname);
-	string fn = path_getsimple(pathname);
+// libupnp calls getinfo then open for each request, in the same
+// thread. The data from getinfo is kept for the open call, so that a
+// generated file is produced once, and the contents match the length
+// we returned. For a local file, this is the open descriptor.
+struct InfoCache {
+	InfoCache() : fd(-1), size(0) {}
+	void reset()
+	{
+		content.reset();
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+	string path;
+	shared_ptr<const string> content;
+	int fd;
+	off_t size;
+};
+static pthread_key_t infoCacheKey;
+static pthread_once_t infoCacheOnce = PTHREAD_ONCE_INIT;
+static void deleteInfoCache(void *p)
+{
+	InfoCache *cache = (InfoCache *)p;
+	cache->reset();
+	delete cache;
+}
+static void createInfoCacheKey()
+{
+	pthread_key_create(&infoCacheKey, deleteInfoCache);
+}
+static InfoCache *getInfoCache()
+{
+	pthread_once(&infoCacheOnce, createInfoCacheKey);
+	InfoCache *cache = (InfoCache *)pthread_getspecific(infoCacheKey);
+	if (cache == 0) {
+		cache = new InfoCache;
+		pthread_setspecific(infoCacheKey, cache);
+	}
+	return cache;
+}
+
+// Open a local file through the resolvers
+static int vdopenlocal(const char *fn, string& mimetype, struct stat& st)
+{
+	string filename;
+	if (!theDir->getLocalFile(fn, filename, mimetype))
+		return -1;
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOGERR("VirtualDir: can't open " << filename << " errno " << 
+			   errno << endl);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
 
-	return theDir->getFile(dir, fn);
+static int vdclose(UpnpWebFileHandle fileHnd)
+{
+	releaseHandle((Handle*)fileHnd);
+	return 0;
 }
 
 static int vdgetinfo(const char *fn, struct File_Info* info )
 {
 	//LOGDEB("vdgetinfo: [" << fn << "] off_t " << sizeof(off_t) <<
 	// " time_t " << sizeof(time_t) << endl);
-	VirtualDir::FileEnt *entry = vdgetentry(fn);
-	if (entry == 0) {
-		LOGERR("vdgetinfo: no entry for " << fn << endl);
+	VirtualDir *thedir = VirtualDir::getVirtualDir();
+	if (thedir == 0)
 		return -1;
+	InfoCache *cache = getInfoCache();
+	// Possibly left over by a request which did not open the file
+	cache->reset();
+
+	VirtualDir::FileEnt entry;
+	if (thedir->getFile(fn, entry)) {
+		cache->content = entry.content;
+		info->file_length = entry.content->size();
+		info->last_modified = entry.mtime;
+	} else {
+		struct stat st;
+		int fd = vdopenlocal(fn, entry.mimetype, st);
+		if (fd < 0) {
+			LOGERR("vdgetinfo: no entry for " << fn << endl);
+			return -1;
+		}
+		cache->fd = fd;
+		cache->size = st.st_size;
+		info->file_length = st.st_size;
+		info->last_modified = st.st_mtime;
 	}
+	cache->path = fn;
 
-	info->file_length = entry->content.size();
-	info->last_modified = entry->mtime;
 	info->is_directory = 0;
 	info->is_readable = 1;
-	info->content_type = ixmlCloneDOMString(entry->mimetype.c_str());
+	info->content_type = ixmlCloneDOMString(entry.mimetype.c_str());
 
 	return 0;
 }
@@ -80,12 +190,31 @@ static int vdgetinfo(const char *fn, struct File_Info* info )
 static UpnpWebFileHandle vdopen(const char* fn, enum UpnpOpenFileMode Mode)
 {
 	//LOGDEB("vdopen: " << fn << endl);
-	VirtualDir::FileEnt *entry = vdgetentry(fn);
-	if (entry == 0) {
-		LOGERR("vdopen: no entry for " << fn << endl);
-		return NULL;
+	Handle *h = getHandle();
+	InfoCache *cache = getInfoCache();
+	if ((cache->content || cache->fd >= 0) && cache->path == fn) {
+		h->content.swap(cache->content);
+		h->fd = cache->fd;
+		h->size = cache->size;
+		cache->fd = -1;
+		return h;
 	}
-	return new Handle(entry);
+	cache->reset();
+
+	VirtualDir *thedir = VirtualDir::getVirtualDir();
+	VirtualDir::FileEnt entry;
+	if (thedir && thedir->getFile(fn, entry)) {
+		h->content = entry.content;
+		return h;
+	}
+	struct stat st;
+	if (thedir && (h->fd = vdopenlocal(fn, entry.mimetype, st)) >= 0) {
+		h->size = st.st_size;
+		return h;
+	}
+	LOGERR("vdopen: no entry for " << fn << endl);
+	releaseHandle(h);
+	return NULL;
 }
 
 static int vdread(UpnpWebFileHandle fileHnd, char* buf, size_t buflen)
@@ -94,11 +223,19 @@ static int vdread(UpnpWebFileHandle fileHnd, char* buf, size_t buflen)
 	if (buflen == 0)
 		return 0;
 	Handle *h = (Handle *)fileHnd;
-	if (h->offset >= h->entry->content.size())
+	if (h->fd >= 0) {
+		ssize_t n = pread(h->fd, buf, buflen, h->offset);
+		if (n < 0)
+			return -1;
+		h->offset += n;
+		return n;
+	}
+	const string& content = *h->content;
+	if (h->offset >= content.size())
 		return 0;
-	size_t toread = buflen > h->entry->content.size() - h->offset ?
-		h->entry->content.size() - h->offset : buflen;
-	memcpy(buf, h->entry->content.c_str() + h->offset, toread);
+	size_t toread = buflen > content.size() - h->offset ?
+		content.size() - h->offset : buflen;
+	memcpy(buf, content.c_str() + h->offset, toread);
 	h->offset += toread;
 	return toread;
 }
@@ -112,7 +249,7 @@ static int vdseek(UpnpWebFileHandle fileHnd, off_t offset, int origin)
 	else if (origin == 1)
 		h->offset += offset;
 	else if (origin == 2)
-		h->offset = h->entry->content.size() + offset;
+		h->offset = (h->fd >= 0 ? h->size : h->content->size()) + offset;
 	else 
 		return -1;
 	return offset;
@@ -142,50 +279,210 @@ VirtualDir *VirtualDir::getVirtualDir()
 	return theDir;
 }
 
-bool VirtualDir::addFile(const string& _path, const string& name, 
-						 const string& content, const string& mimetype)
+// Order the index entries and compare them to a (not null-terminated)
+// path
+struct IndexCmp {
+	bool operator()(const pair<string, VirtualDir::FileEnt*>& e,
+					const pair<const char *, size_t>& path) const
+	{
+		return e.first.compare(0, string::npos, path.first, path.second) < 0;
+	}
+	bool operator()(const pair<string, VirtualDir::FileEnt*>& e1,
+					const pair<string, VirtualDir::FileEnt*>& e2) const
+	{
+		return e1.first < e2.first;
+	}
+};
+
+// Find the entry, creating it and the directory if needed. Called
+// with the lock held.
+VirtualDir::FileEnt *VirtualDir::newEntry(const string& _path,
+										  const string& name)
 {
 	string path(_path);
 	if (path.empty() || path[path.size()-1] != '/') {
 		path += '/';
 	}
 	if (m_dirs.find(path) == m_dirs.end()) {
-		m_dirs[path] = unordered_map<string, VirtualDir::FileEnt>();
+		m_dirs.insert(path);
 		UpnpAddVirtualDir(path.c_str());
 	}
-	VirtualDir::FileEnt entry;
-	entry.mtime = time(0);
-	entry.mimetype = mimetype;
-	entry.content = content;
-	m_dirs[path][name] = entry;
+	string fullpath = path + name;
+	FileEnt *entry = findEntry(fullpath.c_str(), fullpath.size());
+	if (entry == 0) {
+		entry = new FileEnt;
+		pair<string, FileEnt*> elt(fullpath, entry);
+		m_index.insert(upper_bound(m_index.begin(), m_index.end(), elt,
+								   IndexCmp()), elt);
+	}
+	return entry;
+}
+
+bool VirtualDir::addFile(const string& path, const string& name, 
+						 const string& content, const string& mimetype)
+{
+	PTMutexLocker lock(m_mutex);
+	if (m_frozen) {
+		LOGERR("VirtualDir::addFile: frozen, can't add " << name << endl);
+		return false;
+	}
+	VirtualDir::FileEnt *entry = newEntry(path, name);
+	entry->mtime = time(0);
+	entry->mimetype = mimetype;
+	entry->content = make_shared<const string>(content);
+	entry->generator = Generator();
+	entry->cachesecs = 0;
 	// LOGDEB("VirtualDir::addFile: added entry for dir " << 
 	// path << " name " << name << endl);
 	return true;
 }
 
-VirtualDir::FileEnt *VirtualDir::getFile(const string& _path, 
-										 const string& name)
+bool VirtualDir::addGenerator(const string& path, const string& name,
+							  Generator generator, const string& mimetype,
+							  int cachesecs)
+{
+	PTMutexLocker lock(m_mutex);
+	if (m_frozen) {
+		LOGERR("VirtualDir::addGenerator: frozen, can't add " << name <<
+			   endl);
+		return false;
+	}
+	VirtualDir::FileEnt *entry = newEntry(path, name);
+	entry->mtime = 0;
+	entry->mimetype = mimetype;
+	entry->content.reset();
+	entry->generator = generator;
+	entry->cachesecs = cachesecs;
+	return true;
+}
+
+void VirtualDir::freeze()
+{
+	PTMutexLocker lock(m_mutex);
+	m_frozen.store(true, std::memory_order_release);
+}
+
+// Called with the lock held, or after freeze()
+VirtualDir::FileEnt *VirtualDir::findEntry(const char *fullpath, size_t len)
+{
+	pair<const char *, size_t> key(fullpath, len);
+	vector<pair<string, FileEnt*> >::const_iterator it = 
+		lower_bound(m_index.begin(), m_index.end(), key, IndexCmp());
+	if (it == m_index.end() || 
+		it->first.compare(0, string::npos, fullpath, len)) {
+		return 0;
+	}
+	return it->second;
+}
+
+bool VirtualDir::addFileResolver(const string& _path, FileResolver resolver)
 {
 	string path(_path);
 	if (path.empty() || path[path.size()-1] != '/') {
 		path += '/';
 	}
+	PTMutexLocker lock(m_mutex);
+	if (m_frozen) {
+		LOGERR("VirtualDir::addFileResolver: frozen, can't add " << path <<
+			   endl);
+		return false;
+	}
+	if (m_dirs.find(path) == m_dirs.end()) {
+		m_dirs.insert(path);
+		UpnpAddVirtualDir(path.c_str());
+	}
+	m_resolvers.push_back(pair<string, FileResolver>(path, resolver));
+	return true;
+}
 
-	// LOGDEB("VirtualDir::getFile: path " << path << " name " << name << endl);
+bool VirtualDir::getLocalFile(const char *fullpath, string& filename,
+							  string& mimetype)
+{
+	const char *cp = strchr(fullpath, '?');
+	string path(fullpath, cp ? cp - fullpath : strlen(fullpath));
 
-	unordered_map<string, unordered_map<string,VirtualDir::FileEnt> >::iterator dir = 
-		m_dirs.find(path);
-	if (dir == m_dirs.end()) {
-		LOGERR("VirtualDir::getFile: no dir: " << path << endl);
-		return 0;
+	FileResolver resolver;
+	string name;
+	{
+		// The resolvers don't change once frozen
+		PTMutexLocker lock(m_mutex, m_frozen.load(std::memory_order_acquire));
+		for (vector<pair<string, FileResolver> >::const_iterator it = 
+				 m_resolvers.begin(); it != m_resolvers.end(); it++) {
+			if (path.size() > it->first.size() &&
+				!path.compare(0, it->first.size(), it->first)) {
+				resolver = it->second;
+				name = path.substr(it->first.size());
+				break;
+			}
+		}
 	}
-	unordered_map<string, FileEnt>::iterator f = dir->second.find(name);
-	if (f == dir->second.end()) {
-		LOGERR("VirtualDir::getFile: no file: " << path << endl);
-		return 0;
+	return resolver && resolver(name, filename, mimetype);
+}
+
+bool VirtualDir::getFile(const string& _path, const string& name,
+						 FileEnt& entry)
+{
+	string path(_path);
+	if (path.empty() || path[path.size()-1] != '/') {
+		path += '/';
+	}
+	path += name;
+	return getFile(path.c_str(), entry);
+}
+
+// The generator is not copied to the output entry
+bool VirtualDir::getFile(const char *fullpath, FileEnt& entry)
+{
+	// Ignore a query part
+	const char *cp = strchr(fullpath, '?');
+	size_t len = cp ? cp - fullpath : strlen(fullpath);
+
+	// Once frozen, the index and the static files don't change and
+	// we only need the lock for the generated files cache.
+	bool frozen = m_frozen.load(std::memory_order_acquire);
+	FileEnt *f;
+	{
+		PTMutexLocker lock(m_mutex, frozen);
+		f = findEntry(fullpath, len);
+		if (f == 0)
+			return false;
+		if (!f->generator) {
+			entry.mimetype = f->mimetype;
+			entry.cachesecs = f->cachesecs;
+			entry.mtime = f->mtime;
+			entry.content = f->content;
+			return true;
+		}
+	}
+
+	Generator generator;
+	{
+		PTMutexLocker lock(m_mutex);
+		// Check again: the entry may have been replaced if not frozen
+		entry.mimetype = f->mimetype;
+		entry.cachesecs = f->cachesecs;
+		if (!f->generator ||
+			(f->content && time(0) - f->mtime < f->cachesecs)) {
+			entry.mtime = f->mtime;
+			entry.content = f->content;
+			return true;
+		}
+		generator = f->generator;
 	}
 
-	return &(f->second);
+	// Produce the data without holding the lock: this may take some
+	// time. Concurrent requests for an expired entry will each call
+	// the generator.
+	entry.content = make_shared<const string>(generator());
+	entry.mtime = time(0);
+	if (entry.cachesecs > 0) {
+		PTMutexLocker lock(m_mutex);
+		if (f->generator) {
+			f->content = entry.content;
+			f->mtime = entry.mtime;
+		}
+	}
+	return true;
 }
 
 /* Local Variables: */
@@ -23,31 +23,105 @@
 
     As libupnp only lets us defines the api calls (open/read/etc.),
     without any data cookie, this has to be a global singleton object.
+
+    Files can be added or replaced until freeze() is called. After
+    this, the index and the static files are immutable and the web
+    server lookups are done without locking. The contents are shared,
+    not copied, by the open file handles.
+
+    There is no support for conditional requests (If-None-Match,
+    If-Modified-Since) or content encoding: the libupnp 1.6 callbacks
+    don't see the request headers and can't set response headers.
+    The modification time is only passed to libupnp in the file info.
+
+    Local files can also be served, through a resolver function
+    which translates the names under a given directory.
+
+    A file can also be defined by a generator function, which is
+    called when the file is requested, for documents which change
+    all the time (status, metrics...). The result can be cached for
+    some time to limit the cost when many clients are polling.
  */
 
 #include <time.h>
 
 #include <string>
-#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <vector>
+#include <unordered_set>
+
+#include "ptmutex.hxx"
 
 class VirtualDir {
 public:
 	static VirtualDir* getVirtualDir();
 	bool addFile(const std::string& path, const std::string& name, 
 				 const std::string& content, const std::string& mimetype);
+
+	/** Produce the file contents. Called without any lock held, maybe
+	 * from several threads at once */
+	typedef std::function<std::string ()> Generator;
+
+	/** Define a generated file. The contents are produced at each
+	 * request if cachesecs is 0, else reused for this many seconds */
+	bool addGenerator(const std::string& path, const std::string& name,
+					  Generator generator, const std::string& mimetype,
+					  int cachesecs = 0);
+
+	/** Translate a file name to a local file path and MIME type.
+	 * Called without any lock held */
+	typedef std::function<bool (const std::string& name,
+								std::string& filename,
+								std::string& mimetype)> FileResolver;
+
+	/** Serve local files under path. The resolver is called with the
+	 * name relative to path, for names which are not otherwise
+	 * defined. The files are read as they are sent. */
+	bool addFileResolver(const std::string& path, FileResolver resolver);
+
+	/** Stop accepting new files, resolvers, or changes to the static
+	 * files. To be called once the devices are set up. The add calls
+	 * then fail. Generated files are still produced and cached. */
+	void freeze();
+
 	class FileEnt {
 	public:
+		FileEnt() : mtime(0), cachesecs(0) {}
 		time_t mtime;
 		std::string mimetype;
-		std::string content;
+		std::shared_ptr<const std::string> content;
+		Generator generator;
+		int cachesecs;
 	};
-	FileEnt *getFile(const std::string& path, const std::string& name);
+	/** Get the file data, producing it if needed. Returns false if
+	 * not found */
+	bool getFile(const std::string& path, const std::string& name,
+				 FileEnt& entry);
+	/** Same, with the full path as received by the web server. A
+	 * query part is ignored. */
+	bool getFile(const char *fullpath, FileEnt& entry);
+	/** Resolve a path to a local file, see addFileResolver */
+	bool getLocalFile(const char *fullpath, std::string& filename,
+					  std::string& mimetype);
 
 private:
-	VirtualDir() {}
+	VirtualDir() : m_frozen(false) {}
+	FileEnt *newEntry(const std::string& path, const std::string& name);
+	FileEnt *findEntry(const char *fullpath, size_t len);
+
+	// Protects everything until frozen, then only the cached contents
+	// of the generated files.
+	PTMutexInit m_mutex;
+	std::atomic<bool> m_frozen;
 
-	std::unordered_map<std::string, std::unordered_map<std::string, FileEnt> > 
-	m_dirs;
+	// All the files, sorted by full path, so that we can look up a
+	// path received from the web server without building a string.
+	// Entries are never deleted.
+	std::vector<std::pair<std::string, FileEnt*> > m_index;
+	std::unordered_set<std::string> m_dirs;
+	std::vector<std::pair<std::string, FileResolver> > m_resolvers;
 };
 
 
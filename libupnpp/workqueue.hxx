@@ -22,12 +22,14 @@
 
 #include <string>
 #include <queue>
+#include <vector>
 #include <tr1/unordered_map>
 #include <tr1/unordered_set>
 using std::tr1::unordered_map;
 using std::tr1::unordered_set;
 using std::queue;
 using std::string;
+using std::vector;
 
 //#include "debuglog.h"
 #define LOGDEB2(X)
@@ -37,9 +39,10 @@ using std::string;
 #define LOGINFO(X)
 #define LOGERR(X)
 #include "ptmutex.hxx"
+#include "wqstats.hxx"
 
-/// Store per-worker-thread data. Just an initialized timespec, and
-/// used at the moment.
+/// Store per-worker-thread data. Just an initialized timespec, used
+/// for the task service time statistics.
 class WQTData {
 	public:
 	WQTData() {wstart.tv_sec = 0; wstart.tv_nsec = 0;}
@@ -58,8 +61,17 @@ class WQTData {
  * the client or worker sets an end condition on the queue. A second
  * queue could conceivably be used for returning individual task
  * status.
+ *
+ * The queue can be divided into a small number of priority lanes. Lane 0
+ * is the most urgent, and tasks are normally taken from the first
+ * non-empty lane. To avoid starvation, a non-empty lane which has been
+ * passed over by agelimit successive takes is served next. Ordering is
+ * FIFO inside a lane only.
+ *
+ * The queue registers with the WQRegistry, which can produce a
+ * statistics snapshot at any time.
  */
-template <class T> class WorkQueue {
+template <class T> class WorkQueue : public WQStatsSource {
 public:
 
 	/** Create a WorkQueue
@@ -67,19 +79,26 @@ public:
 	 * @param hi number of tasks on queue before clients blocks. Default 0
 	 *	  meaning no limit. hi == -1 means that the queue is disabled.
 	 * @param lo minimum count of tasks before worker starts. Default 1.
+	 * @param nlanes number of priority lanes. Default 1 (plain FIFO).
 	 */
-	WorkQueue(const string& name, size_t hi = 0, size_t lo = 1)
-		: m_name(name), m_high(hi), m_low(lo),
-		  m_workers_exited(0), m_clients_waiting(0), m_workers_waiting(0),
-		  m_tottasks(0), m_nowake(0), m_workersleeps(0), m_clientsleeps(0)
+	WorkQueue(const string& name, size_t hi = 0, size_t lo = 1,
+			  int nlanes = 1)
+		: m_name(name), m_high(hi), m_low(lo), m_workers_exited(0),
+		  m_lanes(nlanes > 0 ? nlanes : 1), m_skips(m_lanes.size(), 0),
+		  m_qcount(0), m_agelimit(defaultAgeLimit),
+		  m_clients_waiting(0), m_workers_waiting(0),
+		  m_tottasks(0), m_nowake(0), m_workersleeps(0), m_clientsleeps(0),
+		  m_highwater(0)
 	{
 		m_ok = (pthread_cond_init(&m_ccond, 0) == 0) &&
 		(pthread_cond_init(&m_wcond, 0) == 0);
+		WQRegistry::add(this);
 	}
 
 	~WorkQueue()
 	{
 		LOGDEB2(("WorkQueue::~WorkQueue:%s\n", m_name.c_str()));
+		WQRegistry::remove(this);
 		if (!m_worker_threads.empty())
 			setTerminateAndWait();
 	}
@@ -108,11 +127,21 @@ public:
 		return true;
 	}
 
+	/** Set the anti-starvation limit: the number of successive takes
+	 * which may pass over a non-empty lower priority lane. */
+	void setAgeLimit(unsigned int takes)
+	{
+		PTMutexLocker lock(m_mutex);
+		m_agelimit = takes;
+	}
+
 	/** Add item to work queue, called from client.
 	 *
 	 * Sleeps if there are already too many.
+	 * @param lane priority lane, 0 is the most urgent. The default (-1)
+	 *	 or any out of range value means the lowest priority lane.
 	 */
-	bool put(T t)
+	bool put(T t, int lane = -1)
 	{
 		PTMutexLocker lock(m_mutex);
 		if (!lock.ok() || !ok()) {
@@ -121,7 +150,7 @@ public:
 			return false;
 		}
 
-		while (ok() && m_high > 0 && m_queue.size() >= m_high) {
+		while (ok() && m_high > 0 && m_qcount >= m_high) {
 		m_clientsleeps++;
 			// Keep the order: we test ok() AFTER the sleep...
 		m_clients_waiting++;
@@ -132,7 +161,7 @@ public:
 		m_clients_waiting--;
 		}
 
-		m_queue.push(t);
+		qpush(t, lane);
 		if (m_workers_waiting > 0) {
 			// Just wake one worker, there is only one new task.
 			pthread_cond_signal(&m_wcond);
@@ -143,6 +172,50 @@ public:
 		return true;
 	}
 
+	/** Add a batch of items to the work queue, called from client.
+	 *
+	 * The items are queued under a single lock acquisition, with a
+	 * single worker wakeup. Sleeps if there are too many items on the
+	 * queue (the high watermark is checked for each item). All items
+	 * go to the same lane.
+	 */
+	bool putMany(const vector<T>& tv, int lane = -1)
+	{
+		PTMutexLocker lock(m_mutex);
+		if (!lock.ok() || !ok()) {
+			LOGERR(("WorkQueue::putMany:%s: !ok or mutex_lock failed\n",
+					m_name.c_str()));
+			return false;
+		}
+
+		for (typename vector<T>::const_iterator it = tv.begin();
+			 it != tv.end(); it++) {
+			while (ok() && m_high > 0 && m_qcount >= m_high) {
+				m_clientsleeps++;
+				// Let the workers process what we queued so far
+				if (m_workers_waiting > 0)
+					pthread_cond_broadcast(&m_wcond);
+				m_clients_waiting++;
+				if (pthread_cond_wait(&m_ccond, lock.getMutex()) || !ok()) {
+					m_clients_waiting--;
+					return false;
+				}
+				m_clients_waiting--;
+			}
+			qpush(*it, lane);
+		}
+
+		if (m_workers_waiting > 0) {
+			if (tv.size() > 1)
+				pthread_cond_broadcast(&m_wcond);
+			else
+				pthread_cond_signal(&m_wcond);
+		} else {
+			m_nowake++;
+		}
+		return true;
+	}
+
 	/** Wait until the queue is inactive. Called from client.
 	 *
 	 * Waits until the task queue is empty and the workers are all
@@ -170,7 +243,7 @@ public:
 
 		// We're done when the queue is empty AND all workers are back
 		// waiting for a task.
-		while (ok() && (m_queue.size() > 0 ||
+		while (ok() && (m_qcount > 0 ||
 						m_workers_waiting != m_worker_threads.size())) {
 			m_clients_waiting++;
 			if (pthread_cond_wait(&m_ccond, lock.getMutex())) {
@@ -253,11 +326,12 @@ public:
 			LOGDEB(("WorkQueue::take:%s: not ok\n", m_name.c_str()));
 			return false;
 		}
+		serviceEnd();
 
-		while (ok() && m_queue.size() < m_low) {
+		while (ok() && m_qcount < m_low) {
 			m_workersleeps++;
 			m_workers_waiting++;
-			if (m_queue.empty())
+			if (m_qcount == 0)
 				pthread_cond_broadcast(&m_ccond);
 			if (pthread_cond_wait(&m_wcond, lock.getMutex()) || !ok()) {
 				// !ok is a normal condition when shutting down
@@ -272,10 +346,10 @@ public:
 		}
 
 		m_tottasks++;
-		*tp = m_queue.front();
 		if (szp)
-			*szp = m_queue.size();
-		m_queue.pop();
+			*szp = m_qcount;
+		qpop(tp);
+		serviceStart();
 		if (m_clients_waiting > 0) {
 			// No reason to wake up more than one client thread
 			pthread_cond_signal(&m_ccond);
@@ -285,6 +359,49 @@ public:
 		return true;
 	}
 
+	/** Take up to n tasks from queue. Called from worker.
+	 *
+	 * Sleeps like take() if there are not enough, then moves all
+	 * available tasks, up to n, to the output vector (which is
+	 * cleared first), under a single lock acquisition.
+	 */
+	bool takeUpTo(size_t n, vector<T>& tv)
+	{
+		tv.clear();
+		PTMutexLocker lock(m_mutex);
+		if (!lock.ok() || !ok()) {
+			LOGDEB(("WorkQueue::takeUpTo:%s: not ok\n", m_name.c_str()));
+			return false;
+		}
+		serviceEnd();
+
+		while (ok() && m_qcount < m_low) {
+			m_workersleeps++;
+			m_workers_waiting++;
+			if (m_qcount == 0)
+				pthread_cond_broadcast(&m_ccond);
+			if (pthread_cond_wait(&m_wcond, lock.getMutex()) || !ok()) {
+				m_workers_waiting--;
+				return false;
+			}
+			m_workers_waiting--;
+		}
+
+		while (m_qcount > 0 && tv.size() < n) {
+			tv.push_back(T());
+			qpop(&tv.back());
+		}
+		serviceStart();
+		m_tottasks += tv.size();
+		if (m_clients_waiting > 0) {
+			// Several slots may have been freed: wake all clients
+			pthread_cond_broadcast(&m_ccond);
+		} else {
+			m_nowake++;
+		}
+		return true;
+	}
+
 	/** Advertise exit and abort queue. Called from worker
 	 *
 	 * This would happen after an unrecoverable error, or when
@@ -305,11 +422,94 @@ public:
 	size_t qsize()
 	{
 		PTMutexLocker lock(m_mutex);
-		size_t sz = m_queue.size();
+		size_t sz = m_qcount;
 		return sz;
 	}
 
+	virtual void getStats(WQStats& stats)
+	{
+		PTMutexLocker lock(m_mutex);
+		stats.name = m_name;
+		stats.depth = m_qcount;
+		stats.highwater = m_highwater;
+		stats.workers = m_worker_threads.size();
+		stats.tasks = m_tottasks;
+		stats.nowake = m_nowake;
+		stats.workersleeps = m_workersleeps;
+		stats.clientsleeps = m_clientsleeps;
+		m_waithist.snapshot(stats.wait);
+		m_servicehist.snapshot(stats.service);
+	}
+
 private:
+	enum {defaultAgeLimit = 8};
+
+	// Task with its queueing time
+	struct Item {
+		Item() {}
+		Item(const T& _t, long long _enq) : t(_t), enq(_enq) {}
+		T t;
+		long long enq;
+	};
+
+	// Queue a task on the specified lane. Call with the mutex held.
+	void qpush(const T& t, int lane)
+	{
+		if (lane < 0 || lane >= int(m_lanes.size()))
+			lane = m_lanes.size() - 1;
+		m_lanes[lane].push(Item(t, wqnow()));
+		m_qcount++;
+		if (m_qcount > m_highwater)
+			m_highwater = m_qcount;
+	}
+
+	// Dequeue the next task according to lane priority and aging. Call
+	// with the mutex held, and with m_qcount > 0.
+	void qpop(T* tp)
+	{
+		unsigned int top = 0;
+		while (m_lanes[top].empty())
+			top++;
+		unsigned int sel = top;
+		for (unsigned int i = top + 1; i < m_lanes.size(); i++) {
+			if (!m_lanes[i].empty() && m_skips[i] >= m_agelimit) {
+				sel = i;
+				break;
+			}
+		}
+		for (unsigned int i = top; i < m_lanes.size(); i++) {
+			if (i != sel && !m_lanes[i].empty())
+				m_skips[i]++;
+		}
+		m_skips[sel] = 0;
+		const Item& item = m_lanes[sel].front();
+		*tp = item.t;
+		m_waithist.add(wqnow() - item.enq);
+		m_lanes[sel].pop();
+		m_qcount--;
+	}
+
+	// Service time accounting: the time between a worker's
+	// successive takes. Call with the mutex held.
+	void serviceEnd()
+	{
+		typename unordered_map<pthread_t, WQTData>::iterator it =
+			m_worker_threads.find(pthread_self());
+		if (it == m_worker_threads.end() || it->second.wstart.tv_sec == 0)
+			return;
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		m_servicehist.add(nanodiff(it->second.wstart, now));
+		it->second.wstart.tv_sec = 0;
+	}
+	void serviceStart()
+	{
+		typename unordered_map<pthread_t, WQTData>::iterator it =
+			m_worker_threads.find(pthread_self());
+		if (it != m_worker_threads.end())
+			clock_gettime(CLOCK_MONOTONIC, &it->second.wstart);
+	}
+
 	bool ok()
 	{
 		bool isok = m_ok && m_workers_exited == 0 && !m_worker_threads.empty();
@@ -343,7 +543,12 @@ private:
 	unordered_map<pthread_t, WQTData> m_worker_threads;
 
 	// Synchronization
-	queue<T> m_queue;
+	// One FIFO per priority lane, with the count of takes which passed
+	// over each non-empty lane, and the total task count.
+	vector<queue<Item> > m_lanes;
+	vector<unsigned int> m_skips;
+	size_t m_qcount;
+	unsigned int m_agelimit;
 	pthread_cond_t m_ccond;
 	pthread_cond_t m_wcond;
 	PTMutexInit m_mutex;
@@ -356,6 +561,9 @@ private:
 	unsigned int m_nowake;
 	unsigned int m_workersleeps;
 	unsigned int m_clientsleeps;
+	size_t m_highwater;
+	WQHisto m_waithist;
+	WQHisto m_servicehist;
 };
 
 #endif /* _WORKQUEUE_H_INCLUDED_ */
@@ -0,0 +1,116 @@
+/*	 Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "config.h"
+
+#include <set>
+using namespace std;
+
+#include "ptmutex.hxx"
+#include "wqstats.hxx"
+
+__thread WQLastTake wqLastTake;
+
+WQHistoData::WQHistoData()
+{
+	for (int i = 0; i < nbuckets; i++)
+		buckets[i] = 0;
+}
+
+unsigned long long WQHistoData::count() const
+{
+	unsigned long long cnt = 0;
+	for (int i = 0; i < nbuckets; i++)
+		cnt += buckets[i];
+	return cnt;
+}
+
+unsigned long long WQHistoData::percentile(double pc) const
+{
+	unsigned long long total = count();
+	if (total == 0)
+		return 0;
+	unsigned long long target = (unsigned long long)(total * pc / 100.0);
+	if (target >= total)
+		target = total - 1;
+	unsigned long long cumul = 0;
+	for (int i = 0; i < nbuckets; i++) {
+		cumul += buckets[i];
+		if (cumul > target)
+			return 1ULL << i;
+	}
+	return 1ULL << (nbuckets - 1);
+}
+
+// The queues are often static objects: the list must be available
+// whatever the construction order.
+static PTMutexInit& registryMutex()
+{
+	static PTMutexInit mutex;
+	return mutex;
+}
+static set<WQStatsSource*>& registryQueues()
+{
+	static set<WQStatsSource*> queues;
+	return queues;
+}
+
+void WQRegistry::add(WQStatsSource *src)
+{
+	PTMutexLocker lock(registryMutex());
+	registryQueues().insert(src);
+}
+
+void WQRegistry::remove(WQStatsSource *src)
+{
+	PTMutexLocker lock(registryMutex());
+	registryQueues().erase(src);
+}
+
+void WQRegistry::getAll(vector<WQStats>& stats)
+{
+	stats.clear();
+	PTMutexLocker lock(registryMutex());
+	set<WQStatsSource*>& queues = registryQueues();
+	for (set<WQStatsSource*>::iterator it = queues.begin();
+		 it != queues.end(); it++) {
+		stats.push_back(WQStats());
+		(*it)->getStats(stats.back());
+	}
+}
+
+static void dumpHisto(ostream& out, const char *what, const WQHistoData& h)
+{
+	out << "    " << what << " uS: count " << h.count() <<
+		" p50 < " << h.percentile(50) << " p90 < " << h.percentile(90) <<
+		" p99 < " << h.percentile(99) << " max < " << h.percentile(100) <<
+		endl;
+}
+
+void WQRegistry::dumpAll(ostream& out)
+{
+	vector<WQStats> stats;
+	getAll(stats);
+	for (vector<WQStats>::const_iterator it = stats.begin();
+		 it != stats.end(); it++) {
+		out << it->name << ": workers " << it->workers << " depth " <<
+			it->depth << " highwater " << it->highwater << " tasks " <<
+			it->tasks << " nowake " << it->nowake << " wsleeps " <<
+			it->workersleeps << " csleeps " << it->clientsleeps << endl;
+		dumpHisto(out, "wait", it->wait);
+		dumpHisto(out, "service", it->service);
+	}
+}
@@ -0,0 +1,157 @@
+/*	 Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _WQSTATS_H_INCLUDED_
+#define _WQSTATS_H_INCLUDED_
+
+#include <time.h>
+
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/** Monotonic clock in nanoseconds */
+inline long long wqnow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** Snapshot of a WQHisto */
+struct WQHistoData {
+	enum {nbuckets = 24};
+	WQHistoData();
+	/** Total count of values */
+	unsigned long long count() const;
+	/** Upper bound (microseconds) of the bucket holding the pc percentile */
+	unsigned long long percentile(double pc) const;
+	unsigned long long buckets[nbuckets];
+};
+
+/**
+ * Histogram of durations with power of 2 microsecond buckets: bucket 0
+ * counts values under 1 uS, bucket i values under 2^i uS, the last
+ * one everything above. add() can be called concurrently without
+ * locking.
+ */
+class WQHisto {
+public:
+	WQHisto() {reset();}
+	void add(long long ns)
+	{
+		unsigned long long us = ns > 0 ? ns / 1000 : 0;
+		int i = 0;
+		while (us && i < WQHistoData::nbuckets - 1) {
+			us >>= 1;
+			i++;
+		}
+		m_buckets[i].fetch_add(1, std::memory_order_relaxed);
+	}
+	void reset()
+	{
+		for (int i = 0; i < WQHistoData::nbuckets; i++)
+			m_buckets[i].store(0, std::memory_order_relaxed);
+	}
+	void snapshot(WQHistoData& data) const
+	{
+		for (int i = 0; i < WQHistoData::nbuckets; i++)
+			data.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+	}
+private:
+	std::atomic<unsigned long long> m_buckets[WQHistoData::nbuckets];
+};
+
+/** Statistics snapshot for a work queue. Counters which a queue type
+ * does not maintain are left at 0 */
+struct WQStats {
+	WQStats()
+		: depth(0), highwater(0), workers(0), tasks(0), nowake(0),
+		  workersleeps(0), clientsleeps(0)
+	{}
+	std::string name;
+	// Current and maximum task count on queue
+	size_t depth;
+	size_t highwater;
+	unsigned int workers;
+	// Tasks taken by workers
+	unsigned long long tasks;
+	// Puts which did not need to wake a worker
+	unsigned long long nowake;
+	unsigned long long workersleeps;
+	unsigned long long clientsleeps;
+	// Time between a task's put() and take()
+	WQHistoData wait;
+	// Time between a worker's take() and its next one
+	WQHistoData service;
+};
+
+/** Interface implemented by the queues for the registry */
+class WQStatsSource {
+public:
+	virtual ~WQStatsSource() {}
+	virtual void getStats(WQStats& stats) = 0;
+};
+
+/**
+ * Process-wide list of the live work queues. The queues register
+ * themselves on construction and unregister on destruction. Callers
+ * get snapshots of all the queues at any time.
+ */
+class WQRegistry {
+public:
+	static void add(WQStatsSource *src);
+	static void remove(WQStatsSource *src);
+	static void getAll(std::vector<WQStats>& stats);
+	/** Print the snapshots for all queues, in readable form */
+	static void dumpAll(std::ostream& out);
+};
+
+/**
+ * Service time accounting for the lock-free queues, which can't
+ * cheaply use per-worker data. We remember in thread-local storage
+ * the queue and time of the last take(). A worker serving several
+ * queues alternately only gets the matching intervals accounted.
+ */
+struct WQLastTake {
+	const void *queue;
+	long long when;
+};
+extern __thread WQLastTake wqLastTake;
+
+// Called on entering take()
+inline void wqServiceEnd(const void *queue, WQHisto& hist)
+{
+	if (wqLastTake.queue == queue) {
+		hist.add(wqnow() - wqLastTake.when);
+		wqLastTake.queue = 0;
+	}
+}
+// Called when returning a task from take()
+inline void wqServiceStart(const void *queue, long long now)
+{
+	wqLastTake.queue = queue;
+	wqLastTake.when = now;
+}
+
+#endif /* _WQSTATS_H_INCLUDED_ */
+/* Local Variables: */
+/* mode: c++ */
+/* c-basic-offset: 4 */
+/* tab-width: 4 */
+/* indent-tabs-mode: t */
+/* End: */
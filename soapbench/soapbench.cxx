@@ -0,0 +1,346 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+////////////////////// SOAP action microbenchmark
+//
+// Runs prebuilt action requests for each of the UpMpd actions
+// through the device callback, as libupnp would, with an in-memory
+// MPDCli (stubmpdcli.cxx). For each action, this reports the median
+// time for the complete call and the count and size of the C++
+// allocations per call. The libupnp (ixml) allocations, done with
+// malloc(), are not counted.
+//
+// The median times for decoding the arguments, running the handler
+// and encoding the response come from the trace spans recorded by the
+// device callback around these phases. They are measured in a second
+// pass with tracing on, so that the trace buffer does not disturb the
+// totals and allocation counts of the first one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <new>
+using namespace std;
+
+#include "libupnpp/upnpplib.hxx"
+#include "libupnpp/soaphelp.hxx"
+#include "libupnpp/device.hxx"
+#include "libupnpp/log.hxx"
+#include "libupnpp/metrics.hxx"
+#include "libupnpp/trace.hxx"
+#include "upmpd/mpdcli.hxx"
+#include "upmpd/upmpd.hxx"
+
+static std::atomic<unsigned long long> nallocs(0);
+static std::atomic<unsigned long long> nallocbytes(0);
+
+void *operator new(size_t size)
+{
+	nallocs.fetch_add(1, std::memory_order_relaxed);
+	nallocbytes.fetch_add(size, std::memory_order_relaxed);
+	void *p = malloc(size ? size : 1);
+	if (p == 0)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+static const char *rdcstype = 
+	"urn:schemas-upnp-org:service:RenderingControl:1";
+static const char *rdcsid = "urn:upnp-org:serviceId:RenderingControl";
+static const char *avtstype = "urn:schemas-upnp-org:service:AVTransport:1";
+static const char *avtsid = "urn:upnp-org:serviceId:AVTransport";
+static const char *devudn = "uuid:soapbench";
+
+static const char *metadata = 
+	"<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+	"xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
+	"xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\">"
+	"<item id=\"0$1$17$2$0\" parentID=\"0$1$17$2\" restricted=\"1\">"
+	"<dc:title>Some Title &amp; More</dc:title>"
+	"<upnp:artist>Some Artist</upnp:artist>"
+	"<upnp:album>Some Album</upnp:album>"
+	"<upnp:genre>Rock</upnp:genre>"
+	"<upnp:originalTrackNumber>3</upnp:originalTrackNumber>"
+	"<upnp:class>object.item.audioItem.musicTrack</upnp:class>"
+	"<res protocolInfo=\"http-get:*:audio/flac:*\" size=\"28173512\" "
+	"duration=\"0:04:05.000\" bitrate=\"176400\" sampleFrequency=\"44100\" "
+	"nrAudioChannels=\"2\">"
+	"http://192.168.1.1:9790/minimserver/*/music/track3.flac</res>"
+	"</item></DIDL-Lite>";
+
+// The actions and their arguments (name/value pairs, null-terminated)
+static const struct BenchAction {
+	const char *stype;
+	const char *sid;
+	const char *name;
+	const char *args[9];
+} actions[] = {
+	{rdcstype, rdcsid, "SetMute", {"InstanceID", "0", "Channel", "Master",
+								   "DesiredMute", "0", 0}},
+	{rdcstype, rdcsid, "GetMute", {"InstanceID", "0", "Channel", "Master", 0}},
+	{rdcstype, rdcsid, "SetVolume", {"InstanceID", "0", "Channel", "Master",
+									 "DesiredVolume", "40", 0}},
+	{rdcstype, rdcsid, "GetVolume", {"InstanceID", "0", "Channel", "Master",
+									 0}},
+	{rdcstype, rdcsid, "ListPresets", {"InstanceID", "0", 0}},
+	{rdcstype, rdcsid, "SelectPreset", {"InstanceID", "0", "PresetName",
+										"FactoryDefaults", 0}},
+	{avtstype, avtsid, "SetAVTransportURI", {"InstanceID", "0", 
+		"CurrentURI", "http://192.168.1.1:9790/minimserver/*/music/track3.flac",
+		"CurrentURIMetaData", metadata, 0}},
+	{avtstype, avtsid, "SetNextAVTransportURI", {"InstanceID", "0", 
+		"NextURI", "http://192.168.1.1:9790/minimserver/*/music/track4.flac",
+		"NextURIMetaData", metadata, 0}},
+	{avtstype, avtsid, "GetPositionInfo", {"InstanceID", "0", 0}},
+	{avtstype, avtsid, "GetTransportInfo", {"InstanceID", "0", 0}},
+	{avtstype, avtsid, "GetMediaInfo", {"InstanceID", "0", 0}},
+	{avtstype, avtsid, "GetDeviceCapabilities", {"InstanceID", "0", 0}},
+	{avtstype, avtsid, "SetPlayMode", {"InstanceID", "0", "NewPlayMode",
+									   "NORMAL", 0}},
+	{avtstype, avtsid, "GetTransportSettings", {"InstanceID", "0", 0}},
+	{avtstype, avtsid, "GetCurrentTransportActions", {"InstanceID", "0", 0}},
+	{avtstype, avtsid, "Play", {"InstanceID", "0", "Speed", "1", 0}},
+	{avtstype, avtsid, "Pause", {"InstanceID", "0", 0}},
+	{avtstype, avtsid, "Seek", {"InstanceID", "0", "Unit", "REL_TIME",
+								"Target", "0:01:00", 0}},
+	{avtstype, avtsid, "Next", {"InstanceID", "0", 0}},
+	{avtstype, avtsid, "Previous", {"InstanceID", "0", 0}},
+	{avtstype, avtsid, "Stop", {"InstanceID", "0", 0}},
+};
+static const int nactions = sizeof(actions) / sizeof(actions[0]);
+
+static IXML_Document *makeRequest(const BenchAction& action)
+{
+	IXML_Document *doc = UpnpMakeAction(action.name, action.stype, 0, 0, 0);
+	for (int i = 0; doc && action.args[i]; i += 2) {
+		UpnpAddToAction(&doc, action.name, action.stype, action.args[i],
+						action.args[i+1]);
+	}
+	return doc;
+}
+
+static double median(vector<double>& values)
+{
+	sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+// Results for one action. Times in microseconds.
+struct BenchResult {
+	BenchResult() : ok(false), total(0), allocs(0), allocbytes(0) {
+		for (int i = 0; i < Trace::NCATEGORIES; i++)
+			phases[i] = 0;
+	}
+	bool ok;
+	double total;
+	double allocs;
+	double allocbytes;
+	double phases[Trace::NCATEGORIES]; // Only DECODE, HANDLER, ENCODE
+};
+
+// Run one action iterations times. Returns false if it failed.
+static bool runAction(const BenchAction& action, int iterations,
+					  vector<double>& totals, unsigned long long& allocs,
+					  unsigned long long& allocbytes)
+{
+	IXML_Document *request = makeRequest(action);
+	if (request == 0) {
+		fprintf(stderr, "%s: can't build request\n", action.name);
+		return false;
+	}
+	allocs = allocbytes = 0;
+	for (int i = 0; i < iterations; i++) {
+		struct Upnp_Action_Request act;
+		memset(&act, 0, sizeof(act));
+		strncpy(act.ActionName, action.name, sizeof(act.ActionName) - 1);
+		strncpy(act.DevUDN, devudn, sizeof(act.DevUDN) - 1);
+		strncpy(act.ServiceID, action.sid, sizeof(act.ServiceID) - 1);
+		act.ActionRequest = request;
+
+		unsigned long long allocs0 = nallocs, bytes0 = nallocbytes;
+		long long start = Metrics::now();
+		int ret = UpnpDevice::sCallBack(UPNP_CONTROL_ACTION_REQUEST, &act, 0);
+		long long end = Metrics::now();
+		allocs += nallocs - allocs0;
+		allocbytes += nallocbytes - bytes0;
+		totals.push_back((end - start) / 1000.0);
+		if (ret != UPNP_E_SUCCESS || act.ActionResult == 0) {
+			fprintf(stderr, "%s: failed: %d\n", action.name, ret);
+			ixmlDocument_free(request);
+			return false;
+		}
+		ixmlDocument_free(act.ActionResult);
+	}
+	ixmlDocument_free(request);
+	return true;
+}
+
+// Read the records added to the trace file since the last call, and
+// collect the span durations (microseconds) by category.
+static void readSpans(ifstream& input, vector<double> durs[])
+{
+	input.clear();
+	TraceRecord rec;
+	while (input.read((char *)&rec, sizeof(rec))) {
+		if (rec.cat == Trace::NAME) {
+			input.ignore(rec.namelen + (8 - rec.namelen % 8) % 8);
+			continue;
+		}
+		if (rec.cat < Trace::NCATEGORIES)
+			durs[rec.cat].push_back(rec.dur / 1000.0);
+	}
+}
+
+static void printResult(const char *name, const BenchResult& res)
+{
+	printf("%-27s %9.2f %9.2f %9.2f %9.2f %8.1f %9.0f\n", name,
+		   res.total, res.phases[Trace::DECODE], res.phases[Trace::HANDLER],
+		   res.phases[Trace::ENCODE], res.allocs, res.allocbytes);
+}
+
+static char *thisprog;
+static char usage [] =
+			" [-n iterations] [-a action]\n"
+			"   Measure the processing time of the UpMpd SOAP actions\n"
+			" -n iterations : calls for each action (default 10000)\n"
+			" -a action : only run the specified action\n"
+			"  \n\n"
+			;
+static void
+Usage(void)
+{
+	fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+	exit(1);
+}
+static int	   op_flags;
+#define OPT_MOINS 0x1
+#define OPT_n	  0x2
+#define OPT_a	  0x4
+
+int main(int argc, char *argv[])
+{
+	int iterations = 10000;
+	string onlyaction;
+
+	thisprog = argv[0];
+	argc--; argv++;
+
+	while (argc > 0 && **argv == '-') {
+		(*argv)++;
+		if (!(**argv))
+			Usage();
+		while (**argv)
+			switch (*(*argv)++) {
+			case 'n':	op_flags |= OPT_n; if (argc < 2)  Usage();
+				iterations = atoi(*(++argv)); argc--; goto b1;
+			case 'a':	op_flags |= OPT_a; if (argc < 2)  Usage();
+				onlyaction = *(++argv); argc--; goto b1;
+			default: Usage();	break;
+			}
+	b1: argc--; argv++;
+	}
+	if (argc != 0 || iterations < 1)
+		Usage();
+
+	if (upnppdebug::Logger::getTheLog("") == 0) {
+		fprintf(stderr, "Can't initialize log\n");
+		return 1;
+	}
+	upnppdebug::Logger::getTheLog("")->setLogLevel(upnppdebug::Logger::LLERR);
+
+	// The device is created without a description, so that it is not
+	// published on the network.
+	MPDCli mpdcli("localhost");
+	unordered_map<string, string> xmlfiles;
+	UpMpd device(devudn, xmlfiles, &mpdcli);
+	if (!device.ok()) {
+		fprintf(stderr, "Device initialization failed\n");
+		return 1;
+	}
+
+	vector<BenchResult> results(nactions);
+	int ret = 0;
+	for (int i = 0; i < nactions; i++) {
+		if (!onlyaction.empty() && onlyaction != actions[i].name)
+			continue;
+		vector<double> totals;
+		unsigned long long allocs, allocbytes;
+		if (!runAction(actions[i], iterations, totals, allocs, allocbytes)) {
+			ret = 1;
+			continue;
+		}
+		BenchResult& res = results[i];
+		res.ok = true;
+		res.total = median(totals);
+		res.allocs = double(allocs) / iterations;
+		res.allocbytes = double(allocbytes) / iterations;
+	}
+
+	// Second pass for the phase times
+	char tracefile[] = "/tmp/soapbenchXXXXXX";
+	int fd = mkstemp(tracefile);
+	if (fd < 0 || !Trace::open(tracefile)) {
+		fprintf(stderr, "Can't open trace file\n");
+		return 1;
+	}
+	close(fd);
+	ifstream input(tracefile, ios::in | ios::binary);
+	unlink(tracefile);
+	TraceFileHeader hdr;
+	input.read((char *)&hdr, sizeof(hdr));
+	for (int i = 0; i < nactions; i++) {
+		if (!results[i].ok)
+			continue;
+		vector<double> totals;
+		unsigned long long allocs, allocbytes;
+		if (!runAction(actions[i], iterations, totals, allocs, allocbytes)) {
+			results[i].ok = false;
+			ret = 1;
+			continue;
+		}
+		Trace::flush();
+		vector<double> durs[Trace::NCATEGORIES];
+		readSpans(input, durs);
+		int phases[] = {Trace::DECODE, Trace::HANDLER, Trace::ENCODE};
+		for (int j = 0; j < 3; j++) {
+			if (!durs[phases[j]].empty())
+				results[i].phases[phases[j]] = median(durs[phases[j]]);
+		}
+	}
+
+	printf("Times in microseconds (median), allocations per call\n");
+	printf("%-27s %9s %9s %9s %9s %8s %9s\n", "action", "total", "decode",
+		   "handler", "encode", "allocs", "bytes");
+	for (int i = 0; i < nactions; i++) {
+		if (results[i].ok)
+			printResult(actions[i].name, results[i]);
+	}
+	return ret;
+}
@@ -0,0 +1,248 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+// In-memory replacement for mpdcli.cxx, used by soapbench to measure
+// the UPnP side of the actions without MPD. The state changes as the
+// commands are run, but nothing is played.
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+using namespace std;
+
+#include "upmpd/mpdcli.hxx"
+
+// The queue (song ids and uris). There is only one MPDCli in the
+// benchmark.
+static vector<pair<int, string> > queue;
+static int nextid = 1;
+
+static void setSong(unordered_map<string, string>& song, int pos)
+{
+	song.clear();
+	if (pos < 0 || pos >= int(queue.size()))
+		return;
+	char buf[100];
+	sprintf(buf, "Title %d", queue[pos].first);
+	song["dc:title"] = buf;
+	song["upnp:artist"] = "Some Artist & Friends";
+	song["upnp:album"] = "Some Album";
+	song["upnp:genre"] = "Rock";
+	sprintf(buf, "%d", pos + 1);
+	song["upnp:originalTrackNumber"] = buf;
+	song["uri"] = queue[pos].second;
+}
+
+MPDCli::MPDCli(const string& host, int port, const string& pass)
+	: m_conn((void*)1), m_ok(true), m_premutevolume(0), m_cachedvolume(50),
+	  m_host(host), m_port(port), m_password(pass), m_newport(0),
+	  m_newserver(false)
+{
+	m_stat.volume = 50;
+	m_stat.rept = m_stat.random = m_stat.single = m_stat.consume = false;
+	m_stat.qlen = 0;
+	m_stat.qvers = 1;
+	m_stat.state = MpdStatus::MPDS_STOP;
+	m_stat.crossfade = 0;
+	m_stat.mixrampdb = 0;
+	m_stat.mixrampdelay = 0;
+	m_stat.songpos = m_stat.songid = -1;
+	m_stat.songelapsedms = 0;
+	m_stat.songlenms = 0;
+	m_stat.kbrate = 0;
+	for (int i = 0; i < 3; i++) {
+		char uri[100];
+		sprintf(uri, "http://192.168.1.1:9790/minimserver/track%d.flac", i);
+		insert(uri, i);
+	}
+	play(0);
+}
+
+MPDCli::~MPDCli()
+{
+}
+
+bool MPDCli::openconn()
+{
+	return true;
+}
+
+void MPDCli::setServer(const string& host, int port)
+{
+	m_host = host;
+	m_port = port;
+}
+
+bool MPDCli::showError(const string&)
+{
+	return false;
+}
+
+bool MPDCli::updStatus()
+{
+	m_stat.qlen = queue.size();
+	if (m_stat.songpos >= int(queue.size()))
+		m_stat.songpos = -1;
+	m_stat.songid = m_stat.songpos >= 0 ? queue[m_stat.songpos].first : -1;
+	if (m_stat.state != MpdStatus::MPDS_STOP && m_stat.songpos >= 0) {
+		m_stat.songelapsedms = 61000;
+		m_stat.songlenms = 245000;
+		m_stat.kbrate = 1411;
+	} else {
+		m_stat.songelapsedms = m_stat.songlenms = m_stat.kbrate = 0;
+	}
+	setSong(m_stat.currentsong, m_stat.songpos);
+	setSong(m_stat.nextsong, m_stat.songpos >= 0 ? m_stat.songpos + 1 : -1);
+	return true;
+}
+
+bool MPDCli::updSong(unordered_map<string, string>& song, int pos)
+{
+	setSong(song, pos);
+	return true;
+}
+
+bool MPDCli::setVolume(int volume, bool isMute)
+{
+	if (isMute) {
+		if (volume) {
+			volume = m_premutevolume;
+		} else {
+			m_premutevolume = m_stat.volume;
+		}
+	}
+	m_stat.volume = m_cachedvolume = volume;
+	return true;
+}
+
+int MPDCli::getVolume()
+{
+	return m_stat.volume;
+}
+
+bool MPDCli::togglePause()
+{
+	if (m_stat.state == MpdStatus::MPDS_PLAY)
+		m_stat.state = MpdStatus::MPDS_PAUSE;
+	else if (m_stat.state == MpdStatus::MPDS_PAUSE)
+		m_stat.state = MpdStatus::MPDS_PLAY;
+	return true;
+}
+
+bool MPDCli::play(int pos)
+{
+	if (pos >= int(queue.size()))
+		return false;
+	if (pos >= 0)
+		m_stat.songpos = pos;
+	else if (m_stat.songpos < 0)
+		m_stat.songpos = 0;
+	m_stat.state = MpdStatus::MPDS_PLAY;
+	return true;
+}
+
+bool MPDCli::stop()
+{
+	m_stat.state = MpdStatus::MPDS_STOP;
+	return true;
+}
+
+bool MPDCli::seek(int)
+{
+	return m_stat.songpos >= 0;
+}
+
+// Stay on the current song, so that the benchmark can repeat these
+bool MPDCli::next()
+{
+	return m_stat.songpos >= 0;
+}
+
+bool MPDCli::previous()
+{
+	return m_stat.songpos >= 0;
+}
+
+bool MPDCli::repeat(bool on)
+{
+	m_stat.rept = on;
+	return true;
+}
+
+bool MPDCli::random(bool on)
+{
+	m_stat.random = on;
+	return true;
+}
+
+bool MPDCli::single(bool on)
+{
+	m_stat.single = on;
+	return true;
+}
+
+int MPDCli::insert(const string& uri, int pos)
+{
+	if (pos < 0 || pos > int(queue.size()))
+		pos = queue.size();
+	// Keep the queue small, dropping the oldest entry after the current.
+	if (queue.size() >= 10) {
+		int victim = m_stat.songpos + 1 < int(queue.size()) ? 
+			m_stat.songpos + 1 : 0;
+		queue.erase(queue.begin() + victim);
+		if (pos > victim)
+			pos--;
+		if (m_stat.songpos > victim)
+			m_stat.songpos--;
+	}
+	int id = nextid++;
+	queue.insert(queue.begin() + pos, pair<int, string>(id, uri));
+	if (m_stat.songpos >= pos)
+		m_stat.songpos++;
+	m_stat.qvers++;
+	return id;
+}
+
+bool MPDCli::deleteId(int id)
+{
+	for (unsigned int i = 0; i < queue.size(); i++) {
+		if (queue[i].first == id) {
+			queue.erase(queue.begin() + i);
+			if (m_stat.songpos > int(i))
+				m_stat.songpos--;
+			m_stat.qvers++;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool MPDCli::statId(int id)
+{
+	for (unsigned int i = 0; i < queue.size(); i++)
+		if (queue[i].first == id)
+			return true;
+	return false;
+}
+
+int MPDCli::curpos()
+{
+	updStatus();
+	return m_stat.songpos;
+}
@@ -0,0 +1,165 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+////////////////////// Decoder for the libupnpp binary trace files
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+using namespace std;
+
+#include "libupnpp/trace.hxx"
+
+// All the spans for one category and name
+struct SpanSet {
+	SpanSet() : totvalue(0) {}
+	vector<uint64_t> durs;
+	long long totvalue;
+};
+
+static string nameFor(const map<unsigned int, string>& names,
+					  unsigned int id)
+{
+	map<unsigned int, string>::const_iterator it = names.find(id);
+	if (it == names.end()) {
+		char buf[30];
+		sprintf(buf, "#%u", id);
+		return buf;
+	}
+	return it->second;
+}
+
+// Duration at percentile pc in microseconds, from sorted durations
+static double pcus(const vector<uint64_t>& durs, double pc)
+{
+	size_t idx = size_t(durs.size() * pc / 100.0);
+	if (idx >= durs.size())
+		idx = durs.size() - 1;
+	return durs[idx] / 1000.0;
+}
+
+static char *thisprog;
+static char usage [] =
+			" [-r] tracefile\n"
+			"   Print count, total time and latency percentiles for each "
+			"span type\n"
+			" -r : also list all the records, in file order\n"
+			"  \n\n"
+			;
+static void
+Usage(void)
+{
+	fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+	exit(1);
+}
+static int	   op_flags;
+#define OPT_MOINS 0x1
+#define OPT_r	  0x2
+
+int main(int argc, char *argv[])
+{
+	thisprog = argv[0];
+	argc--; argv++;
+
+	while (argc > 0 && **argv == '-') {
+		(*argv)++;
+		if (!(**argv))
+			Usage();
+		while (**argv)
+			switch (*(*argv)++) {
+			case 'r':	op_flags |= OPT_r; break;
+			default: Usage();	break;
+			}
+		argc--; argv++;
+	}
+	if (argc != 1)
+		Usage();
+
+	ifstream input(argv[0], ios::in | ios::binary);
+	if (!input.is_open()) {
+		cerr << "Can't open " << argv[0] << endl;
+		return 1;
+	}
+	TraceFileHeader hdr;
+	if (!input.read((char *)&hdr, sizeof(hdr)) ||
+		memcmp(hdr.magic, "UPNPTRC1", 8)) {
+		cerr << argv[0] << ": not a trace file" << endl;
+		return 1;
+	}
+	if (hdr.byteorder != 0x01020304 || hdr.recsize != sizeof(TraceRecord)) {
+		cerr << argv[0] << ": written on a different architecture" << endl;
+		return 1;
+	}
+
+	map<unsigned int, string> names;
+	map<pair<int, unsigned int>, SpanSet> spans;
+	uint64_t first = 0, last = 0;
+	TraceRecord rec;
+	while (input.read((char *)&rec, sizeof(rec))) {
+		if (rec.cat == Trace::NAME) {
+			size_t padded = rec.namelen + (8 - rec.namelen % 8) % 8;
+			string name(padded, 0);
+			if (!input.read(&name[0], padded))
+				break;
+			name.resize(rec.namelen);
+			names[rec.nameid] = name;
+			continue;
+		}
+		if (first == 0 || rec.start < first)
+			first = rec.start;
+		if (rec.start + rec.dur > last)
+			last = rec.start + rec.dur;
+		SpanSet& set = spans[pair<int, unsigned int>(rec.cat, rec.nameid)];
+		set.durs.push_back(rec.dur);
+		set.totvalue += rec.value;
+		if ((op_flags & OPT_r)) {
+			printf("%12.3f ms %-10s %-30s %10.1f us %lld\n",
+				   (rec.start - (first ? first : rec.start)) / 1e6,
+				   Trace::catName(rec.cat),
+				   nameFor(names, rec.nameid).c_str(), rec.dur / 1000.0,
+				   (long long)rec.value);
+		}
+	}
+
+	printf("Trace duration: %.3f S\n", (last - first) / 1e9);
+	printf("%-10s %-30s %8s %10s %9s %9s %9s %9s %10s\n",
+		   "category", "name", "count", "total ms", "p50 us", "p90 us",
+		   "p99 us", "max us", "avg value");
+	for (map<pair<int, unsigned int>, SpanSet>::iterator it = spans.begin();
+		 it != spans.end(); it++) {
+		vector<uint64_t>& durs = it->second.durs;
+		sort(durs.begin(), durs.end());
+		uint64_t total = 0;
+		for (unsigned int i = 0; i < durs.size(); i++)
+			total += durs[i];
+		printf("%-10s %-30s %8u %10.3f %9.1f %9.1f %9.1f %9.1f %10.1f\n",
+			   Trace::catName(it->first.first),
+			   nameFor(names, it->first.second).c_str(),
+			   (unsigned int)durs.size(), total / 1e6,
+			   pcus(durs, 50), pcus(durs, 90), pcus(durs, 99),
+			   durs.back() / 1000.0,
+			   double(it->second.totvalue) / durs.size());
+	}
+	return 0;
+}
@@ -0,0 +1,155 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+#include <functional>
+#include <iostream>
+using namespace std;
+
+#include "libupnpp/log.hxx"
+#include "libupnpp/md5.hxx"
+#include "libupnpp/upnpplib.hxx"
+#include "libupnpp/vdir.hxx"
+
+#include "upmpdutils.hxx"
+#include "albumart.hxx"
+
+// Image file names we look for, in order of preference
+static const char *artnames[] = {"cover.jpg", "cover.png", "folder.jpg",
+                                 "folder.png", "front.jpg", "front.png",
+                                 "AlbumArt.jpg"};
+static const unsigned int nartnames = sizeof(artnames) / sizeof(char *);
+
+// Max count of directories we remember
+static const size_t maxArtEnts = 500;
+
+// Recheck directories where we found nothing after this time, in
+// case an image was added
+static const int negativeTtlS = 300;
+
+AlbumArt::AlbumArt(const string& musicdir, const string& vdirpath)
+    : m_musicdir(path_tildexpand(musicdir))
+{
+    if (m_musicdir.empty())
+        return;
+    VirtualDir *vdir = VirtualDir::getVirtualDir();
+    LibUPnP *lib = LibUPnP::getLibUPnP();
+    if (vdir == 0 || lib == 0) {
+        LOGERR("AlbumArt: can't get VirtualDir or LibUPnP" << endl);
+        m_musicdir.clear();
+        return;
+    }
+    string path(vdirpath);
+    path_catslash(path);
+    char portbuf[20];
+    sprintf(portbuf, "%d", lib->port());
+    m_urlprefix = string("http://") + lib->host() + ":" + portbuf + path;
+    vdir->addFileResolver(path, bind(&AlbumArt::resolve, this, 
+                                     placeholders::_1, placeholders::_2,
+                                     placeholders::_3));
+}
+
+// Get the (possibly new) entry for a directory, and mark it most
+// recently used. Returns true if the directory must be searched.
+// Called with the lock held.
+bool AlbumArt::lookup(const string& dir, string& id, ArtEnt*& ent)
+{
+    string digest;
+    MD5String(dir, digest);
+    MD5HexPrint(digest, id);
+
+    unordered_map<string, ArtEnt>::iterator it = m_ents.find(id);
+    if (it != m_ents.end()) {
+        ent = &it->second;
+        m_lru.splice(m_lru.begin(), m_lru, ent->lruit);
+        return ent->imgpath.empty() && 
+            time(0) - ent->checked >= negativeTtlS;
+    }
+    evict();
+    m_lru.push_front(id);
+    ent = &m_ents[id];
+    ent->lruit = m_lru.begin();
+    ent->checked = 0;
+    return true;
+}
+
+void AlbumArt::evict()
+{
+    while (m_ents.size() >= maxArtEnts && !m_lru.empty()) {
+        m_ents.erase(m_lru.back());
+        m_lru.pop_back();
+    }
+}
+
+string AlbumArt::uriFor(const string& songuri)
+{
+    // Streams and songs from other places have no art that we know of
+    if (m_musicdir.empty() || songuri.empty() || 
+        songuri.find("://") != string::npos || songuri[0] == '/') {
+        return string();
+    }
+    string::size_type slash = songuri.rfind('/');
+    string dir = slash == string::npos ? string() : songuri.substr(0, slash);
+
+    string id;
+    ArtEnt *ent;
+    {
+        PTMutexLocker lock(m_mutex);
+        if (!lookup(dir, id, ent)) 
+            return ent->imgpath.empty() ? string() : m_urlprefix + id;
+    }
+
+    // Search the directory without holding the lock
+    string fulldir = path_cat(m_musicdir, dir);
+    string imgpath;
+    for (unsigned int i = 0; i < nartnames; i++) {
+        string path = path_cat(fulldir, artnames[i]);
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            imgpath = path;
+            break;
+        }
+    }
+
+    PTMutexLocker lock(m_mutex);
+    // The entry may have been evicted while we were searching
+    lookup(dir, id, ent);
+    ent->imgpath = imgpath;
+    ent->checked = time(0);
+    return imgpath.empty() ? string() : m_urlprefix + id;
+}
+
+bool AlbumArt::resolve(const string& name, string& filename, string& mimetype)
+{
+    PTMutexLocker lock(m_mutex);
+    unordered_map<string, ArtEnt>::const_iterator it = m_ents.find(name);
+    if (it == m_ents.end() || it->second.imgpath.empty())
+        return false;
+    filename = it->second.imgpath;
+    string::size_type dot = filename.rfind('.');
+    if (dot != string::npos && !filename.compare(dot, string::npos, ".png")) {
+        mimetype = "image/png";
+    } else {
+        mimetype = "image/jpeg";
+    }
+    return true;
+}
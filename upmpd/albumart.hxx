@@ -0,0 +1,69 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _ALBUMART_H_X_INCLUDED_
+#define _ALBUMART_H_X_INCLUDED_
+
+#include <string>
+#include <list>
+#include <unordered_map>
+
+#include "libupnpp/ptmutex.hxx"
+
+/**
+ * Cover art for the songs played from the MPD music directory, served
+ * through the libupnp HTTP server.
+ *
+ * The art for a song is an image file (cover.jpg, folder.jpg...)
+ * in its directory. The results of the directory searches are kept in
+ * a bounded LRU cache, which also maps the published art URIs to the
+ * image files. The images are served as they are, without resizing.
+ */
+class AlbumArt {
+public:
+    /**
+     * @param musicdir the MPD music directory. Nothing is done if empty.
+     * @param vdirpath where to publish the images in the VirtualDir,
+     *   e.g. "/art/r0/"
+     */
+    AlbumArt(const std::string& musicdir, const std::string& vdirpath);
+
+    /** Return the art URI for an MPD song URI, or an empty string */
+    std::string uriFor(const std::string& songuri);
+
+    /** VirtualDir resolver for our URIs */
+    bool resolve(const std::string& name, std::string& filename,
+                 std::string& mimetype);
+
+private:
+    struct ArtEnt {
+        std::list<std::string>::iterator lruit;
+        std::string imgpath; // Empty if no image was found
+        time_t checked;
+    };
+    bool lookup(const std::string& dir, std::string& id, ArtEnt*& ent);
+    void evict();
+
+    std::string m_musicdir;
+    std::string m_urlprefix;
+    PTMutexInit m_mutex;
+    // Entries are keyed by id, a hash of the song directory. Most
+    // recently used ids are at the front of the list.
+    std::unordered_map<std::string, ArtEnt> m_ents;
+    std::list<std::string> m_lru;
+};
+
+#endif /* _ALBUMART_H_X_INCLUDED_ */
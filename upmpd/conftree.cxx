@@ -18,8 +18,10 @@
 
 #include <unistd.h> // for access(2)
 #include <ctype.h>
+#include <fcntl.h>
 #include <fnmatch.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <fstream>
 #include <sstream>
@@ -604,6 +606,256 @@ int ConfTree::get(const std::string &name, string &value, const string &sk)
     return 0;
 }
 
+// //////////////////////////////////////////////////////////////////////////
+// ConfMapped Methods: read-only, memory-mapped and hashed
+// //////////////////////////////////////////////////////////////////////////
+
+static const char *cfwhitespace = " \t";
+
+// Trim whitespace (or the specified chars) from both ends of a char range
+static void trimrange(const char *&p, size_t& len, const char *ws = cfwhitespace)
+{
+    while (len > 0 && strchr(ws, *p)) {
+	p++;
+	len--;
+    }
+    while (len > 0 && strchr(ws, p[len-1]))
+	len--;
+}
+
+// FNV-1a on subkey and name
+static unsigned int cfhash(const char *sk, size_t sklen, 
+			   const char *nm, size_t nmlen)
+{
+    unsigned int h = 2166136261U;
+    for (size_t i = 0; i < sklen; i++)
+	h = (h ^ (unsigned char)sk[i]) * 16777619U;
+    h = (h ^ 0xff) * 16777619U;
+    for (size_t i = 0; i < nmlen; i++)
+	h = (h ^ (unsigned char)nm[i]) * 16777619U;
+    return h;
+}
+
+ConfMapped::ConfMapped(const char *fname, bool tildexp)
+    : m_ok(false), m_tildexp(tildexp), m_filename(fname), m_fmtime(0),
+      m_addr(0), m_size(0)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+	return;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return;
+    }
+    m_fmtime = st.st_mtime;
+    if (st.st_size > 0) {
+	void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+	    close(fd);
+	    return;
+	}
+	m_addr = addr;
+	m_size = st.st_size;
+	parse((const char *)m_addr, m_size);
+    }
+    close(fd);
+    m_ok = true;
+}
+
+ConfMapped::~ConfMapped()
+{
+    if (m_addr)
+	munmap(m_addr, m_size);
+}
+
+ConfMapped::StrRef ConfMapped::own(const string& s)
+{
+    m_owned.push_back(s);
+    return StrRef(m_owned.back().data(), s.size());
+}
+
+// Same logic as ConfSimple::parseinput(), without the comments and
+// ordering data.
+void ConfMapped::parse(const char *data, size_t size)
+{
+    StrRef submapkey;
+    string joined;
+    bool appending = false;
+    const char *end = data + size;
+
+    for (const char *cp = data; cp < end;) {
+	const char *eol = (const char *)memchr(cp, '\n', end - cp);
+	if (eol == 0)
+	    eol = end;
+	const char *lp = cp;
+	size_t len = eol - cp;
+	cp = eol + 1;
+	while (len > 0 && lp[len-1] == '\r')
+	    len--;
+
+	if (appending) {
+	    joined.append(lp, len);
+	    lp = joined.data();
+	    len = joined.size();
+	}
+	trimrange(lp, len);
+	if (len == 0 || lp[0] == '#') {
+	    appending = false;
+	    continue;
+	}
+	if (lp[len-1] == '\\') {
+	    joined.assign(lp, len - 1);
+	    appending = true;
+	    continue;
+	}
+	StrRef line(lp, len);
+	if (appending) {
+	    line = own(string(lp, len));
+	    appending = false;
+	}
+
+	if (line.p[0] == '[') {
+	    trimrange(line.p, line.len, "[]");
+	    if (m_tildexp && line.len > 0 && line.p[0] == '~') {
+		submapkey = own(path_tildexpand(string(line.p, line.len)));
+	    } else {
+		submapkey = line;
+	    }
+	    continue;
+	}
+
+	const char *eq = (const char *)memchr(line.p, '=', line.len);
+	if (eq == 0)
+	    continue;
+	Entry ent;
+	ent.sk = submapkey;
+	ent.nm = StrRef(line.p, eq - line.p);
+	trimrange(ent.nm.p, ent.nm.len);
+	ent.val = StrRef(eq + 1, line.p + line.len - (eq + 1));
+	trimrange(ent.val.p, ent.val.len);
+	if (ent.nm.len == 0)
+	    continue;
+	addEntry(ent);
+    }
+}
+
+int ConfMapped::find(const char *sk, size_t sklen, const char *nm, 
+		     size_t nmlen) const
+{
+    if (m_table.empty())
+	return -1;
+    size_t mask = m_table.size() - 1;
+    for (size_t i = cfhash(sk, sklen, nm, nmlen) & mask;; i = (i + 1) & mask) {
+	unsigned int idx = m_table[i];
+	if (idx == 0)
+	    return -1;
+	const Entry& ent = m_entries[idx - 1];
+	if (ent.nm.equals(nm, nmlen) && ent.sk.equals(sk, sklen))
+	    return idx - 1;
+    }
+}
+
+void ConfMapped::rehash(size_t size)
+{
+    m_table.assign(size, 0);
+    size_t mask = size - 1;
+    for (unsigned int idx = 0; idx < m_entries.size(); idx++) {
+	const Entry& ent = m_entries[idx];
+	size_t i = cfhash(ent.sk.p, ent.sk.len, ent.nm.p, ent.nm.len) & mask;
+	while (m_table[i] != 0)
+	    i = (i + 1) & mask;
+	m_table[i] = idx + 1;
+    }
+}
+
+// Insert or replace (the last value set in the file wins)
+void ConfMapped::addEntry(const Entry& ent)
+{
+    int idx = find(ent.sk.p, ent.sk.len, ent.nm.p, ent.nm.len);
+    if (idx >= 0) {
+	m_entries[idx].val = ent.val;
+	return;
+    }
+    m_entries.push_back(ent);
+    // Keep the load factor under 1/2
+    if (m_entries.size() * 2 > m_table.size()) {
+	rehash(m_table.empty() ? 16 : m_table.size() * 2);
+    } else {
+	size_t mask = m_table.size() - 1;
+	size_t i = cfhash(ent.sk.p, ent.sk.len, ent.nm.p, ent.nm.len) & mask;
+	while (m_table[i] != 0)
+	    i = (i + 1) & mask;
+	m_table[i] = m_entries.size();
+    }
+}
+
+bool ConfMapped::getRef(const string &nm, const char *&value, size_t& len,
+			const string &sk) const
+{
+    int idx = find(sk.data(), sk.size(), nm.data(), nm.size());
+    if (idx < 0)
+	return false;
+    value = m_entries[idx].val.p;
+    len = m_entries[idx].val.len;
+    return true;
+}
+
+int ConfMapped::get(const string &nm, string &value, const string &sk) const
+{
+    const char *cp;
+    size_t len;
+    if (!getRef(nm, cp, len, sk))
+	return 0;
+    value.assign(cp, len);
+    return 1;
+}
+
+bool ConfMapped::hasNameAnywhere(const string& nm) const
+{
+    for (vector<Entry>::const_iterator it = m_entries.begin();
+	 it != m_entries.end(); it++) {
+	if (it->nm.equals(nm.data(), nm.size()))
+	    return true;
+    }
+    return false;
+}
+
+vector<string> ConfMapped::getNames(const string &sk, const char *pattern) 
+    const
+{
+    vector<string> mylist;
+    for (vector<Entry>::const_iterator it = m_entries.begin();
+	 it != m_entries.end(); it++) {
+	if (!it->sk.equals(sk.data(), sk.size()))
+	    continue;
+	string nm(it->nm.p, it->nm.len);
+        if (pattern && 0 != fnmatch(pattern, nm.c_str(), 0))
+            continue;
+	mylist.push_back(nm);
+    }
+    sort(mylist.begin(), mylist.end());
+    return mylist;
+}
+
+vector<string> ConfMapped::getSubKeys() const
+{
+    vector<string> mylist;
+    for (vector<Entry>::const_iterator it = m_entries.begin();
+	 it != m_entries.end(); it++) {
+	mylist.push_back(string(it->sk.p, it->sk.len));
+    }
+    sort(mylist.begin(), mylist.end());
+    mylist.resize(unique(mylist.begin(), mylist.end()) - mylist.begin());
+    return mylist;
+}
+
+bool ConfMapped::sourceChanged() const
+{
+    struct stat st;
+    return stat(m_filename.c_str(), &st) == 0 && m_fmtime != st.st_mtime;
+}
+
 #else // TEST_CONFTREE
 
 #include <stdio.h>
@@ -49,8 +49,12 @@
  * (useful to have central/personal config files)
  */
 
+#include <string.h>
+#include <time.h>
+
 #include <string>
 #include <map>
+#include <list>
 #include <vector>
 #include <algorithm>
 
@@ -333,6 +337,93 @@ public:
     virtual int get(const string &name, string &value, const string &sk) const;
 };
 
+/**
+ * Read-only configuration, for fast loading and lookups in big files.
+ *
+ * The syntax is the same as for ConfSimple. The file is memory-mapped
+ * and parsed once. The names and values point into the mapping (only
+ * continued lines and tilde-expanded subkeys are copied), and are
+ * indexed by an open-addressing hash table on (subkey, name). No
+ * presentation data is kept, and the object can't be modified.
+ */
+class ConfMapped : public ConfNull {
+public:
+    /**
+     * @param fname file to map
+     * @param tildexp  try tilde (home dir) expansion for subkey values
+     */
+    ConfMapped(const char *fname, bool tildexp = false);
+    virtual ~ConfMapped();
+
+    virtual int get(const string &name, string &value, 
+		    const string &sk = string()) const;
+    /** 
+     * Same as get(), without copying the value. The data stays valid
+     * for the life of the object, and is not null-terminated.
+     */
+    bool getRef(const string &name, const char *&value, size_t& len,
+		const string &sk = string()) const;
+    virtual bool hasNameAnywhere(const string& nm) const;
+    virtual vector<string> getNames(const string &sk, const char *pattern = 0)
+	const;
+    virtual vector<string> getSubKeys() const;
+    virtual vector<string> getSubKeys(bool) const 
+    {
+	return getSubKeys();
+    }
+    virtual bool ok() const {return m_ok;}
+    virtual bool sourceChanged() const;
+    virtual string getFilename() const 
+    {return m_filename;}
+
+    // Read-only
+    virtual int set(const string &, const string &, const string & = string())
+    {return 0;}
+    virtual int erase(const string &, const string &) {return 0;}
+    virtual int eraseKey(const string &) {return 0;}
+    virtual bool holdWrites(bool) {return true;}
+
+private:
+    struct StrRef {
+	StrRef() : p(0), len(0) {}
+	StrRef(const char *_p, size_t _len) : p(_p), len(_len) {}
+	bool equals(const char *op, size_t olen) const
+	{
+	    return len == olen && (len == 0 || !memcmp(p, op, len));
+	}
+	const char *p;
+	size_t len;
+    };
+    struct Entry {
+	StrRef sk;
+	StrRef nm;
+	StrRef val;
+    };
+
+    bool                 m_ok;
+    bool                 m_tildexp;
+    string               m_filename;
+    time_t               m_fmtime;
+    void                *m_addr;
+    size_t               m_size;
+    vector<Entry>        m_entries;
+    // Hash table: indexes in m_entries, plus 1. 0 means free. The
+    // size is a power of 2.
+    vector<unsigned int> m_table;
+    // Storage for the strings which are not in the mapping
+    std::list<string>    m_owned;
+
+    void parse(const char *data, size_t size);
+    void addEntry(const Entry& ent);
+    void rehash(size_t size);
+    int find(const char *sk, size_t sklen, const char *nm, size_t nmlen)
+	const;
+    StrRef own(const string& s);
+
+    ConfMapped(const ConfMapped&);
+    ConfMapped& operator=(const ConfMapped&);
+};
+
 /** 
  * Use several config files, trying to get values from each in order. Used to
  * have a central config, with possible overrides from more specific
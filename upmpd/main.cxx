@@ -0,0 +1,638 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+
+////////////////////// upmpdcli main program: configuration and startup
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <memory>
+using namespace std;
+
+#include "libupnpp/upnpplib.hxx"
+#include "libupnpp/device.hxx"
+#include "libupnpp/log.hxx"
+#include "libupnpp/wqstats.hxx"
+#include "libupnpp/trace.hxx"
+#include "libupnpp/metrics.hxx"
+#include "libupnpp/vdir.hxx"
+
+#include "mpdcli.hxx"
+#include "upmpdutils.hxx"
+#include "albumart.hxx"
+#include "conftree.hxx"
+#include "upmpd.hxx"
+
+static const string dfltFriendlyName("UpMpd");
+
+static char *thisprog;
+
+static int op_flags;
+#define OPT_MOINS 0x1
+#define OPT_h	  0x2
+#define OPT_p	  0x4
+#define OPT_d	  0x8
+#define OPT_D     0x10
+#define OPT_c     0x20
+#define OPT_l     0x40
+#define OPT_f     0x80
+static const char usage[] = 
+"-c configfile \t configuration file to use\n"
+"-h host    \t specify host MPD is running on\n"
+"-p port     \t specify MPD port\n"
+"-d logfilename\t debug messages to\n"
+"-l loglevel\t  log level (0-6)\n"
+"-D          \t run as a daemon\n"
+"-f friendlyname\t define device displayed name\n"
+"  \n\n"
+			;
+static void
+Usage(void)
+{
+	fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+	exit(1);
+}
+
+static string myDeviceUUID;
+
+// Renderer definition from the command line or configuration
+struct RendererDef {
+	string section; // Configuration section, empty for the global one
+	string friendlyname;
+	string mpdhost;
+	int mpdport;
+	string musicdir;
+};
+
+// Additional event loop threads
+static void *evloopthread(void *)
+{
+	UpnpDevice::eventloop();
+	return 0;
+}
+
+// Dump the work queue statistics to the log when we get SIGUSR1. The
+// signal is blocked in all the other threads.
+static void *sigthread(void *)
+{
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	for (;;) {
+		int sig;
+		if (sigwait(&sigs, &sig))
+			continue;
+		ostringstream out;
+		WQRegistry::dumpAll(out);
+		DEBOUT << "Work queue statistics:" << endl << out.str();
+	}
+	return 0;
+}
+
+// Extract the device element from a (substituted) description
+// template, for inclusion in the root description deviceList. The
+// control and event URLs must be unique inside the root description,
+// so we give them a per-renderer prefix.
+static string embeddedDescription(const string& description, int idx)
+{
+	string::size_type pos1 = description.find("<device>");
+	string::size_type pos2 = description.rfind("</device>");
+	if (pos1 == string::npos || pos2 == string::npos || pos2 < pos1) {
+		LOGERR("embeddedDescription: bad description template" << endl);
+		return string();
+	}
+	string device = description.substr(pos1, pos2 + 9 - pos1);
+
+	char prefix[30];
+	sprintf(prefix, "/%d/", idx);
+	const char *urls[] = {"ctl/RenderingControl", "ctl/AVTransport",
+						  "evt/RenderingControl", "evt/AVTransport"};
+	for (unsigned int i = 0; i < sizeof(urls) / sizeof(urls[0]); i++) {
+		if (device.find(urls[i]) == string::npos)
+			continue;
+		device = regsub1(string("/") + urls[i], device, 
+						 string(prefix) + urls[i]);
+	}
+	return device;
+}
+
+// Compute the renderer definitions and the other values which can be
+// changed while running, from the configuration. cmddef holds the
+// values from the command line and environment: those set on the
+// command line have priority over the configuration. loglevel and
+// evintervalms are only changed if set in the configuration.
+static void readConfig(const ConfNull& config, const RendererDef& cmddef,
+					   int& loglevel, int& evintervalms,
+					   vector<RendererDef>& renderers)
+{
+	string value;
+	RendererDef global(cmddef);
+	if (!(op_flags & OPT_f))
+		config.get("friendlyname", global.friendlyname);
+	if (!(op_flags & OPT_l) && config.get("loglevel", value))
+		loglevel = atoi(value.c_str());
+	if (!(op_flags & OPT_h))
+		config.get("mpdhost", global.mpdhost);
+	if (!(op_flags & OPT_p) && config.get("mpdport", value)) {
+		global.mpdport = atoi(value.c_str());
+	}
+	config.get("musicdir", global.musicdir);
+	if (config.get("eventintervalms", value))
+		evintervalms = atoi(value.c_str());
+
+	// Each subsection defines a renderer. The section name is
+	// the default friendly name, and the MPD host and port
+	// default to the global values.
+	renderers.clear();
+	vector<string> sections = config.getSubKeys();
+	for (vector<string>::const_iterator it = sections.begin();
+		 it != sections.end(); it++) {
+		// The global space has an empty subkey
+		if (it->empty())
+			continue;
+		RendererDef def;
+		def.section = *it;
+		if (!config.get("friendlyname", def.friendlyname, *it))
+			def.friendlyname = *it;
+		if (!config.get("mpdhost", def.mpdhost, *it))
+			def.mpdhost = global.mpdhost;
+		def.mpdport = global.mpdport;
+		if (config.get("mpdport", value, *it))
+			def.mpdport = atoi(value.c_str());
+		if (!config.get("musicdir", def.musicdir, *it))
+			def.musicdir = global.musicdir;
+		renderers.push_back(def);
+	}
+	if (renderers.empty())
+		renderers.push_back(global);
+}
+
+// A parsed configuration file and the values computed from it. This
+// is never modified once built: a reload builds a new one and swaps
+// it in.
+struct ConfigSnapshot {
+	shared_ptr<const ConfMapped> conf;
+	int loglevel;
+	int evintervalms;
+	vector<RendererDef> renderers;
+};
+
+// What we need to apply a configuration change while running.
+struct LiveConfig {
+	string filename;
+	RendererDef cmddef;
+	int cmdloglevel;
+	// The renderers' configuration sections and MPD clients, in
+	// startup order
+	vector<string> sections;
+	vector<MPDCli*> mpdclis;
+	PTMutexInit lock;
+	shared_ptr<const ConfigSnapshot> current; // Under lock
+};
+static LiveConfig liveconfig;
+
+static shared_ptr<const ConfigSnapshot> currentConfig()
+{
+	PTMutexLocker lock(liveconfig.lock);
+	return liveconfig.current;
+}
+
+// Index of the renderer for a configuration section, or -1
+static int findSection(const vector<RendererDef>& renderers,
+					   const string& section)
+{
+	for (unsigned int i = 0; i < renderers.size(); i++) {
+		if (renderers[i].section == section)
+			return int(i);
+	}
+	return -1;
+}
+
+// Reparse the configuration file and apply the changes. The log level,
+// event interval and MPD addresses are changed at once. The friendly
+// names and the renderer set are part of the device description
+// registered with libupnp, which can't be changed without
+// re-registering the devices (sending byebyes and dropping the
+// subscriptions), so these need a restart.
+static void reloadConfig()
+{
+	shared_ptr<ConfigSnapshot> snap(new ConfigSnapshot);
+	snap->conf = shared_ptr<const ConfMapped>(
+		new ConfMapped(liveconfig.filename.c_str(), true));
+	if (!snap->conf->ok()) {
+		LOGERR("Could not reread config: " << liveconfig.filename << endl);
+		return;
+	}
+	snap->loglevel = liveconfig.cmdloglevel;
+	snap->evintervalms = 1000;
+	readConfig(*snap->conf, liveconfig.cmddef, snap->loglevel,
+			   snap->evintervalms, snap->renderers);
+	LOGINF("Configuration changed, applying" << endl);
+
+	shared_ptr<const ConfigSnapshot> old = currentConfig();
+	upnppdebug::Logger::getTheLog("")->setLogLevel(
+		upnppdebug::Logger::LogLevel(snap->loglevel));
+	UpnpDevice::setEventInterval(snap->evintervalms);
+
+	// The renderers are matched by section name: the positions
+	// change when sections are added or removed.
+	const vector<RendererDef>& renderers = snap->renderers;
+	for (unsigned int i = 0; i < old->renderers.size(); i++) {
+		if (findSection(renderers, old->renderers[i].section) < 0) {
+			LOGERR("Renderer " << old->renderers[i].friendlyname << 
+				   " removed: restart needed" << endl);
+		}
+	}
+	for (unsigned int i = 0; i < renderers.size(); i++) {
+		int oi = findSection(old->renderers, renderers[i].section);
+		int ci = -1;
+		for (unsigned int j = 0; j < liveconfig.sections.size(); j++) {
+			if (liveconfig.sections[j] == renderers[i].section)
+				ci = int(j);
+		}
+		if (oi < 0 || ci < 0) {
+			LOGERR("Renderer " << renderers[i].friendlyname << 
+				   " added: restart needed" << endl);
+			continue;
+		}
+		const RendererDef& prev = old->renderers[oi];
+		if (renderers[i].friendlyname != prev.friendlyname ||
+			renderers[i].musicdir != prev.musicdir) {
+			LOGERR("Renderer " << prev.friendlyname << 
+				   ": friendly name or music directory changed: restart "
+				   "needed" << endl);
+		}
+		if (renderers[i].mpdhost != prev.mpdhost ||
+			renderers[i].mpdport != prev.mpdport) {
+			liveconfig.mpdclis[ci]->setServer(renderers[i].mpdhost,
+											  renderers[i].mpdport);
+		}
+	}
+
+	PTMutexLocker lock(liveconfig.lock);
+	liveconfig.current = snap;
+}
+
+// Watch the configuration file and reload it when it changes. We
+// watch the directory because editors often replace the file.
+static void *configwatcher(void *)
+{
+	string dir(".");
+	string name(liveconfig.filename);
+	string::size_type slash = name.rfind('/');
+	if (slash != string::npos) {
+		dir = slash == 0 ? string("/") : name.substr(0, slash);
+		name = name.substr(slash + 1);
+	}
+	int fd = inotify_init();
+	if (fd < 0 || 
+		inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		LOGERR("configwatcher: can't watch " << dir << " errno " << 
+			   errno << endl);
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	for (;;) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			LOGERR("configwatcher: read failed, errno " << errno << endl);
+			break;
+		}
+		bool changed = false;
+		for (char *cp = buf; cp < buf + len;) {
+			struct inotify_event *ev = (struct inotify_event *)cp;
+			if (ev->len > 0 && name == ev->name)
+				changed = true;
+			cp += sizeof(struct inotify_event) + ev->len;
+		}
+		if (!changed)
+			continue;
+		// Let a burst of writes complete, and only reload once.
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		while (poll(&pfd, 1, 200) > 0) {
+			if (read(fd, buf, sizeof(buf)) <= 0)
+				break;
+		}
+		reloadConfig();
+	}
+	close(fd);
+	return 0;
+}
+
+static string datadir(DATADIR "/");
+static string configdir(CONFIGDIR "/");
+
+int main(int argc, char *argv[])
+{
+	string mpdhost("localhost");
+	int mpdport = 6600;
+//	string upnplogfilename("/tmp/upmpd_libupnp.log");
+	string logfilename;
+	int loglevel(upnppdebug::Logger::LLINF);
+	string configfile;
+	string friendlyname(dfltFriendlyName);
+	string tracefilename;
+	string musicdir;
+
+	// Block SIGUSR1 before any thread is created (the log writer and
+	// trace flusher are started on first use), so that it is only
+	// seen by the statistics thread. The mask survives daemon().
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigs, 0);
+
+	const char *cp;
+	if ((cp = getenv("UPMPD_HOST")))
+		mpdhost = cp;
+	if ((cp = getenv("UPMPD_PORT")))
+		mpdport = atoi(cp);
+	if ((cp = getenv("UPMPD_FRIENDLYNAME")))
+		friendlyname = atoi(cp);
+	if ((cp = getenv("UPMPD_CONFIG")))
+		configfile = cp;
+
+	thisprog = argv[0];
+	argc--; argv++;
+	while (argc > 0 && **argv == '-') {
+		(*argv)++;
+		if (!(**argv))
+			Usage();
+		while (**argv)
+			switch (*(*argv)++) {
+			case 'D':	op_flags |= OPT_D; break;
+			case 'c':	op_flags |= OPT_c; if (argc < 2)  Usage();
+				configfile = *(++argv); argc--; goto b1;
+			case 'f':	op_flags |= OPT_f; if (argc < 2)  Usage();
+				friendlyname = *(++argv); argc--; goto b1;
+			case 'd':	op_flags |= OPT_d; if (argc < 2)  Usage();
+				logfilename = *(++argv); argc--; goto b1;
+			case 'h':	op_flags |= OPT_h; if (argc < 2)  Usage();
+				mpdhost = *(++argv); argc--; goto b1;
+			case 'l':	op_flags |= OPT_l; if (argc < 2)  Usage();
+				loglevel = atoi(*(++argv)); argc--; goto b1;
+			case 'p':	op_flags |= OPT_p; if (argc < 2)  Usage();
+				mpdport = atoi(*(++argv)); argc--; goto b1;
+			default: Usage();	break;
+			}
+	b1: argc--; argv++;
+	}
+
+	if (argc != 0)
+		Usage();
+
+	// The renderers to run. There is a single one, defined by the
+	// global parameters, unless the configuration has subsections.
+	RendererDef cmddef;
+	cmddef.friendlyname = friendlyname;
+	cmddef.mpdhost = mpdhost;
+	cmddef.mpdport = mpdport;
+	cmddef.musicdir = musicdir;
+	int cmdloglevel = loglevel;
+	int evintervalms = 0;
+	vector<RendererDef> renderers(1, cmddef);
+
+	shared_ptr<const ConfMapped> config;
+	if (!configfile.empty()) {
+		config = shared_ptr<const ConfMapped>(
+			new ConfMapped(configfile.c_str(), true));
+		if (!config->ok()) {
+			cerr << "Could not open config: " << configfile << endl;
+			return 1;
+		}
+		if (!(op_flags & OPT_d))
+			config->get("logfilename", logfilename);
+		config->get("tracefilename", tracefilename);
+		readConfig(*config, cmddef, loglevel, evintervalms, renderers);
+	}
+
+	if (upnppdebug::Logger::getTheLog(logfilename) == 0) {
+		cerr << "Can't initialize log" << endl;
+		return 1;
+	}
+	upnppdebug::Logger::getTheLog("")->setLogLevel(upnppdebug::Logger::LogLevel(loglevel));
+
+	if ((op_flags & OPT_D)) {
+		if (daemon(1, 0)) {
+			LOGFAT("Daemon failed: errno " << errno << endl);
+			return 1;
+		}
+	}
+
+	// The trace flusher thread must be started after the fork
+	if (!tracefilename.empty() && !Trace::open(tracefilename)) {
+		LOGERR("Can't open trace file " << tracefilename << endl);
+	}
+
+	pthread_t sigthr;
+	if (pthread_create(&sigthr, 0, sigthread, 0)) {
+		LOGERR("Can't create signal handling thread" << endl);
+	} else {
+		pthread_detach(sigthr);
+	}
+
+	// Initialize libupnpp, and check health
+	LibUPnP *mylib = LibUPnP::getLibUPnP(true);
+	if (!mylib) {
+		LOGFAT("Can't get LibUPnP" << endl);
+		return 1;
+	}
+	if (!mylib->ok()) {
+		LOGFAT("Lib init failed: " <<
+			   mylib->errAsString("main", mylib->getInitError()) << endl);
+		return 1;
+	}
+	// mylib->setLogFileName(upnplogfilename, LibUPnP::LogLevelDebug);
+
+	// Read our XML data.
+	string reason;
+
+	string description;
+	string filename = datadir + "description.xml";
+	if (!file_to_string(filename, description, &reason)) {
+		LOGFAT("Failed reading " << filename << " : " << reason << endl);
+		return 1;
+	}
+
+	string rdc_scdp;
+	filename = datadir + "RenderingControl.xml";
+	if (!file_to_string(filename, rdc_scdp, &reason)) {
+		LOGFAT("Failed reading " << filename << " : " << reason << endl);
+		return 1;
+	}
+
+	string avt_scdp;
+	filename = datadir + "AVTransport.xml";
+	if (!file_to_string(filename, avt_scdp, &reason)) {
+		LOGFAT("Failed reading " << filename << " : " << reason << endl);
+		return 1;
+	}
+
+	// Initialize the MPD client modules, and compute the device
+	// descriptions. The first renderer is the root device, the
+	// others are embedded inside its description.
+	vector<MPDCli*> mpdclis;
+	vector<string> uuids;
+	vector<string> descriptions;
+	for (vector<RendererDef>::const_iterator it = renderers.begin();
+		 it != renderers.end(); it++) {
+		MPDCli *mpdcli = new MPDCli(it->mpdhost, it->mpdport);
+		if (!mpdcli->ok()) {
+			LOGFAT("MPD connection failed for " << it->friendlyname << 
+				   " (" << it->mpdhost << ":" << it->mpdport << ")" << endl);
+			return 1;
+		}
+		mpdclis.push_back(mpdcli);
+
+		// Create unique ID
+		string UUID = LibUPnP::makeDevUUID(it->friendlyname);
+		for (vector<string>::const_iterator uit = uuids.begin();
+			 uit != uuids.end(); uit++) {
+			if (!uit->compare(string("uuid:") + UUID)) {
+				LOGFAT("Duplicate friendly name: " << it->friendlyname <<endl);
+				return 1;
+			}
+		}
+		uuids.push_back(string("uuid:") + UUID);
+
+		// Update device description with UUID and friendlyname
+		string desc = regsub1("@UUID@", description, UUID);
+		desc = regsub1("@FRIENDLYNAME@", desc, it->friendlyname);
+		if (it != renderers.begin())
+			desc = embeddedDescription(desc, it - renderers.begin());
+		descriptions.push_back(desc);
+	}
+
+	// Insert the embedded devices in the root description.
+	if (descriptions.size() > 1) {
+		string devlist("<deviceList>\n");
+		for (unsigned int i = 1; i < descriptions.size(); i++) {
+			devlist += descriptions[i];
+			devlist += "\n";
+		}
+		devlist += "</deviceList>\n";
+		string::size_type pos = descriptions[0].rfind("</device>");
+		if (pos == string::npos) {
+			LOGFAT("Bad description template: no </device>" << endl);
+			return 1;
+		}
+		descriptions[0].insert(pos, devlist);
+	}
+
+	// Initialize the UPnP device objects. The embedded devices must
+	// exist before the root device registers the description with
+	// the library.
+	vector<UpMpd*> devices(renderers.size());
+	for (unsigned int i = renderers.size(); i-- > 0;) {
+		// List the XML files to be served through http (all will
+		// live in '/'). These are common to all the devices, and
+		// set by the root one.
+		unordered_map<string, string> xmlfiles;
+		if (i == 0) {
+			xmlfiles["description.xml"] = descriptions[0];
+			xmlfiles["RenderingControl.xml"] = rdc_scdp;
+			xmlfiles["AVTransport.xml"] = avt_scdp;
+		}
+		// Cover art for the songs from the music directory
+		AlbumArt *art = 0;
+		if (!renderers[i].musicdir.empty()) {
+			char path[30];
+			sprintf(path, "/art/r%u/", i);
+			art = new AlbumArt(renderers[i].musicdir, path);
+		}
+		devices[i] = new UpMpd(uuids[i], xmlfiles, mpdclis[i], art);
+	}
+
+	// With several renderers, run the event loop in a few threads,
+	// so that a slow MPD does not delay the events for the others.
+	unsigned int nevthreads = renderers.size() < 4 ? renderers.size() : 4;
+	for (unsigned int i = 1; i < nevthreads; i++) {
+		pthread_t thr;
+		if (pthread_create(&thr, 0, evloopthread, 0)) {
+			LOGERR("Can't create event loop thread" << endl);
+			break;
+		}
+		pthread_detach(thr);
+	}
+
+	// Publish the metrics document at /metrics through the libupnp
+	// web server. It is produced on request, at most once per second.
+	VirtualDir *vdir = VirtualDir::getVirtualDir();
+	if (vdir) {
+		vdir->addGenerator("/", "metrics", Metrics::render,
+						   "text/plain; version=0.0.4", 1);
+		// All the files are in: the web server lookups need no lock
+		vdir->freeze();
+	}
+
+	if (evintervalms > 0)
+		UpnpDevice::setEventInterval(evintervalms);
+
+	// Apply the configuration changes while running
+	if (config) {
+		liveconfig.filename = configfile;
+		liveconfig.cmddef = cmddef;
+		liveconfig.cmdloglevel = cmdloglevel;
+		liveconfig.mpdclis = mpdclis;
+		for (unsigned int i = 0; i < renderers.size(); i++)
+			liveconfig.sections.push_back(renderers[i].section);
+		shared_ptr<ConfigSnapshot> snap(new ConfigSnapshot);
+		snap->conf = config;
+		snap->loglevel = loglevel;
+		snap->evintervalms = evintervalms;
+		snap->renderers = renderers;
+		liveconfig.current = snap;
+		pthread_t watchthr;
+		if (pthread_create(&watchthr, 0, configwatcher, 0)) {
+			LOGERR("Can't create configuration watcher thread" << endl);
+		} else {
+			pthread_detach(watchthr);
+		}
+	}
+
+	LOGDEB("Entering event loop" << endl);
+
+	// And forever generate state change events for all devices.
+	UpnpDevice::eventloop();
+
+	return 0;
+}
+
+/* Local Variables: */
+/* mode: c++ */
+/* c-basic-offset: 4 */
+/* tab-width: 4 */
+/* indent-tabs-mode: t */
+/* End: */
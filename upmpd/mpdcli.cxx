@@ -28,15 +28,24 @@
 #include <mpd/queue.h>
 
 #include "libupnpp/log.hxx"
+#include "libupnpp/trace.hxx"
+#include "libupnpp/metrics.hxx"
 #include "mpdcli.hxx"
 
 using namespace std;
 
 #define M_CONN ((struct mpd_connection *)m_conn)
 
+static MetricHisto *mpdcmdhisto = 
+    Metrics::histogram("mpd_command_duration_seconds", 
+                       "MPD command round trip time");
+static MetricCounter *mpdreconnects = 
+    Metrics::counter("mpd_reconnects_total", "MPD connection reopenings");
+
 MPDCli::MPDCli(const string& host, int port, const string& pass)
     : m_conn(0), m_premutevolume(0), m_cachedvolume(50),
-      m_host(host), m_port(port), m_password(pass)
+      m_host(host), m_port(port), m_password(pass), m_newport(0),
+      m_newserver(false)
 {
     if (!openconn()) {
         return;
@@ -56,6 +65,7 @@ bool MPDCli::openconn()
     if (m_conn) {
         mpd_connection_free(M_CONN);
         m_conn = 0;
+        mpdreconnects->inc();
     }
     m_conn = mpd_connection_new(m_host.c_str(), m_port, 0);
     if (m_conn == NULL) {
@@ -78,6 +88,14 @@ bool MPDCli::openconn()
     return true;
 }
 
+void MPDCli::setServer(const string& host, int port)
+{
+    PTMutexLocker lock(m_newservlock);
+    m_newhost = host;
+    m_newport = port;
+    m_newserver = true;
+}
+
 bool MPDCli::showError(const string& who)
 {
     if (!ok()) {
@@ -104,6 +122,8 @@ bool MPDCli::showError(const string& who)
 }
 
 #define RETRY_CMD(CMD) {                                \
+    TRACE_SPAN(mpdspan, Trace::MPD, #CMD);              \
+    MetricTimer mpdtimer(mpdcmdhisto);                  \
     for (int i = 0; i < 2; i++) {                       \
         if ((CMD))                                      \
             break;                                      \
@@ -114,13 +134,28 @@ bool MPDCli::showError(const string& who)
 
 bool MPDCli::updStatus()
 {
+    if (m_newserver) {
+        {
+            PTMutexLocker lock(m_newservlock);
+            m_host = m_newhost;
+            m_port = m_newport;
+            m_newserver = false;
+        }
+        LOGINF("MPDCli: switching to " << m_host << ":" << m_port << endl);
+        openconn();
+    }
+
     if (!ok()) {
         LOGERR("MPDCli::updStatus: bad state" << endl);
         return false;
     }
 
+    TRACE_SPAN(mpdspan, Trace::MPD, "mpd_run_status");
+    long long start = Metrics::now();
     mpd_status *mpds = 0;
     mpds = mpd_run_status(M_CONN);
+    mpdcmdhisto->observe(Metrics::now() - start);
+    mpdspan.end();
     if (mpds == 0) {
         openconn();
         mpds = mpd_run_status(M_CONN);
@@ -359,7 +394,9 @@ int MPDCli::insert(const string& uri, int pos)
     if (!updStatus())
         return -1;
 
+    TRACE_SPAN(mpdspan, Trace::MPD, "mpd_run_add_id_to");
     int id = mpd_run_add_id_to(M_CONN, uri.c_str(), (unsigned)pos);
+    mpdspan.end();
 
     if (id < 0) {
         showError("MPDCli::run_add_id");
@@ -382,7 +419,9 @@ bool MPDCli::statId(int id)
     if (!ok())
         return -1;
 
+    TRACE_SPAN(mpdspan, Trace::MPD, "mpd_run_get_queue_song_id");
     mpd_song *song = mpd_run_get_queue_song_id(M_CONN, (unsigned)id);
+    mpdspan.end();
     if (song) {
         mpd_song_free(song);
         return true;
@@ -19,8 +19,11 @@
 
 #include <unordered_map>
 #include <string>
+#include <atomic>
 #include <map>
 
+#include "libupnpp/ptmutex.hxx"
+
 struct MpdStatus {
     enum State {MPDS_UNK, MPDS_STOP, MPDS_PLAY, MPDS_PAUSE};
     int volume;
@@ -72,6 +75,13 @@ public:
         updStatus();
         return m_stat;
     }
+    /** Switch to another MPD. This can be called from any thread: the
+     * new connection is opened by the next status update. The switch
+     * itself is not locked against the other commands: it is only
+     * safe because all the calls to an MPDCli (status polls from the
+     * event loop and SOAP actions) are serialized by the lock of the
+     * owning UpnpDevice */
+    void setServer(const std::string& host, int port);
 
 private:
     void *m_conn;
@@ -85,6 +95,11 @@ private:
     std::string m_host;
     int m_port;
     std::string m_password;
+    // New server address from setServer()
+    PTMutexInit m_newservlock;
+    std::string m_newhost;
+    int m_newport;
+    std::atomic<bool> m_newserver;
 
     bool openconn();
     bool updStatus();
@@ -21,7 +21,6 @@
 
 #include <string>
 #include <iostream>
-#include <sstream>
 #include <vector>
 #include <functional>
 #include <set>
@@ -35,76 +34,18 @@ using namespace std::placeholders;
 
 #include "mpdcli.hxx"
 #include "upmpdutils.hxx"
+#include "albumart.hxx"
 
-static const string dfltFriendlyName("UpMpd");
-
-// The UPnP MPD frontend device with its 2 services
-class UpMpd : public UpnpDevice {
-public:
-	UpMpd(const string& deviceid, const unordered_map<string, string>& xmlfiles,
-		  MPDCli *mpdcli);
-
-	// RenderingControl
-	int setMute(const SoapArgs& sc, SoapData& data);
-	int getMute(const SoapArgs& sc, SoapData& data);
-	int setVolume(const SoapArgs& sc, SoapData& data, bool isDb);
-	int getVolume(const SoapArgs& sc, SoapData& data, bool isDb);
-	int listPresets(const SoapArgs& sc, SoapData& data);
-	int selectPreset(const SoapArgs& sc, SoapData& data);
-//	int getVolumeDBRange(const SoapArgs& sc, SoapData& data);
-    virtual bool getEventDataRendering(bool all, 
-									   std::vector<std::string>& names, 
-									   std::vector<std::string>& values);
-
-	// AVTransport
-	int setAVTransportURI(const SoapArgs& sc, SoapData& data, bool setnext);
-	int getPositionInfo(const SoapArgs& sc, SoapData& data);
-	int getTransportInfo(const SoapArgs& sc, SoapData& data);
-	int getMediaInfo(const SoapArgs& sc, SoapData& data);
-	int getDeviceCapabilities(const SoapArgs& sc, SoapData& data);
-	int setPlayMode(const SoapArgs& sc, SoapData& data);
-	int getTransportSettings(const SoapArgs& sc, SoapData& data);
-	int getCurrentTransportActions(const SoapArgs& sc, SoapData& data);
-	int playcontrol(const SoapArgs& sc, SoapData& data, int what);
-	int seek(const SoapArgs& sc, SoapData& data);
-	int seqcontrol(const SoapArgs& sc, SoapData& data, int what);
-    virtual bool getEventDataTransport(bool all, 
-									   std::vector<std::string>& names, 
-									   std::vector<std::string>& values);
-
-	// Re-implemented from the base class and shared by both services
-    virtual bool getEventData(bool all, const string& serviceid, 
-							  std::vector<std::string>& names, 
-							  std::vector<std::string>& values);
-
-private:
-	MPDCli *m_mpdcli;
-
-	// State variable storage
-	unordered_map<string, string> m_rdstate;
-	unordered_map<string, string> m_tpstate;
-
-	// Translate MPD state to Renderer state variables.
-	bool rdstateMToU(unordered_map<string, string>& state);
-	// Translate MPD state to AVTransport state variables.
-	bool tpstateMToU(unordered_map<string, string>& state);
-
-	// My track identifiers (for cleaning up)
-	set<int> m_songids;
-
-	// Desired volume target. We may delay executing small volume
-	// changes to avoid saturating with small requests.
-	int m_desiredvolume;
-
-};
+#include "upmpd.hxx"
 
 static const string serviceIdRender("urn:upnp-org:serviceId:RenderingControl");
 static const string serviceIdTransport("urn:upnp-org:serviceId:AVTransport");
 
 UpMpd::UpMpd(const string& deviceid, 
 			 const unordered_map<string, string>& xmlfiles,
-			 MPDCli *mpdcli)
-	: UpnpDevice(deviceid, xmlfiles), m_mpdcli(mpdcli), m_desiredvolume(-1)
+			 MPDCli *mpdcli, AlbumArt *art)
+	: UpnpDevice(deviceid, xmlfiles), m_mpdcli(mpdcli), m_art(art),
+	  m_desiredvolume(-1)
 {
 	addServiceType(serviceIdRender,
 				   "urn:schemas-upnp-org:service:RenderingControl:1");
@@ -195,20 +136,49 @@ UpMpd::UpMpd(const string& deviceid,
 // methods after changing state, which would really act only if the
 // interval with the previous event is long enough. But things seem to
 // work ok with the systematic delay.
-bool UpMpd::getEventData(bool all, const string& serviceid, 
-						 std::vector<std::string>& names, 
-						 std::vector<std::string>& values)
+bool UpMpd::getEventData(bool all, const string& serviceid, EventBuf& buf)
 {
 	if (!serviceid.compare(serviceIdRender)) {
-		return getEventDataRendering(all, names, values);
+		return getEventDataRendering(all, buf);
 	} else if (!serviceid.compare(serviceIdTransport)) {
-		return getEventDataTransport(all, names, values);
+		return getEventDataTransport(all, buf);
 	} else {
 		LOGERR("UpMpd::getEventData: servid? [" << serviceid << "]" << endl);
 		return UPNP_E_INVALID_PARAM;
 	}
 }
 
+// The library only calls the EventBuf version above, which builds
+// the escaped values directly.
+bool UpMpd::getEventData(bool, const string&, vector<string>&,
+						 vector<string>&)
+{
+	LOGERR("UpMpd::getEventData: vector interface not supported" << endl);
+	return false;
+}
+
+// The LastChange value is an XML document which is itself the value
+// of an XML element in the event message. We build it directly in
+// its escaped form, which means that the variable values are escaped
+// twice.
+static const char lastchangehead[] = 
+	"&lt;Event "
+	"xmlns=&quot;urn:schemas-upnp-org:metadata-1-0/AVT_RCS&quot;&gt;\n"
+	"&lt;InstanceID val=&quot;0&quot;&gt;\n";
+static const char lastchangetail[] = "&lt;/InstanceID&gt;\n&lt;/Event&gt;\n";
+
+static void lastchangeadd(string& out, const string& nm, const string& value)
+{
+	out += "&lt;";
+	out += nm;
+	out += " val=&quot;";
+	xmlquote_append(out, value, true);
+	out += "&quot;/&gt;\n";
+}
+
+// Used as previous state when all variables must be sent
+static const unordered_map<string, string> nostate;
+
 ////////////////////////////////////////////////////
 /// RenderingControl methods
 
@@ -243,8 +213,7 @@ bool UpMpd::rdstateMToU(unordered_map<string, string>& status)
 	return true;
 }
 
-bool UpMpd::getEventDataRendering(bool all, std::vector<std::string>& names, 
-								  std::vector<std::string>& values)
+bool UpMpd::getEventDataRendering(bool all, EventBuf& buf)
 {
 	//LOGDEB("UpMpd::getEventDataRendering. desiredvolume " << 
 	//		   m_desiredvolume << (all?" all " : "") << endl);
@@ -253,41 +222,30 @@ bool UpMpd::getEventDataRendering(bool all, std::vector<std::string>& names,
 		m_desiredvolume = -1;
 	}
 
-	unordered_map<string, string> newstate;
-	rdstateMToU(newstate);
-	if (all)
-		m_rdstate.clear();
+	rdstateMToU(m_rdnewstate);
+	const unordered_map<string, string>& oldstate = all ? nostate : m_rdstate;
 
-	string 
-		chgdata("<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT_RCS\">\n"
-				"<InstanceID val=\"0\">\n");
+	string *chgdata = 0;
+	for (unordered_map<string, string>::const_iterator it = 
+			 m_rdnewstate.begin(); it != m_rdnewstate.end(); it++) {
 
-	bool changefound = false;
-	for (unordered_map<string, string>::const_iterator it = newstate.begin();
-		 it != newstate.end(); it++) {
-
-		const string& oldvalue = mapget(m_rdstate, it->first);
+		const string& oldvalue = mapget(oldstate, it->first);
 		if (!it->second.compare(oldvalue))
 			continue;
 
-		changefound = true;
-
-		chgdata += "<";
-		chgdata += it->first;
-		chgdata += " val=\"";
-		chgdata += xmlquote(it->second);
-		chgdata += "\"/>\n";
+		if (chgdata == 0) {
+			chgdata = &buf.add("LastChange");
+			chgdata->append(lastchangehead);
+		}
+		lastchangeadd(*chgdata, it->first, it->second);
 	}
-	chgdata += "</InstanceID>\n</Event>\n";
 
-	if (!changefound) {
+	if (chgdata == 0) {
 		return true;
 	}
+	chgdata->append(lastchangetail);
 
-	names.push_back("LastChange");
-	values.push_back(chgdata);
-
-	m_rdstate = newstate;
+	m_rdstate.swap(m_rdnewstate);
 
 	return true;
 }
@@ -501,6 +459,16 @@ static string mpdsToPlaymode(const struct MpdStatus& mpds)
 //
 // To be all bundled inside:    LastChange
 
+string UpMpd::didl(const MpdStatus& mpds, bool next)
+{
+	string arturi;
+	if (m_art) {
+		arturi = m_art->uriFor(mapget(next ? mpds.nextsong : mpds.currentsong,
+									  "uri"));
+	}
+	return didlmake(mpds, next, arturi);
+}
+
 // Translate MPD state to UPnP AVTRansport state variables
 bool UpMpd::tpstateMToU(unordered_map<string, string>& status)
 {
@@ -532,7 +500,7 @@ bool UpMpd::tpstateMToU(unordered_map<string, string>& status)
 	const string& uri = mapget(mpds.currentsong, "uri");
 	status["CurrentTrack"] = "1";
 	status["CurrentTrackURI"] = uri;
-	status["CurrentTrackMetaData"] = is_song?didlmake(mpds) : "";
+	status["CurrentTrackMetaData"] = is_song?didl(mpds) : "";
 	string playmedium("NONE");
 	if (is_song)
 		playmedium = uri.find("http://") == 0 ?	"HDD" : "NETWORK";
@@ -542,14 +510,14 @@ bool UpMpd::tpstateMToU(unordered_map<string, string>& status)
 	status["CurrentTrackDuration"] = is_song?
 		upnpduration(mpds.songlenms):"00:00:00";
 	status["AVTransportURI"] = uri;
-	status["AVTransportURIMetaData"] = is_song?didlmake(mpds) : "";
+	status["AVTransportURIMetaData"] = is_song?didl(mpds) : "";
 	status["RelativeTimePosition"] = is_song?
 		upnpduration(mpds.songelapsedms):"0:00:00";
 	status["AbsoluteTimePosition"] = is_song?
 		upnpduration(mpds.songelapsedms) : "0:00:00";
 
 	status["NextAVTransportURI"] = mapget(mpds.nextsong, "uri");
-	status["NextAVTransportURIMetaData"] = is_song?didlmake(mpds, true) : "";
+	status["NextAVTransportURIMetaData"] = is_song?didl(mpds, true) : "";
 
 	status["PlaybackStorageMedium"] = playmedium;
 	status["PossiblePlaybackStorageMedium"] = "HDD,NETWORK";
@@ -565,23 +533,19 @@ bool UpMpd::tpstateMToU(unordered_map<string, string>& status)
 	return true;
 }
 
-bool UpMpd::getEventDataTransport(bool all, std::vector<std::string>& names, 
-								  std::vector<std::string>& values)
+bool UpMpd::getEventDataTransport(bool all, EventBuf& buf)
 {
-	unordered_map<string, string> newtpstate;
-	tpstateMToU(newtpstate);
-	if (all)
-		m_tpstate.clear();
+	tpstateMToU(m_tpnewstate);
+	const unordered_map<string, string>& oldstate = all ? nostate : m_tpstate;
 
 	bool changefound = false;
 
-	string 
-		chgdata("<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT_RCS\">\n"
-				"<InstanceID val=\"0\">\n");
-	for (unordered_map<string, string>::const_iterator it = newtpstate.begin();
-		 it != newtpstate.end(); it++) {
+	string& chgdata = buf.add("LastChange");
+	chgdata.append(lastchangehead);
+	for (unordered_map<string, string>::const_iterator it = 
+			 m_tpnewstate.begin(); it != m_tpnewstate.end(); it++) {
 
-		const string& oldvalue = mapget(m_tpstate, it->first);
+		const string& oldvalue = mapget(oldstate, it->first);
 		if (!it->second.compare(oldvalue))
 			continue;
 
@@ -592,23 +556,17 @@ bool UpMpd::getEventDataTransport(bool all, std::vector<std::string>& names,
 			changefound = true;
 		}
 
-		chgdata += "<";
-		chgdata += it->first;
-		chgdata += " val=\"";
-		chgdata += xmlquote(it->second);
-		chgdata += "\"/>\n";
+		lastchangeadd(chgdata, it->first, it->second);
 	}
-	chgdata += "</InstanceID>\n</Event>\n";
+	chgdata.append(lastchangetail);
 
 	if (!changefound) {
 		// DEBOUT << "UpMpd::getEventDataTransport: no updates" << endl;
+		buf.clear();
 		return true;
 	}
 
-	names.push_back("LastChange");
-	values.push_back(chgdata);
-
-	m_tpstate = newtpstate;
+	m_tpstate.swap(m_tpnewstate);
 	// DEBOUT << "UpMpd::getEventDataTransport: " << chgdata << endl;
 	return true;
 }
@@ -709,7 +667,7 @@ int UpMpd::getPositionInfo(const SoapArgs& sc, SoapData& data)
 	}
 
 	if (is_song) {
-		data.addarg("TrackMetaData", didlmake(mpds));
+		data.addarg("TrackMetaData", didl(mpds));
 	} else {
 		data.addarg("TrackMetaData", "");
 	}
@@ -785,7 +743,7 @@ int UpMpd::getMediaInfo(const SoapArgs& sc, SoapData& data)
 		data.addarg("CurrentURI", "");
 	}
 	if (is_song) {
-		data.addarg("CurrentURIMetaData", didlmake(mpds));
+		data.addarg("CurrentURIMetaData", didl(mpds));
 	} else {
 		data.addarg("CurrentURIMetaData", "");
 	}
@@ -957,194 +915,6 @@ int UpMpd::seek(const SoapArgs& sc, SoapData& data)
 	return m_mpdcli->seek(abs_seconds) ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
 }
 
-
-/////////////////////////////////////////////////////////////////////
-// Main program
-
-#include "conftree.hxx"
-
-static char *thisprog;
-
-static int op_flags;
-#define OPT_MOINS 0x1
-#define OPT_h	  0x2
-#define OPT_p	  0x4
-#define OPT_d	  0x8
-#define OPT_D     0x10
-#define OPT_c     0x20
-#define OPT_l     0x40
-#define OPT_f     0x80
-static const char usage[] = 
-"-c configfile \t configuration file to use\n"
-"-h host    \t specify host MPD is running on\n"
-"-p port     \t specify MPD port\n"
-"-d logfilename\t debug messages to\n"
-"-l loglevel\t  log level (0-6)\n"
-"-D          \t run as a daemon\n"
-"-f friendlyname\t define device displayed name\n"
-"  \n\n"
-			;
-static void
-Usage(void)
-{
-	fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
-	exit(1);
-}
-
-static string myDeviceUUID;
-
-static string datadir(DATADIR "/");
-static string configdir(CONFIGDIR "/");
-
-int main(int argc, char *argv[])
-{
-	string mpdhost("localhost");
-	int mpdport = 6600;
-//	string upnplogfilename("/tmp/upmpd_libupnp.log");
-	string logfilename;
-	int loglevel(upnppdebug::Logger::LLINF);
-	string configfile;
-	string friendlyname(dfltFriendlyName);
-
-	const char *cp;
-	if ((cp = getenv("UPMPD_HOST")))
-		mpdhost = cp;
-	if ((cp = getenv("UPMPD_PORT")))
-		mpdport = atoi(cp);
-	if ((cp = getenv("UPMPD_FRIENDLYNAME")))
-		friendlyname = atoi(cp);
-	if ((cp = getenv("UPMPD_CONFIG")))
-		configfile = cp;
-
-	thisprog = argv[0];
-	argc--; argv++;
-	while (argc > 0 && **argv == '-') {
-		(*argv)++;
-		if (!(**argv))
-			Usage();
-		while (**argv)
-			switch (*(*argv)++) {
-			case 'D':	op_flags |= OPT_D; break;
-			case 'c':	op_flags |= OPT_c; if (argc < 2)  Usage();
-				configfile = *(++argv); argc--; goto b1;
-			case 'f':	op_flags |= OPT_f; if (argc < 2)  Usage();
-				friendlyname = *(++argv); argc--; goto b1;
-			case 'd':	op_flags |= OPT_d; if (argc < 2)  Usage();
-				logfilename = *(++argv); argc--; goto b1;
-			case 'h':	op_flags |= OPT_h; if (argc < 2)  Usage();
-				mpdhost = *(++argv); argc--; goto b1;
-			case 'l':	op_flags |= OPT_l; if (argc < 2)  Usage();
-				loglevel = atoi(*(++argv)); argc--; goto b1;
-			case 'p':	op_flags |= OPT_p; if (argc < 2)  Usage();
-				mpdport = atoi(*(++argv)); argc--; goto b1;
-			default: Usage();	break;
-			}
-	b1: argc--; argv++;
-	}
-
-	if (argc != 0)
-		Usage();
-
-	if (!configfile.empty()) {
-		ConfSimple config(configfile.c_str(), 1, true);
-		if (!config.ok()) {
-			cerr << "Could not open config: " << configfile << endl;
-			return 1;
-		}
-		string value;
-		if (!(op_flags & OPT_d))
-			config.get("logfilename", logfilename);
-		if (!(op_flags & OPT_f))
-			config.get("friendlyname", friendlyname);
-		if (!(op_flags & OPT_l) && config.get("loglevel", value))
-			loglevel = atoi(value.c_str());
-		if (!(op_flags & OPT_h))
-			config.get("mpdhost", mpdhost);
-		if (!(op_flags & OPT_p) && config.get("mpdport", value)) {
-			mpdport = atoi(value.c_str());
-		}
-	}
-
-	if (upnppdebug::Logger::getTheLog(logfilename) == 0) {
-		cerr << "Can't initialize log" << endl;
-		return 1;
-	}
-	upnppdebug::Logger::getTheLog("")->setLogLevel(upnppdebug::Logger::LogLevel(loglevel));
-
-	if ((op_flags & OPT_D)) {
-		if (daemon(1, 0)) {
-			LOGFAT("Daemon failed: errno " << errno << endl);
-			return 1;
-		}
-	}
-
-	// Initialize libupnpp, and check health
-	LibUPnP *mylib = LibUPnP::getLibUPnP(true);
-	if (!mylib) {
-		LOGFAT("Can't get LibUPnP" << endl);
-		return 1;
-	}
-	if (!mylib->ok()) {
-		LOGFAT("Lib init failed: " <<
-			   mylib->errAsString("main", mylib->getInitError()) << endl);
-		return 1;
-	}
-	// mylib->setLogFileName(upnplogfilename, LibUPnP::LogLevelDebug);
-
-	// Initialize MPD client module
-	MPDCli mpdcli(mpdhost, mpdport);
-	if (!mpdcli.ok()) {
-		LOGFAT("MPD connection failed" << endl);
-		return 1;
-	}
-	
-	// Create unique ID
-	string UUID = LibUPnP::makeDevUUID(friendlyname);
-
-	// Read our XML data.
-	string reason;
-
-	string description;
-	string filename = datadir + "description.xml";
-	if (!file_to_string(filename, description, &reason)) {
-		LOGFAT("Failed reading " << filename << " : " << reason << endl);
-		return 1;
-	}
-	// Update device description with UUID and friendlyname
-    description = regsub1("@UUID@", description, UUID);
-    description = regsub1("@FRIENDLYNAME@", description, friendlyname);
-
-	string rdc_scdp;
-	filename = datadir + "RenderingControl.xml";
-	if (!file_to_string(filename, rdc_scdp, &reason)) {
-		LOGFAT("Failed reading " << filename << " : " << reason << endl);
-		return 1;
-	}
-
-	string avt_scdp;
-	filename = datadir + "AVTransport.xml";
-	if (!file_to_string(filename, avt_scdp, &reason)) {
-		LOGFAT("Failed reading " << filename << " : " << reason << endl);
-		return 1;
-	}
-
-	// List the XML files to be served through http (all will live in '/')
-	unordered_map<string, string> xmlfiles;
-	xmlfiles["description.xml"] = description;
-	xmlfiles["RenderingControl.xml"] = rdc_scdp;
-	xmlfiles["AVTransport.xml"] = avt_scdp;
-
-	// Initialize the UPnP device object.
-	UpMpd device(string("uuid:") + UUID, xmlfiles, &mpdcli);
-
-	LOGDEB("Entering event loop" << endl);
-
-	// And forever generate state change events.
-	device.eventloop();
-
-	return 0;
-}
-
 /* Local Variables: */
 /* mode: c++ */
 /* c-basic-offset: 4 */
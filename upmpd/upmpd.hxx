@@ -0,0 +1,108 @@
+/* Copyright (C) 2014 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _UPMPD_H_X_INCLUDED_
+#define _UPMPD_H_X_INCLUDED_
+
+#include <string>
+#include <unordered_map>
+#include <set>
+
+#include "libupnpp/upnpplib.hxx"
+#include "libupnpp/soaphelp.hxx"
+#include "libupnpp/device.hxx"
+
+class MPDCli;
+struct MpdStatus;
+class AlbumArt;
+
+// The UPnP MPD frontend device with its 2 services
+class UpMpd : public UpnpDevice {
+public:
+	UpMpd(const std::string& deviceid,
+		  const std::unordered_map<std::string, std::string>& xmlfiles,
+		  MPDCli *mpdcli, AlbumArt *art = 0);
+
+	// RenderingControl
+	int setMute(const SoapArgs& sc, SoapData& data);
+	int getMute(const SoapArgs& sc, SoapData& data);
+	int setVolume(const SoapArgs& sc, SoapData& data, bool isDb);
+	int getVolume(const SoapArgs& sc, SoapData& data, bool isDb);
+	int listPresets(const SoapArgs& sc, SoapData& data);
+	int selectPreset(const SoapArgs& sc, SoapData& data);
+//	int getVolumeDBRange(const SoapArgs& sc, SoapData& data);
+    virtual bool getEventDataRendering(bool all, EventBuf& buf);
+
+	// AVTransport
+	int setAVTransportURI(const SoapArgs& sc, SoapData& data, bool setnext);
+	int getPositionInfo(const SoapArgs& sc, SoapData& data);
+	int getTransportInfo(const SoapArgs& sc, SoapData& data);
+	int getMediaInfo(const SoapArgs& sc, SoapData& data);
+	int getDeviceCapabilities(const SoapArgs& sc, SoapData& data);
+	int setPlayMode(const SoapArgs& sc, SoapData& data);
+	int getTransportSettings(const SoapArgs& sc, SoapData& data);
+	int getCurrentTransportActions(const SoapArgs& sc, SoapData& data);
+	int playcontrol(const SoapArgs& sc, SoapData& data, int what);
+	int seek(const SoapArgs& sc, SoapData& data);
+	int seqcontrol(const SoapArgs& sc, SoapData& data, int what);
+    virtual bool getEventDataTransport(bool all, EventBuf& buf);
+
+	// Re-implemented from the base class and shared by both services
+    virtual bool getEventData(bool all, const std::string& serviceid, 
+							  EventBuf& buf);
+	// Required by the base class, not used
+	virtual bool getEventData(bool all, const std::string& serviceid,
+							  std::vector<std::string>& names, 
+							  std::vector<std::string>& values);
+
+private:
+	MPDCli *m_mpdcli;
+	AlbumArt *m_art;
+
+	// Song metadata, with the cover art if we have some
+	std::string didl(const MpdStatus& mpds, bool next = false);
+
+	// State variable storage. The "new" maps are only used inside
+	// the getEventDataXX methods, and swapped with the current state
+	// instead of being copied, so that the keys and values are reused
+	// from one poll to the next.
+	std::unordered_map<std::string, std::string> m_rdstate;
+	std::unordered_map<std::string, std::string> m_rdnewstate;
+	std::unordered_map<std::string, std::string> m_tpstate;
+	std::unordered_map<std::string, std::string> m_tpnewstate;
+
+	// Translate MPD state to Renderer state variables.
+	bool rdstateMToU(std::unordered_map<std::string, std::string>& state);
+	// Translate MPD state to AVTransport state variables.
+	bool tpstateMToU(std::unordered_map<std::string, std::string>& state);
+
+	// My track identifiers (for cleaning up)
+	std::set<int> m_songids;
+
+	// Desired volume target. We may delay executing small volume
+	// changes to avoid saturating with small requests.
+	int m_desiredvolume;
+
+};
+
+#endif /* _UPMPD_H_X_INCLUDED_ */
+/* Local Variables: */
+/* mode: c++ */
+/* c-basic-offset: 4 */
+/* tab-width: 4 */
+/* indent-tabs-mode: t */
+/* End: */
@@ -31,6 +31,8 @@
 #include <sstream>
 using namespace std;
 
+#include "libupnpp/soaphelp.hxx"
+
 #include "mpdcli.hxx"
 #include "upmpdutils.hxx"
 
@@ -172,22 +174,6 @@ void trimstring(string &s, const char *ws)
 	s.replace(pos+1, string::npos, string());
 }
 
-string xmlquote(const string& in)
-{
-    string out;
-    for (unsigned int i = 0; i < in.size(); i++) {
-        switch(in[i]) {
-        case '"': out += "&quot;";break;
-        case '&': out += "&amp;";break;
-        case '<': out += "&lt;";break;
-        case '>': out += "&gt;";break;
-        case '\'': out += "&apos;";break;
-        default: out += in[i];
-        }
-    }
-    return out;
-}
-
 // Translate 0-100% MPD volume to UPnP VolumeDB: we do db upnp-encoded
 // values from -10240 (0%) to 0 (100%)
 int percentodbvalue(int value)
@@ -253,48 +239,64 @@ const string& mapget(const unordered_map<string, string>& im, const string& k)
 
 // Bogus didl fragment maker. We probably don't need a full-blown XML
 // helper here
-string didlmake(const MpdStatus& mpds, bool next)
+string didlmake(const MpdStatus& mpds, bool next, const string& arturi)
 {
     const unordered_map<string, string>& songmap = 
         next? mpds.nextsong : mpds.currentsong;
-    ostringstream ss;
-    ss << "<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+    string out;
+    out.reserve(1024);
+    out += "<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
         "xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
         "xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" "
         "xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\">"
-       << "<item restricted=\"1\">";
+        "<item restricted=\"1\">";
 
     {   const string& val = mapget(songmap, "dc:title");
-        ss << "<dc:title>" << xmlquote(val) << "</dc:title>";
+        out += "<dc:title>";
+        xmlquote_append(out, val);
+        out += "</dc:title>";
     }
 	
     // TBD Playlists etc?
-    ss << "<upnp:class>object.item.audioItem.musicTrack</upnp:class>";
+    out += "<upnp:class>object.item.audioItem.musicTrack</upnp:class>";
 
     {   const string& val = mapget(songmap, "upnp:artist");
         if (!val.empty()) {
-            string a = xmlquote(val);
-            ss << "<dc:creator>" << a << "</dc:creator>" << 
-                "<upnp:artist>" << a << "</upnp:artist>";
+            out += "<dc:creator>";
+            xmlquote_append(out, val);
+            out += "</dc:creator><upnp:artist>";
+            xmlquote_append(out, val);
+            out += "</upnp:artist>";
         }
     }
 
     {   const string& val = mapget(songmap, "upnp:album");
         if (!val.empty()) {
-            ss << "<upnp:album>" << xmlquote(val) << "</upnp:album>";
+            out += "<upnp:album>";
+            xmlquote_append(out, val);
+            out += "</upnp:album>";
         }
     }
 
     {   const string& val = mapget(songmap, "upnp:genre");
         if (!val.empty()) {
-            ss << "<upnp:genre>" << xmlquote(val) << "</upnp:genre>";
+            out += "<upnp:genre>";
+            xmlquote_append(out, val);
+            out += "</upnp:genre>";
         }
     }
 
+    if (!arturi.empty()) {
+        out += "<upnp:albumArtURI>";
+        xmlquote_append(out, arturi);
+        out += "</upnp:albumArtURI>";
+    }
+
     {const string& val = mapget(songmap, "upnp:originalTrackNumber");
         if (!val.empty()) {
-            ss << "<upnp:originalTrackNumber>" << val << 
-                "</upnp:originalTrackNumber>";
+            out += "<upnp:originalTrackNumber>";
+            out += val;
+            out += "</upnp:originalTrackNumber>";
         }
     }
 
@@ -304,15 +306,16 @@ string didlmake(const MpdStatus& mpds, bool next)
     // set...  Bitrate keeps changing for VBRs and forces
     // events. Keeping it out for now
 
-    ss << "<res " << "duration=\"" << upnpduration(mpds.songlenms) << "\" "
-//       << "bitrate=\"" << mpds.kbrate << "\" "
-       << "sampleFrequency=\"44100\" audioChannels=\"2\" "
-       << "protocolInfo=\"http-get:*:audio/mpeg:DLNA.ORG_PN=MP3;DLNA.ORG_OP=01;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=01700000000000000000000000000000\""
-       << ">"
-       << xmlquote(mapget(songmap, "uri")) 
-       << "</res>"
-       << "</item></DIDL-Lite>";
-    return ss.str();
+    out += "<res duration=\"";
+    out += upnpduration(mpds.songlenms);
+    out += "\" "
+//        "bitrate=\"" << mpds.kbrate << "\" "
+        "sampleFrequency=\"44100\" audioChannels=\"2\" "
+        "protocolInfo=\"http-get:*:audio/mpeg:DLNA.ORG_PN=MP3;DLNA.ORG_OP=01;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=01700000000000000000000000000000\""
+        ">";
+    xmlquote_append(out, mapget(songmap, "uri"));
+    out += "</res></item></DIDL-Lite>";
+    return out;
 }
 
 // Substitute regular expression
@@ -33,9 +33,6 @@ extern void trimstring(string &s, const char *ws = " \t");
 extern string path_tildexpand(const string &s);
 
 
-// Escape XML special chars.
-extern std::string xmlquote(const std::string& in);
-
 // Convert between db value to percent values (Get/Set Volume and VolumeDb)
 extern int percentodbvalue(int value);
 extern int dbvaluetopercent(int dbvalue);
@@ -53,9 +50,11 @@ extern const std::string& mapget(
     const std::unordered_map<std::string, std::string>& im, 
     const std::string& k);
 
-// Format a didl fragment from MPD status data
+// Format a didl fragment from MPD status data. arturi is the album
+// art URI if any.
 class MpdStatus;
-extern std::string didlmake(const MpdStatus& mpds, bool next = false);
+extern std::string didlmake(const MpdStatus& mpds, bool next = false,
+                            const std::string& arturi = std::string());
 
 // Replace the first occurrence of regexp. cxx11 regex does not work
 // that well yet...